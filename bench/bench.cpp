@@ -0,0 +1,513 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "ve_offload.h"
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config {
+    size_t max_contexts = 4;
+    // The stencil grid is grid x grid interior points
+    size_t grid = 512;
+    size_t steps = 100;
+    size_t gemm_n = 256;
+    size_t gemm_k = 32;
+    size_t reduce_n = 1 << 20;
+};
+
+static double seconds_since(bench_clock::time_point start)
+{
+    return std::chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+class bench_env
+{
+    uint64_t handle;
+
+public:
+    struct veo_proc_handle *proc;
+    std::vector<struct veo_thr_ctxt *> ctxs;
+
+    uint64_t stencil_step;
+    uint64_t gemm_panel;
+    uint64_t reduce_sum;
+
+    explicit bench_env(size_t num_contexts)
+    {
+        proc = veo_proc_create(0);
+        if (proc == NULL) {
+            fprintf(stderr, "Cannot create proc\n");
+            exit(1);
+        }
+
+        handle = veo_load_library(proc, "./libvebench.so");
+        stencil_step = veo_get_sym(proc, handle, "stencil_step");
+        gemm_panel = veo_get_sym(proc, handle, "gemm_panel");
+        reduce_sum = veo_get_sym(proc, handle, "reduce_sum");
+
+        for (size_t i = 0; i < num_contexts; i++) {
+            ctxs.push_back(veo_context_open(proc));
+        }
+    }
+
+    ~bench_env()
+    {
+        for (auto ctx : ctxs) {
+            veo_context_close(ctx);
+        }
+        veo_unload_library(proc, handle);
+        veo_proc_destroy(proc);
+    }
+
+    uint64_t alloc(size_t size)
+    {
+        uint64_t addr;
+        if (veo_alloc_mem(proc, &addr, size) != 0) {
+            fprintf(stderr, "Cannot allocate %zu bytes\n", size);
+            exit(1);
+        }
+        return addr;
+    }
+};
+
+static uint64_t wait(struct veo_thr_ctxt *ctx, uint64_t reqid)
+{
+    uint64_t retval = 0;
+
+    if (reqid == VEO_REQUEST_ID_INVALID ||
+        veo_call_wait_result(ctx, reqid, &retval) != VEO_COMMAND_OK) {
+        fprintf(stderr, "Request %llu failed\n",
+                static_cast<unsigned long long>(reqid));
+        exit(1);
+    }
+
+    return retval;
+}
+
+static uint64_t call_async(struct veo_thr_ctxt *ctx, uint64_t sym,
+                           std::initializer_list<uint64_t> args)
+{
+    struct veo_args *argp = veo_args_alloc();
+
+    int i = 0;
+    for (uint64_t arg : args) {
+        veo_args_set_u64(argp, i++, arg);
+    }
+
+    uint64_t reqid = veo_call_async(ctx, sym, argp);
+    veo_args_free(argp);
+
+    return reqid;
+}
+
+// Grid of (n + 2) x (n + 2) points including the fixed boundary
+static std::vector<double> initial_grid(size_t n)
+{
+    const size_t nx = n + 2;
+    std::vector<double> g(nx * nx, 0.0);
+
+    for (size_t j = 0; j < nx; j++) {
+        g[j] = 1.0;
+    }
+    for (size_t i = 1; i <= n; i++) {
+        for (size_t j = 1; j <= n; j++) {
+            g[i * nx + j] = ((i * 7 + j * 13) % 17) / 17.0;
+        }
+    }
+
+    return g;
+}
+
+static std::vector<double> host_stencil(size_t n, size_t steps)
+{
+    const size_t nx = n + 2;
+    std::vector<double> g = initial_grid(n), tmp = g;
+
+    for (size_t s = 0; s < steps; s++) {
+        for (size_t i = 1; i <= n; i++) {
+            for (size_t j = 1; j <= n; j++) {
+                const double *row = &g[i * nx];
+                tmp[i * nx + j] = 0.25 * (row[j - nx] + row[j + nx] +
+                                          row[j - 1] + row[j + 1]);
+            }
+        }
+        std::swap(g, tmp);
+    }
+
+    return g;
+}
+
+// 2D Jacobi stencil decomposed into horizontal strips, one per context. Halo
+// rows are written before and boundary rows are read back after each step.
+static double run_stencil(bench_env &env, size_t num_ctxs,
+                          const bench_config &config,
+                          const std::vector<double> &expected, bool &ok)
+{
+    const size_t n = config.grid, nx = n + 2;
+    const size_t row_bytes = nx * sizeof(double);
+    std::vector<double> g = initial_grid(n);
+
+    struct strip {
+        size_t r0, r1;
+        uint64_t bufs[2];
+        std::vector<double> top, bottom;
+    };
+    std::vector<strip> strips(num_ctxs);
+
+    // Strip p owns the rows [r0, r1) of the grid, and its buffers hold rows
+    // [r0 - 1, r1] including the halos
+    for (size_t p = 0; p < num_ctxs; p++) {
+        strip &st = strips[p];
+        st.r0 = 1 + n * p / num_ctxs;
+        st.r1 = 1 + n * (p + 1) / num_ctxs;
+        st.top.resize(nx);
+        st.bottom.resize(nx);
+
+        for (auto &buf : st.bufs) {
+            buf = env.alloc((st.r1 - st.r0 + 2) * row_bytes);
+            veo_write_mem(env.proc, buf, &g[(st.r0 - 1) * nx],
+                          (st.r1 - st.r0 + 2) * row_bytes);
+        }
+    }
+
+    const auto start = bench_clock::now();
+
+    for (size_t s = 0; s < config.steps; s++) {
+        std::vector<uint64_t> reqids;
+
+        for (size_t p = 0; p < num_ctxs; p++) {
+            strip &st = strips[p];
+            struct veo_thr_ctxt *ctx = env.ctxs[p];
+            const size_t rows = st.r1 - st.r0;
+            const uint64_t in = st.bufs[s % 2], out = st.bufs[(s + 1) % 2];
+
+            reqids.push_back(veo_async_write_mem(
+                ctx, in, &g[(st.r0 - 1) * nx], row_bytes));
+            reqids.push_back(veo_async_write_mem(
+                ctx, in + (rows + 1) * row_bytes, &g[st.r1 * nx], row_bytes));
+            reqids.push_back(
+                call_async(ctx, env.stencil_step, {in, out, nx, rows + 2}));
+            reqids.push_back(veo_async_read_mem(ctx, st.top.data(),
+                                                out + row_bytes, row_bytes));
+            reqids.push_back(veo_async_read_mem(
+                ctx, st.bottom.data(), out + rows * row_bytes, row_bytes));
+        }
+
+        for (size_t i = 0; i < reqids.size(); i++) {
+            wait(env.ctxs[i / 5], reqids[i]);
+        }
+
+        // Exchange the boundary rows once all strips finished the step
+        for (const auto &st : strips) {
+            std::copy(st.top.begin(), st.top.end(), &g[st.r0 * nx]);
+            std::copy(st.bottom.begin(), st.bottom.end(),
+                      &g[(st.r1 - 1) * nx]);
+        }
+    }
+
+    const double elapsed = seconds_since(start);
+
+    for (const auto &st : strips) {
+        veo_read_mem(env.proc, &g[st.r0 * nx],
+                     st.bufs[config.steps % 2] + row_bytes,
+                     (st.r1 - st.r0) * row_bytes);
+        for (auto buf : st.bufs) {
+            veo_free_mem(env.proc, buf);
+        }
+    }
+
+    ok = true;
+    for (size_t i = 0; i < g.size(); i++) {
+        if (std::abs(g[i] - expected[i]) > 1e-12) {
+            ok = false;
+            break;
+        }
+    }
+
+    return elapsed;
+}
+
+struct gemm_result {
+    double serial;
+    double transfer;
+    double compute;
+    double pipelined;
+    bool ok;
+};
+
+// Blocked GEMM where panels of A and B are streamed to the VE. The serial
+// run waits for every request, while the pipelined run transfers the next
+// panels on a second context during the current panel's compute.
+static gemm_result run_gemm(bench_env &env, const bench_config &config)
+{
+    const size_t n = config.gemm_n, k = config.gemm_k, nb = n / k;
+    const size_t panel_bytes = n * k * sizeof(double);
+    gemm_result r = {};
+
+    std::vector<double> a(n * n), b(n * n), c(n * n), expected(n * n, 0.0);
+    for (size_t i = 0; i < n * n; i++) {
+        a[i] = (i % 11) / 11.0;
+        b[i] = (i % 7) / 7.0;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        for (size_t p = 0; p < n; p++) {
+            for (size_t j = 0; j < n; j++) {
+                expected[i * n + j] += a[i * n + p] * b[p * n + j];
+            }
+        }
+    }
+
+    // Pack column panels of A. Row panels of B are already contiguous.
+    std::vector<std::vector<double>> a_panels(nb, std::vector<double>(n * k));
+    for (size_t kb = 0; kb < nb; kb++) {
+        for (size_t i = 0; i < n; i++) {
+            std::copy_n(&a[i * n + kb * k], k, &a_panels[kb][i * k]);
+        }
+    }
+
+    const uint64_t c_buf = env.alloc(n * n * sizeof(double));
+    uint64_t a_bufs[2], b_bufs[2];
+    for (int i = 0; i < 2; i++) {
+        a_bufs[i] = env.alloc(panel_bytes);
+        b_bufs[i] = env.alloc(panel_bytes);
+    }
+
+    auto write_panels = [&](struct veo_thr_ctxt *ctx, size_t kb) {
+        return std::make_pair(
+            veo_async_write_mem(ctx, a_bufs[kb % 2], a_panels[kb].data(),
+                                panel_bytes),
+            veo_async_write_mem(ctx, b_bufs[kb % 2], &b[kb * k * n],
+                                panel_bytes));
+    };
+    auto compute = [&](struct veo_thr_ctxt *ctx, size_t kb) {
+        return call_async(ctx, env.gemm_panel,
+                          {a_bufs[kb % 2], b_bufs[kb % 2], c_buf, n, k});
+    };
+
+    for (int pipelined = 0; pipelined < 2; pipelined++) {
+        std::fill(c.begin(), c.end(), 0.0);
+        veo_write_mem(env.proc, c_buf, c.data(), c.size() * sizeof(double));
+
+        struct veo_thr_ctxt *compute_ctx = env.ctxs[0];
+        struct veo_thr_ctxt *copy_ctx = env.ctxs[pipelined ? 1 : 0];
+
+        const auto start = bench_clock::now();
+
+        if (!pipelined) {
+            for (size_t kb = 0; kb < nb; kb++) {
+                auto t0 = bench_clock::now();
+                auto w = write_panels(copy_ctx, kb);
+                wait(copy_ctx, w.first);
+                wait(copy_ctx, w.second);
+                r.transfer += seconds_since(t0);
+
+                auto t1 = bench_clock::now();
+                wait(compute_ctx, compute(compute_ctx, kb));
+                r.compute += seconds_since(t1);
+            }
+            r.serial = seconds_since(start);
+        } else {
+            std::vector<uint64_t> calls(nb);
+            auto w = write_panels(copy_ctx, 0);
+
+            for (size_t kb = 0; kb < nb; kb++) {
+                wait(copy_ctx, w.first);
+                wait(copy_ctx, w.second);
+                calls[kb] = compute(compute_ctx, kb);
+
+                // The next panels go to the slot of the previous compute
+                if (kb + 1 < nb) {
+                    if (kb > 0) wait(compute_ctx, calls[kb - 1]);
+                    w = write_panels(copy_ctx, kb + 1);
+                }
+            }
+
+            if (nb > 1) wait(compute_ctx, calls[nb - 2]);
+            wait(compute_ctx, calls[nb - 1]);
+            r.pipelined = seconds_since(start);
+        }
+
+        veo_read_mem(env.proc, c.data(), c_buf, c.size() * sizeof(double));
+
+        r.ok = true;
+        for (size_t i = 0; i < c.size(); i++) {
+            if (std::abs(c[i] - expected[i]) > 1e-9 * std::abs(expected[i])) {
+                r.ok = false;
+                break;
+            }
+        }
+        if (!r.ok) break;
+    }
+
+    veo_free_mem(env.proc, c_buf);
+    for (int i = 0; i < 2; i++) {
+        veo_free_mem(env.proc, a_bufs[i]);
+        veo_free_mem(env.proc, b_bufs[i]);
+    }
+
+    return r;
+}
+
+// Sum of an array split into one chunk per context
+static double run_reduce(bench_env &env, size_t num_ctxs,
+                         const std::vector<double> &x, double expected,
+                         bool &ok)
+{
+    std::vector<uint64_t> bufs(num_ctxs), writes(num_ctxs), calls(num_ctxs);
+    std::vector<size_t> offsets(num_ctxs + 1);
+
+    for (size_t p = 0; p <= num_ctxs; p++) {
+        offsets[p] = x.size() * p / num_ctxs;
+    }
+    for (size_t p = 0; p < num_ctxs; p++) {
+        bufs[p] = env.alloc((offsets[p + 1] - offsets[p]) * sizeof(double));
+    }
+
+    const auto start = bench_clock::now();
+
+    for (size_t p = 0; p < num_ctxs; p++) {
+        const size_t len = offsets[p + 1] - offsets[p];
+        writes[p] = veo_async_write_mem(env.ctxs[p], bufs[p], &x[offsets[p]],
+                                        len * sizeof(double));
+        calls[p] = call_async(env.ctxs[p], env.reduce_sum, {bufs[p], len});
+    }
+
+    double sum = 0;
+    for (size_t p = 0; p < num_ctxs; p++) {
+        wait(env.ctxs[p], writes[p]);
+        uint64_t bits = wait(env.ctxs[p], calls[p]);
+
+        double partial;
+        std::memcpy(&partial, &bits, sizeof(partial));
+        sum += partial;
+    }
+
+    const double elapsed = seconds_since(start);
+
+    for (auto buf : bufs) {
+        veo_free_mem(env.proc, buf);
+    }
+
+    ok = std::abs(sum - expected) <= 1e-9 * std::abs(expected);
+    return elapsed;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [--contexts N] [--grid N] [--steps N] [--gemm-n N] "
+            "[--gemm-k N] [--reduce-n N]\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_config config;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        const std::string opt = argv[i];
+        const size_t val = std::max(1L, std::atol(argv[++i]));
+
+        if (opt == "--contexts") {
+            config.max_contexts = val;
+        } else if (opt == "--grid") {
+            config.grid = val;
+        } else if (opt == "--steps") {
+            config.steps = val;
+        } else if (opt == "--gemm-n") {
+            config.gemm_n = val;
+        } else if (opt == "--gemm-k") {
+            config.gemm_k = val;
+        } else if (opt == "--reduce-n") {
+            config.reduce_n = val;
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.gemm_n % config.gemm_k != 0) {
+        fprintf(stderr, "--gemm-n must be a multiple of --gemm-k\n");
+        return 1;
+    }
+
+    // The pipelined GEMM needs a second context
+    bench_env env(std::max<size_t>(config.max_contexts, 2));
+    bool all_ok = true;
+
+    std::vector<size_t> scales;
+    for (size_t c = 1; c <= config.max_contexts; c *= 2) {
+        scales.push_back(c);
+    }
+
+    printf("stencil: %zu x %zu grid, %zu steps\n", config.grid, config.grid,
+           config.steps);
+    printf("%10s %12s %12s %10s %6s\n", "contexts", "time_s", "steps/s",
+           "speedup", "ok");
+
+    const auto stencil_expected = host_stencil(config.grid, config.steps);
+    double stencil_base = 0;
+
+    for (size_t c : scales) {
+        bool ok;
+        double t = run_stencil(env, c, config, stencil_expected, ok);
+        if (c == 1) stencil_base = t;
+
+        printf("%10zu %12.4f %12.1f %10.2f %6s\n", c, t, config.steps / t,
+               stencil_base / t, ok ? "yes" : "no");
+        all_ok &= ok;
+    }
+
+    printf("\ngemm: n = %zu, panel width %zu\n", config.gemm_n,
+           config.gemm_k);
+    printf("%12s %12s %12s %12s %10s %6s\n", "serial_s", "transfer_s",
+           "compute_s", "pipelined_s", "overlap", "ok");
+
+    gemm_result g = run_gemm(env, config);
+    // Fraction of the shorter phase hidden behind the longer one
+    double overlap = (g.serial - g.pipelined) /
+                     std::max(std::min(g.transfer, g.compute), 1e-12);
+
+    printf("%12.4f %12.4f %12.4f %12.4f %9.0f%% %6s\n", g.serial, g.transfer,
+           g.compute, g.pipelined,
+           100 * std::min(std::max(overlap, 0.0), 1.0), g.ok ? "yes" : "no");
+    all_ok &= g.ok;
+
+    printf("\nreduce: %zu doubles\n", config.reduce_n);
+    printf("%10s %12s %12s %10s %6s\n", "contexts", "time_s", "MB/s",
+           "speedup", "ok");
+
+    std::vector<double> x(config.reduce_n);
+    double reduce_expected = 0;
+    for (size_t i = 0; i < x.size(); i++) {
+        x[i] = (i % 101) / 101.0;
+        reduce_expected += x[i];
+    }
+
+    double reduce_base = 0;
+    for (size_t c : scales) {
+        bool ok;
+        double t = run_reduce(env, c, x, reduce_expected, ok);
+        if (c == 1) reduce_base = t;
+
+        printf("%10zu %12.4f %12.2f %10.2f %6s\n", c, t,
+               x.size() * sizeof(double) / t / 1e6, reduce_base / t,
+               ok ? "yes" : "no");
+        all_ok &= ok;
+    }
+
+    return all_ok ? 0 : 1;
+}
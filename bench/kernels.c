@@ -0,0 +1,53 @@
+#include <stdint.h>
+#include <string.h>
+
+// One Jacobi sweep of a 5-point stencil over the interior of an ny x nx
+// grid. The first and last rows are halos and are not updated.
+uint64_t stencil_step(const double *in, double *out, uint64_t nx, uint64_t ny)
+{
+    for (uint64_t i = 1; i + 1 < ny; i++) {
+        const double *row = in + i * nx;
+
+        out[i * nx] = row[0];
+        out[i * nx + nx - 1] = row[nx - 1];
+
+        for (uint64_t j = 1; j + 1 < nx; j++) {
+            out[i * nx + j] =
+                0.25 * (row[j - nx] + row[j + nx] + row[j - 1] + row[j + 1]);
+        }
+    }
+
+    return 0;
+}
+
+// c += a * b, where a is an n x k panel, b is a k x n panel and c is n x n.
+// All matrices are row-major.
+uint64_t gemm_panel(const double *a, const double *b, double *c, uint64_t n,
+                    uint64_t k)
+{
+    for (uint64_t i = 0; i < n; i++) {
+        for (uint64_t p = 0; p < k; p++) {
+            const double aip = a[i * k + p];
+
+            for (uint64_t j = 0; j < n; j++) {
+                c[i * n + j] += aip * b[p * n + j];
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Sum of an array. The bits of the double are returned as an integer.
+uint64_t reduce_sum(const double *x, uint64_t n)
+{
+    double sum = 0;
+    uint64_t bits;
+
+    for (uint64_t i = 0; i < n; i++) {
+        sum += x[i];
+    }
+
+    memcpy(&bits, &sum, sizeof(bits));
+    return bits;
+}
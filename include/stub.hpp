@@ -1,22 +1,66 @@
 #ifndef __STUB_HPP__
 #define __STUB_HPP__
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cerrno>
 #include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
 #include <mutex>
-#include <queue>
+#include <poll.h>
+#include <string>
+#include <sys/mman.h>
 #include <thread>
+#include <tuple>
+#include <type_traits>
+#include <time.h>
 #include <unistd.h>
 #include <unordered_map>
 #include <variant>
 #include <vector>
 
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#endif
+
 #include <nlohmann/json.hpp>
+#include <spdlog/spdlog.h>
 
 #include "ve_offload.h"
 
 using json = nlohmann::json;
 
+// Log at debug level. The arguments (e.g. a dump of a whole message) are
+// only evaluated if debug logging is enabled at runtime, and the statement is
+// compiled out if SPDLOG_ACTIVE_LEVEL is above debug. If binary tracing is
+// enabled, the call site and its integer arguments are also recorded in the
+// trace without formatting.
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define VS_DEBUG(fmt, ...)                                                     \
+    do {                                                                       \
+        if (tracer.enabled()) {                                                \
+            tracer.log(fmt, [&] { return std::make_tuple(__VA_ARGS__); });     \
+        }                                                                      \
+        if (spdlog::should_log(spdlog::level::debug)) {                        \
+            spdlog::debug(fmt, ##__VA_ARGS__);                                 \
+        }                                                                      \
+    } while (0)
+#else
+#define VS_DEBUG(...) (void)0
+#endif
+
 enum veo_stubs_cmd {
     VS_CMD_LOAD_LIBRARY,
     VS_CMD_UNLOAD_LIBRARY,
@@ -27,12 +71,26 @@ enum veo_stubs_cmd {
     VS_CMD_WRITE_MEM,
     VS_CMD_CALL_ASYNC,
     VS_CMD_CALL_ASYNC_BY_NAME,
+    VS_CMD_CALL_ASYNC_PACKED,
+    VS_CMD_CALL_ASYNC_BATCH,
+    VS_CMD_CALL_ASYNC_BATCH_BY_NAME,
     VS_CMD_ASYNC_READ_MEM,
     VS_CMD_ASYNC_WRITE_MEM,
+    VS_CMD_WRITE_MEM_FROM_FILE,
+    VS_CMD_READ_MEM_TO_FILE,
+    VS_CMD_GRAPH_CREATE,
+    VS_CMD_GRAPH_LAUNCH,
+    VS_CMD_GRAPH_DESTROY,
     VS_CMD_OPEN_CONTEXT,
     VS_CMD_CLOSE_CONTEXT,
     VS_CMD_SYNC_CONTEXT,
     VS_CMD_QUIT,
+    // Recordings and traces store commands as numbers, so new commands are
+    // only ever appended
+    VS_CMD_GET_MEM_USAGE,
+    VS_CMD_CHECKPOINT,
+    VS_CMD_RESTORE,
+    VS_CMD_GET_SYMS,
 };
 
 enum veo_stubs_arg_type {
@@ -49,20 +107,108 @@ enum veo_stubs_arg_type {
     VS_ARG_TYPE_STACK,
 };
 
+// Name of a command for diagnostics. Negative values denote results.
+inline const char *cmd_name(int16_t cmd)
+{
+    if (cmd < 0) {
+        return "RESULT";
+    }
+
+    switch (static_cast<veo_stubs_cmd>(cmd)) {
+    case VS_CMD_LOAD_LIBRARY:
+        return "LOAD_LIBRARY";
+    case VS_CMD_UNLOAD_LIBRARY:
+        return "UNLOAD_LIBRARY";
+    case VS_CMD_GET_SYM:
+        return "GET_SYM";
+    case VS_CMD_ALLOC_MEM:
+        return "ALLOC_MEM";
+    case VS_CMD_FREE_MEM:
+        return "FREE_MEM";
+    case VS_CMD_READ_MEM:
+        return "READ_MEM";
+    case VS_CMD_WRITE_MEM:
+        return "WRITE_MEM";
+    case VS_CMD_CALL_ASYNC:
+        return "CALL_ASYNC";
+    case VS_CMD_CALL_ASYNC_BY_NAME:
+        return "CALL_ASYNC_BY_NAME";
+    case VS_CMD_CALL_ASYNC_PACKED:
+        return "CALL_ASYNC_PACKED";
+    case VS_CMD_CALL_ASYNC_BATCH:
+        return "CALL_ASYNC_BATCH";
+    case VS_CMD_CALL_ASYNC_BATCH_BY_NAME:
+        return "CALL_ASYNC_BATCH_BY_NAME";
+    case VS_CMD_ASYNC_READ_MEM:
+        return "ASYNC_READ_MEM";
+    case VS_CMD_ASYNC_WRITE_MEM:
+        return "ASYNC_WRITE_MEM";
+    case VS_CMD_WRITE_MEM_FROM_FILE:
+        return "WRITE_MEM_FROM_FILE";
+    case VS_CMD_READ_MEM_TO_FILE:
+        return "READ_MEM_TO_FILE";
+    case VS_CMD_GRAPH_CREATE:
+        return "GRAPH_CREATE";
+    case VS_CMD_GRAPH_LAUNCH:
+        return "GRAPH_LAUNCH";
+    case VS_CMD_GRAPH_DESTROY:
+        return "GRAPH_DESTROY";
+    case VS_CMD_OPEN_CONTEXT:
+        return "OPEN_CONTEXT";
+    case VS_CMD_CLOSE_CONTEXT:
+        return "CLOSE_CONTEXT";
+    case VS_CMD_SYNC_CONTEXT:
+        return "SYNC_CONTEXT";
+    case VS_CMD_QUIT:
+        return "QUIT";
+    case VS_CMD_GET_MEM_USAGE:
+        return "GET_MEM_USAGE";
+    case VS_CMD_CHECKPOINT:
+        return "CHECKPOINT";
+    case VS_CMD_RESTORE:
+        return "RESTORE";
+    case VS_CMD_GET_SYMS:
+        return "GET_SYMS";
+    }
+
+    return "UNKNOWN";
+}
+
+enum veo_stubs_graph_node_type {
+    VS_GRAPH_NODE_WRITE_MEM,
+    VS_GRAPH_NODE_CALL,
+    VS_GRAPH_NODE_READ_MEM,
+};
+
 struct veo_proc_handle {
     int32_t venode;
     pid_t pid;
 
-    struct veo_thr_ctxt *default_context;
+    struct veo_thr_ctxt *default_context = NULL;
     std::vector<veo_thr_ctxt *> contexts;
 
+    // The default context while it is being opened in the background
+    std::shared_future<struct veo_thr_ctxt *> pending_context;
+    std::once_flag create_flag;
+
+    // Libraries loaded by stub-veorun at startup (VEO_STUBS_PRELOAD) by name,
+    // and symbols resolved in them by (handle, name)
+    std::unordered_map<std::string, uint64_t> preloaded_libs;
+    std::map<std::pair<uint64_t, std::string>, uint64_t> preloaded_syms;
+
+    // Addresses from a restored checkpoint. Library handles and symbols are
+    // translated exactly, buffers by range (old start -> new start, size).
+    std::unordered_map<uint64_t, uint64_t> restored_handles;
+    std::map<uint64_t, std::pair<uint64_t, uint64_t>> restored_bufs;
+    std::mutex restored_mtx;
+
     veo_proc_handle(int32_t venode, pid_t pid) : venode(venode), pid(pid) {}
 };
 
 // A single-producer, single-consumer queue
 template <typename T> class blocking_queue
 {
-    std::queue<T> queue;
+    std::deque<T> queue;
     std::mutex mtx;
     std::condition_variable cv_item;
     std::condition_variable cv_empty;
@@ -73,54 +219,934 @@ public:
     {
         std::lock_guard<std::mutex> lock(mtx);
 
-        queue.push(item);
-        cv_item.notify_one();
+        queue.push_back(item);
+        cv_item.notify_one();
+    }
+
+    // Blocking pop an item
+    void wait_pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_item.wait(lock, [&] { return !queue.empty(); });
+
+        item = queue.front();
+        queue.pop_front();
+
+        if (queue.empty()) {
+            cv_empty.notify_one();
+        }
+    }
+
+    // Remove the first item satisfying pred. Returns false if there is none.
+    template <typename Pred> bool remove_if(Pred pred, T &item)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        const auto it = std::find_if(queue.begin(), queue.end(), pred);
+
+        if (it == queue.end()) {
+            return false;
+        }
+
+        item = *it;
+        queue.erase(it);
+
+        if (queue.empty()) {
+            cv_empty.notify_one();
+        }
+
+        return true;
+    }
+
+    // Block until the queue becomes empty
+    void wait_empty()
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_empty.wait(lock, [&] { return queue.empty(); });
+    }
+};
+
+// A work-stealing thread pool. Each worker thread owns a deque. Tasks are
+// distributed round-robin, and an idle worker steals from the back of the
+// other workers' deques.
+class thread_pool
+{
+    struct worker_queue {
+        std::deque<std::function<void()>> tasks;
+        std::mutex mtx;
+    };
+
+    std::vector<std::unique_ptr<worker_queue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next_queue;
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    size_t pending = 0;
+    bool stopping = false;
+
+    bool try_pop(size_t idx, std::function<void()> &task)
+    {
+        for (size_t i = 0; i < queues.size(); i++) {
+            worker_queue &q = *queues[(idx + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mtx);
+
+            if (q.tasks.empty()) continue;
+
+            if (i == 0) {
+                task = std::move(q.tasks.front());
+                q.tasks.pop_front();
+            } else {
+                task = std::move(q.tasks.back());
+                q.tasks.pop_back();
+            }
+
+            return true;
+        }
+
+        return false;
+    }
+
+    void run(size_t idx)
+    {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                cv.wait(lock, [&] { return pending > 0 || stopping; });
+
+                if (pending == 0) {
+                    return;
+                }
+
+                pending--;
+            }
+
+            // A task is guaranteed to be in one of the queues
+            std::function<void()> task;
+            while (!try_pop(idx, task)) {
+                std::this_thread::yield();
+            }
+
+            task();
+        }
+    }
+
+public:
+    explicit thread_pool(size_t num_threads) : next_queue(0)
+    {
+        num_threads = std::max(num_threads, static_cast<size_t>(1));
+
+        for (size_t i = 0; i < num_threads; i++) {
+            queues.emplace_back(new worker_queue);
+        }
+        for (size_t i = 0; i < num_threads; i++) {
+            threads.emplace_back(&thread_pool::run, this, i);
+        }
+    }
+
+    // Finish all submitted tasks and join the worker threads
+    ~thread_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv.notify_all();
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+    }
+
+    size_t size() const { return threads.size(); }
+
+    // Add worker threads until there are at least num_threads. New workers
+    // share the existing queues.
+    void grow(size_t num_threads)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        while (threads.size() < num_threads) {
+            threads.emplace_back(&thread_pool::run, this,
+                                 threads.size() % queues.size());
+        }
+    }
+
+    void submit(std::function<void()> task)
+    {
+        worker_queue &q = *queues[next_queue++ % queues.size()];
+
+        {
+            std::lock_guard<std::mutex> lock(q.mtx);
+            q.tasks.push_back(std::move(task));
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            pending++;
+        }
+        cv.notify_one();
+    }
+};
+
+// Counts completions across all contexts so that a thread can wait for
+// results from multiple contexts at once
+struct completion_notifier {
+    std::mutex mtx;
+    std::condition_variable cv;
+    uint64_t generation = 0;
+
+    uint64_t current()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        return generation;
+    }
+
+    void notify()
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        generation++;
+        cv.notify_all();
+    }
+
+    // Block until a completion happens after current() returned generation
+    void wait_change(uint64_t gen)
+    {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv.wait(lock, [&] { return generation != gen; });
+    }
+};
+
+static completion_notifier completions;
+
+#ifdef __linux__
+// Shared-memory transport. Each direction is a single-producer,
+// single-consumer byte stream that carries the same length-prefixed msgpack
+// frames as the socket. Both ends spin for a while before sleeping on a
+// futex. The socket stays open and is only used to detect a dead peer.
+struct shm_ring {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    // Futex words, bumped when the other side may be sleeping
+    alignas(64) std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> consumer_waiting;
+    std::atomic<uint32_t> closed;
+    alignas(64) std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> producer_waiting;
+};
+
+struct shm_header {
+    alignas(64) uint64_t capacity;
+};
+
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+static int futex_wait(std::atomic<uint32_t> &word, uint32_t val,
+                      const struct timespec *timeout)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+                   val, timeout, NULL, 0);
+}
+
+static int futex_wake(std::atomic<uint32_t> &word)
+{
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+                   INT32_MAX, NULL, NULL, 0);
+}
+
+// Returns false if the peer has closed its end of the socket
+static bool peer_alive(int sock)
+{
+    struct pollfd pfd = {sock, POLLIN, 0};
+    if (poll(&pfd, 1, 0) <= 0) {
+        return true;
+    }
+    if (pfd.revents & (POLLHUP | POLLERR)) {
+        return false;
+    }
+
+    char c;
+    return recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) != 0;
+}
+
+class shm_channel
+{
+    shm_ring *ring = NULL;
+    uint8_t *data = NULL;
+    uint64_t capacity = 0;
+    int peer_sock = -1;
+    int spin = 0;
+
+    static void notify(std::atomic<uint32_t> &seq,
+                       std::atomic<uint32_t> &waiting)
+    {
+        if (waiting.load()) {
+            seq.fetch_add(1);
+            futex_wake(seq);
+        }
+    }
+
+    // Spin, then sleep on the futex until ready() holds. Wakes up
+    // periodically to check that the peer is still alive.
+    template <typename Pred>
+    bool wait(std::atomic<uint32_t> &seq, std::atomic<uint32_t> &waiting,
+              Pred ready)
+    {
+        for (int i = 0; i < spin; i++) {
+            if (ready()) {
+                return true;
+            }
+            cpu_relax();
+        }
+
+        const struct timespec timeout = {0, 100 * 1000 * 1000};
+
+        while (true) {
+            waiting.store(1);
+            uint32_t val = seq.load();
+            if (ready()) {
+                waiting.store(0);
+                return true;
+            }
+            futex_wait(seq, val, &timeout);
+            waiting.store(0);
+
+            if (ready()) {
+                return true;
+            }
+            if (!peer_alive(peer_sock)) {
+                return false;
+            }
+        }
+    }
+
+public:
+    shm_channel() = default;
+
+    shm_channel(shm_ring *ring, uint8_t *data, uint64_t capacity, int peer_sock,
+                int spin)
+        : ring(ring), data(data), capacity(capacity), peer_sock(peer_sock),
+          spin(spin)
+    {
+    }
+
+    bool write(const uint8_t *buf, size_t count)
+    {
+        while (count > 0) {
+            uint64_t head = ring->head.load(std::memory_order_relaxed);
+
+            if (!wait(ring->space_seq, ring->producer_waiting, [&] {
+                    return head - ring->tail.load() < capacity;
+                })) {
+                return false;
+            }
+
+            uint64_t used = head - ring->tail.load();
+            uint64_t n = std::min<uint64_t>(count, capacity - used);
+            uint64_t off = head % capacity;
+            uint64_t first = std::min(n, capacity - off);
+
+            memcpy(data + off, buf, first);
+            memcpy(data, buf + first, n - first);
+            ring->head.store(head + n);
+            notify(ring->data_seq, ring->consumer_waiting);
+
+            buf += n;
+            count -= n;
+        }
+
+        return true;
+    }
+
+    bool read(uint8_t *buf, size_t count)
+    {
+        while (count > 0) {
+            uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+
+            if (!wait(ring->data_seq, ring->consumer_waiting, [&] {
+                    return ring->head.load() != tail || ring->closed.load();
+                })) {
+                return false;
+            }
+
+            uint64_t n = std::min<uint64_t>(count, ring->head.load() - tail);
+            if (n == 0) {
+                return false;
+            }
+
+            uint64_t off = tail % capacity;
+            uint64_t first = std::min(n, capacity - off);
+
+            memcpy(buf, data + off, first);
+            memcpy(buf + first, data, n - first);
+            ring->tail.store(tail + n);
+            notify(ring->space_seq, ring->producer_waiting);
+
+            buf += n;
+            count -= n;
+        }
+
+        return true;
+    }
+
+    // Tell the consumer that nothing more will be written
+    void close()
+    {
+        ring->closed.store(1);
+        ring->data_seq.fetch_add(1);
+        futex_wake(ring->data_seq);
+    }
+};
+
+// A shared mapping holding two rings. Ring 0 carries requests from VH to VE
+// and ring 1 carries replies from VE to VH.
+class shm_transport
+{
+    void *base = MAP_FAILED;
+    size_t length = 0;
+
+    static size_t ring_offset(uint64_t capacity, int i)
+    {
+        return sizeof(shm_header) + i * (sizeof(shm_ring) + capacity);
+    }
+
+    // Spinning only helps if the peer can run at the same time
+    static int spin_count()
+    {
+        const char *env = getenv("VEO_STUBS_SHM_SPIN");
+        if (env) {
+            return atoi(env);
+        }
+        return std::thread::hardware_concurrency() > 1 ? 4000 : 0;
+    }
+
+    void setup(uint64_t capacity, int sock, bool is_vh)
+    {
+        uint8_t *p = static_cast<uint8_t *>(base);
+        shm_ring *rings[2];
+        uint8_t *bufs[2];
+
+        for (int i = 0; i < 2; i++) {
+            rings[i] =
+                reinterpret_cast<shm_ring *>(p + ring_offset(capacity, i));
+            bufs[i] = reinterpret_cast<uint8_t *>(rings[i] + 1);
+        }
+
+        int spin = spin_count();
+        int out = is_vh ? 0 : 1;
+
+        tx = shm_channel(rings[out], bufs[out], capacity, sock, spin);
+        rx = shm_channel(rings[1 - out], bufs[1 - out], capacity, sock, spin);
+    }
+
+public:
+    shm_channel tx;
+    shm_channel rx;
+
+    ~shm_transport()
+    {
+        if (base != MAP_FAILED) {
+            munmap(base, length);
+        }
+    }
+
+    // Create and map a new shared memory file (VH side)
+    bool create(const std::string &path, uint64_t capacity, int sock)
+    {
+        int fd =
+            open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (fd == -1) {
+            return false;
+        }
+
+        // Keep the second ring cache line aligned
+        capacity = (capacity + 63) & ~static_cast<uint64_t>(63);
+        length = ring_offset(capacity, 2);
+        if (ftruncate(fd, length) == -1) {
+            close(fd);
+            unlink(path.c_str());
+            return false;
+        }
+
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            unlink(path.c_str());
+            return false;
+        }
+
+        // The file is zero-filled, so the rings start out empty
+        static_cast<shm_header *>(base)->capacity = capacity;
+        setup(capacity, sock, true);
+
+        return true;
+    }
+
+    // Map a file created by the peer (VE side)
+    bool attach(const std::string &path, int sock)
+    {
+        int fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+        if (fd == -1) {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == -1 ||
+            static_cast<size_t>(st.st_size) < sizeof(shm_header)) {
+            close(fd);
+            return false;
+        }
+
+        length = st.st_size;
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (base == MAP_FAILED) {
+            return false;
+        }
+
+        uint64_t capacity = static_cast<shm_header *>(base)->capacity;
+        if (capacity == 0 || ring_offset(capacity, 2) != length) {
+            return false;
+        }
+        setup(capacity, sock, false);
+
+        return true;
+    }
+};
+#endif
+
+// Parse a size with an optional K, M or G suffix
+inline uint64_t parse_size(const std::string &str)
+{
+    size_t pos = 0;
+    uint64_t size = std::stoull(str, &pos);
+
+    switch (pos < str.size() ? std::toupper(str[pos]) : 0) {
+    case 'G':
+        size <<= 10;
+        // fall through
+    case 'M':
+        size <<= 10;
+        // fall through
+    case 'K':
+        size <<= 10;
+        break;
+    }
+
+    return size;
+}
+
+// FNV-1a hash of a buffer. Pass the hash of preceding bytes to hash data in
+// several pieces.
+inline uint64_t hash_bytes(const uint8_t *buf, size_t len,
+                           uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+// Records the requests submitted by libveo and their results to a file that
+// can be replayed with veo-replay. The file starts with a magic string,
+// followed by records each consisting of a 32-bit length and a msgpack
+// object. Payloads are replaced by their length and hash.
+class request_recorder
+{
+    int fd = -1;
+    std::mutex mtx;
+    std::chrono::steady_clock::time_point start;
+    // Contexts may be reallocated at the same address, so IDs are assigned
+    // until a context is closed
+    std::unordered_map<const void *, uint64_t> ctx_ids;
+    uint64_t next_ctx_id = 0;
+
+    uint64_t ctx_id(const void *ctx)
+    {
+        auto it = ctx_ids.find(ctx);
+        if (it == ctx_ids.end()) {
+            it = ctx_ids.emplace(ctx, next_ctx_id++).first;
+        }
+
+        return it->second;
+    }
+
+    uint64_t elapsed_ns() const
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    }
+
+    static void strip_payloads(json &req)
+    {
+        if (req.contains("data")) {
+            std::vector<uint8_t> data = req["data"];
+            req["data"] = {{"len", data.size()},
+                           {"hash", hash_bytes(data.data(), data.size())}};
+        }
+
+        // Data to copy in is still in VH memory when a request is submitted.
+        // Only the rows of a strided copy are hashed, not the gaps between
+        // them.
+        if (req.contains("copy_in")) {
+            for (auto &desc : req["copy_in"]) {
+                const uint8_t *ptr =
+                    reinterpret_cast<uint8_t *>(desc["vh_ptr"].get<uint64_t>());
+                const uint64_t len = desc["len"].get<uint64_t>();
+                const uint64_t width = desc.value("width", 0ULL);
+                const uint64_t pitch = desc.value("vh_pitch", 0ULL);
+
+                if (width == 0 || width == pitch) {
+                    desc["hash"] = hash_bytes(ptr, len);
+                    continue;
+                }
+
+                uint64_t hash = hash_bytes(ptr, 0);
+                for (uint64_t offset = 0; offset < len;
+                     offset += width, ptr += pitch) {
+                    hash = hash_bytes(ptr, width, hash);
+                }
+                desc["hash"] = hash;
+            }
+        }
+
+        if (req.contains("calls")) {
+            for (auto &call : req["calls"]) {
+                strip_payloads(call);
+            }
+        }
+    }
+
+    void write_record(const json &rec)
+    {
+        std::vector<uint8_t> buf = json::to_msgpack(rec);
+        uint32_t size = buf.size();
+
+        if (::write(fd, &size, sizeof(size)) != sizeof(size) ||
+            ::write(fd, buf.data(), size) != static_cast<ssize_t>(size)) {
+            spdlog::warn("Failed to write request record");
+        }
+    }
+
+public:
+    static constexpr char MAGIC[8] = {'V', 'S', 'R', 'E', 'C', '0', '0', '1'};
+
+    ~request_recorder()
+    {
+        if (fd != -1) close(fd);
+    }
+
+    bool enabled() const { return fd != -1; }
+
+    // Start recording if VEO_STUBS_RECORD is set to a file path
+    void open_from_env()
+    {
+        const char *path = getenv("VEO_STUBS_RECORD");
+        if (path == NULL) return;
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1 || ::write(fd, MAGIC, sizeof(MAGIC)) != sizeof(MAGIC)) {
+            spdlog::warn("Cannot record requests to {}", path);
+            if (fd != -1) close(fd);
+            fd = -1;
+            return;
+        }
+
+        start = std::chrono::steady_clock::now();
+    }
+
+    void record_submit(const void *ctx, pid_t pid, int32_t venode,
+                       bool is_default, bool unordered, const json &req)
+    {
+        json stripped = req;
+        strip_payloads(stripped);
+
+        std::lock_guard<std::mutex> lock(mtx);
+
+        write_record({{"t", elapsed_ns()},
+                      {"type", "submit"},
+                      {"pid", pid},
+                      {"venode", venode},
+                      {"ctx", ctx_id(ctx)},
+                      {"default", is_default},
+                      {"unordered", unordered},
+                      {"req", stripped}});
+
+        if (req["cmd"] == VS_CMD_CLOSE_CONTEXT || req["cmd"] == VS_CMD_QUIT) {
+            ctx_ids.erase(ctx);
+        }
+    }
+
+    void record_result(const void *ctx, const json &res)
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+
+        write_record({{"t", elapsed_ns()},
+                      {"type", "result"},
+                      {"ctx", ctx_id(ctx)},
+                      {"reqid", res["reqid"]},
+                      {"result", res.value("result", json(0))}});
+    }
+};
+
+static request_recorder recorder;
+
+// Limits on the requests of a context that were submitted but have not
+// completed yet. Zero means unlimited.
+struct queue_limits {
+    uint64_t max_requests = 0;
+    uint64_t max_bytes = 0;
+    // Fail instead of blocking when a limit is reached
+    bool nonblock = false;
+
+    // Defaults for all contexts
+    static queue_limits from_env()
+    {
+        queue_limits limits;
+
+        try {
+            if (const char *env = getenv("VEO_STUBS_MAX_INFLIGHT")) {
+                limits.max_requests = std::stoull(env);
+            }
+            if (const char *env = getenv("VEO_STUBS_MAX_INFLIGHT_BYTES")) {
+                limits.max_bytes = parse_size(env);
+            }
+        } catch (const std::exception &) {
+            spdlog::warn("Invalid VEO_STUBS_MAX_INFLIGHT(_BYTES) value");
+        }
+
+        const char *mode = getenv("VEO_STUBS_BACKPRESSURE");
+        limits.nonblock = mode != NULL && std::string(mode) == "fail";
+
+        return limits;
+    }
+};
+
+// Bytes of data carried by a request or by its result
+inline uint64_t payload_bytes(const json &req)
+{
+    uint64_t bytes = 0;
+
+    for (const char *key : {"copy_in", "copy_out"}) {
+        if (req.contains(key)) {
+            for (const auto &desc : req[key]) {
+                bytes += desc["len"].get<uint64_t>();
+            }
+        }
+    }
+
+    if (req.contains("data")) {
+        bytes += req["data"].is_binary() ? req["data"].get_binary().size()
+                                         : req["data"].size();
+    }
+    if (req.value("cmd", -1) == VS_CMD_READ_MEM) {
+        bytes += req["size"].get<uint64_t>();
+    }
+
+    if (req.contains("calls")) {
+        for (const auto &call : req["calls"]) {
+            bytes += payload_bytes(call);
+        }
+    }
+
+    return bytes;
+}
+
+struct veo_thr_ctxt_attr {
+    size_t stacksize = 0;
+    bool unordered = false;
+    bool has_limits = false;
+    queue_limits limits;
+};
+
+struct veo_thr_ctxt {
+    struct veo_proc_handle *proc;
+
+    int sock;
+    std::thread comm_thread;
+    std::atomic<bool> is_running;
+
+    // Requests may complete out of order. Results are received by
+    // recv_thread while comm_thread keeps sending requests.
+    bool unordered = false;
+    std::thread recv_thread;
+    std::atomic<bool> is_closing{false};
+
+    blocking_queue<json> requests;
+    std::atomic<uint64_t> num_reqs;
+
+    // Latest virtual time reported by the VE timing model
+    std::atomic<uint64_t> vtime{0};
+
+    std::unordered_map<uint64_t, json> results;
+    std::mutex results_mtx;
+    std::condition_variable results_cv;
+
+    // Requests counted against the limits and their payload bytes
+    queue_limits limits;
+    std::unordered_map<uint64_t, uint64_t> inflight;
+    uint64_t inflight_bytes = 0;
+    std::mutex inflight_mtx;
+    std::condition_variable inflight_cv;
+
+    // Graphs instantiated on this context, detached when it is closed
+    std::vector<struct veo_graph *> graphs;
+
+    // Becomes readable when a result arrives. Created on first use.
+    int event_fd = -1;
+    int event_wfd = -1;
+
+#ifdef __linux__
+    // Set if messages are exchanged over shared memory instead of sock
+    std::unique_ptr<shm_transport> shm;
+#endif
+
+    veo_thr_ctxt(struct veo_proc_handle *proc, int sock)
+        : proc(proc), sock(sock), num_reqs(0), is_running(true)
+    {
+    }
+
+    ~veo_thr_ctxt()
+    {
+        close(sock);
+        if (event_fd != -1) close(event_fd);
+        if (event_wfd != -1 && event_wfd != event_fd) close(event_wfd);
+    }
+
+    int get_event_fd()
+    {
+        std::lock_guard<std::mutex> lock(results_mtx);
+
+        if (event_fd != -1) {
+            return event_fd;
+        }
+
+#ifdef __linux__
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        event_wfd = event_fd;
+#else
+        int fds[2];
+        if (pipe(fds) == 0) {
+            for (int fd : fds) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                fcntl(fd, F_SETFD, FD_CLOEXEC);
+            }
+            event_fd = fds[0];
+            event_wfd = fds[1];
+        }
+#endif
+
+        // Results that arrived before the fd was created are also signaled
+        if (event_fd != -1 && (!results.empty() || !is_running)) {
+            signal_event();
+        }
+
+        return event_fd;
     }
 
-    // Blocking pop an item
-    void wait_pop(T &item)
+    // Must be called with results_mtx held
+    void signal_event()
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        cv_item.wait(lock, [&] { return !queue.empty(); });
-
-        item = queue.front();
-        queue.pop();
+        if (event_wfd == -1) {
+            return;
+        }
 
-        if (queue.empty()) {
-            cv_empty.notify_one();
+        uint64_t val = 1;
+        if (write(event_wfd, &val, sizeof(val)) == -1) {
+            // The counter is already signaled, which is fine
         }
     }
 
-    // Block until the queue becomes empty
-    void wait_empty()
+    uint64_t issue_reqid() { return num_reqs++; }
+
+    // Count a request against the limits. Blocks until it fits, or fails
+    // with EAGAIN if nonblocking and may_fail are set. A request always fits
+    // if nothing else is in flight.
+    bool reserve(const json &request, bool may_fail)
     {
-        std::unique_lock<std::mutex> lock(mtx);
-        cv_empty.wait(lock, [&] { return queue.empty(); });
-    }
-};
+        if (limits.max_requests == 0 && limits.max_bytes == 0) {
+            return true;
+        }
 
-struct veo_thr_ctxt {
-    struct veo_proc_handle *proc;
+        std::vector<uint64_t> reqids;
+        if (request.contains("calls")) {
+            for (const auto &call : request["calls"]) {
+                reqids.push_back(call["reqid"]);
+            }
+        } else {
+            reqids.push_back(request["reqid"]);
+        }
 
-    int sock;
-    std::thread comm_thread;
-    std::atomic<bool> is_running;
+        const uint64_t bytes = payload_bytes(request);
 
-    blocking_queue<json> requests;
-    std::atomic<uint64_t> num_reqs;
+        std::unique_lock<std::mutex> lock(inflight_mtx);
 
-    std::unordered_map<uint64_t, json> results;
-    std::mutex results_mtx;
-    std::condition_variable results_cv;
+        auto fits = [&] {
+            return !is_running || inflight.empty() ||
+                   ((limits.max_requests == 0 ||
+                     inflight.size() + reqids.size() <= limits.max_requests) &&
+                    (limits.max_bytes == 0 ||
+                     inflight_bytes + bytes <= limits.max_bytes));
+        };
 
-    veo_thr_ctxt(struct veo_proc_handle *proc, int sock)
-        : proc(proc), sock(sock), num_reqs(0), is_running(true)
+        if (!fits()) {
+            if (may_fail && limits.nonblock) {
+                errno = EAGAIN;
+                return false;
+            }
+            inflight_cv.wait(lock, fits);
+        }
+
+        // The bytes of a batch are released with its first call
+        for (size_t i = 0; i < reqids.size(); i++) {
+            inflight[reqids[i]] = i == 0 ? bytes : 0;
+        }
+        inflight_bytes += bytes;
+
+        return true;
+    }
+
+    void release(uint64_t reqid)
     {
+        std::lock_guard<std::mutex> lock(inflight_mtx);
+
+        const auto it = inflight.find(reqid);
+        if (it == inflight.end()) {
+            return;
+        }
+
+        inflight_bytes -= it->second;
+        inflight.erase(it);
+        inflight_cv.notify_all();
     }
 
-    uint64_t issue_reqid() { return num_reqs++; }
+    // Returns false if the request was rejected by the limits
+    bool submit_request(json request, bool may_fail = false)
+    {
+        if (!reserve(request, may_fail)) {
+            return false;
+        }
+
+        if (recorder.enabled()) {
+            recorder.record_submit(this, proc->pid, proc->venode,
+                                   this == proc->default_context, unordered,
+                                   request);
+        }
+
+        requests.push(request);
 
-    void submit_request(json request) { requests.push(request); }
+        return true;
+    }
 
     bool wait_result(uint64_t reqid, json &result)
     {
@@ -141,6 +1167,75 @@ struct veo_thr_ctxt {
         return true;
     }
 
+    // Same as wait_result, but gives up after timeout. Returns false and
+    // sets timed_out if the result did not arrive in time.
+    bool wait_result_for(uint64_t reqid, std::chrono::microseconds timeout,
+                         json &result, bool &timed_out)
+    {
+        std::unique_lock<std::mutex> lock(results_mtx);
+
+        timed_out = !results_cv.wait_for(lock, timeout, [=] {
+            return results.find(reqid) != results.end() || !is_running;
+        });
+
+        if (results.find(reqid) == results.end()) {
+            return false;
+        }
+
+        result = results.at(reqid);
+        results.erase(reqid);
+
+        return true;
+    }
+
+    // Withdraw a request that has not been sent to the VE yet. A waiter for
+    // the request receives a result marked as cancelled. Cancelling a call
+    // in a batch withdraws the whole batch.
+    bool cancel_request(uint64_t reqid)
+    {
+        json req;
+        bool removed = requests.remove_if(
+            [=](const json &r) {
+                if (r.contains("calls")) {
+                    for (const auto &call : r["calls"]) {
+                        if (call["reqid"] == reqid) return true;
+                    }
+                    return false;
+                }
+                return r["reqid"] == reqid;
+            },
+            req);
+
+        if (!removed) {
+            return false;
+        }
+
+        for (const auto &call :
+             req.contains("calls") ? req["calls"] : json::array({req})) {
+            uint64_t id = call["reqid"];
+            store_result(id,
+                         {{"result", 0}, {"reqid", id}, {"cancelled", true}});
+        }
+
+        return true;
+    }
+
+    // Store a result and wake up everyone waiting for it
+    void store_result(uint64_t reqid, const json &result)
+    {
+        release(reqid);
+
+        {
+            std::lock_guard<std::mutex> lock(results_mtx);
+
+            results.insert({reqid, result});
+            signal_event();
+            results_cv.notify_all();
+        }
+
+        completions.notify();
+    }
+
     bool peek_result(uint64_t reqid, json &result)
     {
         std::lock_guard<std::mutex> lock(results_mtx);
@@ -159,8 +1254,45 @@ struct veo_thr_ctxt {
 struct copy_descriptor {
     uint8_t *ve_ptr;
     uint8_t *vh_ptr;
+    // Total number of bytes to copy
     size_t len;
     std::vector<uint8_t> data;
+    // A strided copy moves rows of width bytes that start every ve_pitch
+    // bytes on the VE and every vh_pitch bytes on the VH. The rows are
+    // packed in data. A width of zero means a contiguous copy.
+    size_t width = 0;
+    size_t ve_pitch = 0;
+    size_t vh_pitch = 0;
+
+    // Pack the rows starting at src into data
+    void gather(const uint8_t *src, size_t pitch)
+    {
+        data.resize(len);
+
+        if (width == 0 || width == pitch) {
+            std::copy(src, src + len, data.begin());
+            return;
+        }
+
+        for (size_t offset = 0; offset < len; offset += width, src += pitch) {
+            std::copy(src, src + width, data.begin() + offset);
+        }
+    }
+
+    // Unpack data into the rows starting at dst
+    void scatter(uint8_t *dst, size_t pitch) const
+    {
+        if (width == 0 || width == pitch) {
+            std::copy(data.begin(), data.end(), dst);
+            return;
+        }
+
+        for (size_t offset = 0; offset < data.size();
+             offset += width, dst += pitch) {
+            std::copy(data.begin() + offset, data.begin() + offset + width,
+                      dst);
+        }
+    }
 };
 
 void to_json(json &j, const copy_descriptor &arg)
@@ -169,6 +1301,12 @@ void to_json(json &j, const copy_descriptor &arg)
     j["vh_ptr"] = reinterpret_cast<uint64_t>(arg.vh_ptr);
     j["len"] = arg.len;
     j["data"] = arg.data;
+
+    if (arg.width != 0) {
+        j["width"] = arg.width;
+        j["ve_pitch"] = arg.ve_pitch;
+        j["vh_pitch"] = arg.vh_pitch;
+    }
 }
 
 void from_json(const json &j, copy_descriptor &arg)
@@ -177,6 +1315,9 @@ void from_json(const json &j, copy_descriptor &arg)
     arg.vh_ptr = reinterpret_cast<uint8_t *>(j["vh_ptr"].get<uint64_t>());
     arg.len = j["len"].get<uint64_t>();
     arg.data = j["data"].get<std::vector<uint8_t>>();
+    arg.width = j.value("width", size_t(0));
+    arg.ve_pitch = j.value("ve_pitch", size_t(0));
+    arg.vh_pitch = j.value("vh_pitch", size_t(0));
 }
 
 struct stack_arg {
@@ -205,114 +1346,430 @@ struct veo_arg {
         val;
 };
 
+// Arguments are encoded as an array of type tags and an array of 64-bit
+// words holding each value in its low bytes. The encoding is cached and only
+// the slots changed since the last call are re-encoded.
 struct veo_args {
     std::vector<veo_arg> args;
+
+    mutable std::vector<uint8_t> types;
+    mutable std::vector<uint8_t> vals;
+    // Stack arguments and their copy descriptors, rebuilt when any stack
+    // argument changes
+    mutable json stack = json::array();
+    mutable json copy_in = json::array();
+    mutable json copy_out = json::array();
+
+    mutable std::vector<uint8_t> is_dirty;
+    mutable std::vector<uint32_t> dirty;
+    mutable bool stack_dirty = false;
+
+    // Serializes encode() so that the same arguments can be submitted from
+    // several threads at once. A copy gets a mutex of its own.
+    struct copyable_mutex : std::mutex {
+        copyable_mutex() = default;
+        copyable_mutex(const copyable_mutex &) {}
+        copyable_mutex &operator=(const copyable_mutex &) { return *this; }
+    };
+    mutable copyable_mutex encode_mtx;
+
+    void mark_dirty(size_t argnum)
+    {
+        if (!is_dirty[argnum]) {
+            is_dirty[argnum] = 1;
+            dirty.push_back(argnum);
+        }
+    }
+
+    void resize(size_t n)
+    {
+        size_t old = args.size();
+
+        args.resize(n);
+        types.resize(n);
+        vals.resize(n * sizeof(uint64_t));
+        is_dirty.resize(n);
+
+        for (size_t i = old; i < n; i++) {
+            mark_dirty(i);
+        }
+    }
+
+    void clear()
+    {
+        args.clear();
+        types.clear();
+        vals.clear();
+        is_dirty.clear();
+        dirty.clear();
+        stack_dirty = true;
+    }
+
+    // Bring the cached encoding up to date. The cache is only read after
+    // this returns, and only rewritten if arguments have been set since.
+    void encode() const
+    {
+        std::lock_guard<std::mutex> lock(encode_mtx);
+
+        for (uint32_t i : dirty) {
+            const auto &val = args[i].val;
+            uint64_t word = 0;
+
+            std::visit(
+                [&](const auto &v) {
+                    if constexpr (std::is_same_v<std::decay_t<decltype(v)>,
+                                                 stack_arg>) {
+                        word = reinterpret_cast<uint64_t>(v.buff);
+                    } else {
+                        std::memcpy(&word, &v, sizeof(v));
+                    }
+                },
+                val);
+
+            types[i] = val.index();
+            std::memcpy(&vals[i * sizeof(uint64_t)], &word, sizeof(word));
+            is_dirty[i] = 0;
+        }
+        dirty.clear();
+
+        if (stack_dirty) {
+            encode_stack();
+        }
+    }
+
+private:
+    void encode_stack() const
+    {
+        stack = json::array();
+        copy_in = json::array();
+        copy_out = json::array();
+
+        for (const auto &arg : args) {
+            if (arg.val.index() != VS_ARG_TYPE_STACK) continue;
+            const stack_arg &sa = std::get<stack_arg>(arg.val);
+            const copy_descriptor desc{
+                NULL, reinterpret_cast<uint8_t *>(sa.buff), sa.len};
+
+            stack.push_back(sa);
+
+            if (sa.inout == VEO_INTENT_IN || sa.inout == VEO_INTENT_INOUT) {
+                copy_in.push_back(desc);
+            }
+            if (sa.inout == VEO_INTENT_OUT || sa.inout == VEO_INTENT_INOUT) {
+                copy_out.push_back(desc);
+            }
+        }
+
+        stack_dirty = false;
+    }
 };
 
 void to_json(json &j, const veo_args &argp)
 {
-    j = json::array();
-
-    for (const auto &arg : argp.args) {
-        json e = {{"type", arg.val.index()}};
+    argp.encode();
 
-        switch (arg.val.index()) {
-        case VS_ARG_TYPE_I64:
-            e["val"] = std::get<VS_ARG_TYPE_I64>(arg.val);
-            break;
-        case VS_ARG_TYPE_U64:
-            e["val"] = std::get<VS_ARG_TYPE_U64>(arg.val);
-            break;
-        case VS_ARG_TYPE_I32:
-            e["val"] = std::get<VS_ARG_TYPE_I32>(arg.val);
-            break;
-        case VS_ARG_TYPE_U32:
-            e["val"] = std::get<VS_ARG_TYPE_U32>(arg.val);
-            break;
-        case VS_ARG_TYPE_I16:
-            e["val"] = std::get<VS_ARG_TYPE_I16>(arg.val);
-            break;
-        case VS_ARG_TYPE_U16:
-            e["val"] = std::get<VS_ARG_TYPE_U16>(arg.val);
-            break;
-        case VS_ARG_TYPE_I8:
-            e["val"] = std::get<VS_ARG_TYPE_I8>(arg.val);
-            break;
-        case VS_ARG_TYPE_U8:
-            e["val"] = std::get<VS_ARG_TYPE_I8>(arg.val);
-            break;
-        case VS_ARG_TYPE_DOUBLE:
-            e["val"] = std::get<VS_ARG_TYPE_DOUBLE>(arg.val);
-            break;
-        case VS_ARG_TYPE_FLOAT:
-            e["val"] = std::get<VS_ARG_TYPE_FLOAT>(arg.val);
-            break;
-        case VS_ARG_TYPE_STACK:
-            e["val"] = std::get<VS_ARG_TYPE_STACK>(arg.val);
-            break;
-        }
+    j = {{"types", json::binary(argp.types)},
+         {"vals", json::binary(argp.vals)}};
 
-        j.push_back(e);
+    if (!argp.stack.empty()) {
+        j["stack"] = argp.stack;
     }
 }
 
+template <typename T> T decode_arg(const uint8_t *word)
+{
+    T val;
+    std::memcpy(&val, word, sizeof(val));
+    return val;
+}
+
 void from_json(const json &j, veo_args &argp)
 {
-    for (const auto &e : j) {
-        veo_arg arg;
+    const auto &types = j["types"].get_binary();
+    const auto &vals = j["vals"].get_binary();
+    size_t num_stack = 0;
+
+    argp.args.resize(types.size());
+
+    for (size_t i = 0; i < types.size(); i++) {
+        const uint8_t *word = &vals[i * sizeof(uint64_t)];
+        auto &val = argp.args[i].val;
 
-        switch (e["type"].get<int32_t>()) {
+        switch (types[i]) {
         case VS_ARG_TYPE_I64:
-            arg.val = e["val"].get<int64_t>();
+            val = decode_arg<int64_t>(word);
             break;
         case VS_ARG_TYPE_U64:
-            arg.val = e["val"].get<uint64_t>();
+            val = decode_arg<uint64_t>(word);
             break;
         case VS_ARG_TYPE_I32:
-            arg.val = e["val"].get<int32_t>();
+            val = decode_arg<int32_t>(word);
             break;
         case VS_ARG_TYPE_U32:
-            arg.val = e["val"].get<uint64_t>();
+            val = decode_arg<uint32_t>(word);
             break;
         case VS_ARG_TYPE_I16:
-            arg.val = e["val"].get<int16_t>();
+            val = decode_arg<int16_t>(word);
             break;
         case VS_ARG_TYPE_U16:
-            arg.val = e["val"].get<uint64_t>();
+            val = decode_arg<uint16_t>(word);
             break;
         case VS_ARG_TYPE_I8:
-            arg.val = e["val"].get<int8_t>();
+            val = decode_arg<int8_t>(word);
             break;
         case VS_ARG_TYPE_U8:
-            arg.val = e["val"].get<uint8_t>();
+            val = decode_arg<uint8_t>(word);
             break;
         case VS_ARG_TYPE_DOUBLE:
-            arg.val = e["val"].get<double>();
+            val = decode_arg<double>(word);
             break;
         case VS_ARG_TYPE_FLOAT:
-            arg.val = e["val"].get<float>();
+            val = decode_arg<float>(word);
             break;
         case VS_ARG_TYPE_STACK:
-            arg.val = e["val"].get<stack_arg>();
+            val = j["stack"][num_stack++].get<stack_arg>();
             break;
         }
-
-        argp.args.push_back(arg);
     }
 }
 
+struct graph_node {
+    veo_stubs_graph_node_type type;
+    uint64_t ve_ptr;
+    uint8_t *vh_ptr;
+    size_t len;
+    uint64_t addr;
+    veo_args args;
+    // Arguments have changed since the graph was last sent to the VE
+    bool dirty;
+};
+
+// A recorded sequence of operations that can be replayed with a single
+// request. The graph is kept resident in stub-veorun once instantiated.
+struct veo_graph {
+    std::vector<graph_node> nodes;
+    struct veo_thr_ctxt *ctx = NULL;
+    uint64_t id = 0;
+};
+
 template <typename T> int veo_args_set(struct veo_args *ca, int argnum, T val)
 {
-    ca->args.resize(std::max(ca->args.size(), static_cast<size_t>(argnum + 1)));
-    ca->args[argnum].val = val;
+    ca->resize(std::max(ca->args.size(), static_cast<size_t>(argnum + 1)));
+
+    auto &arg = ca->args[argnum];
+    if (std::is_same_v<T, stack_arg> || arg.val.index() == VS_ARG_TYPE_STACK) {
+        ca->stack_dirty = true;
+    }
+
+    arg.val = val;
+    ca->mark_dirty(argnum);
 
     return 0;
 }
 
+enum veo_stubs_trace_event {
+    VS_TRACE_SEND,
+    VS_TRACE_RECV,
+    VS_TRACE_LOG,
+};
+
+// A fixed-size record in a binary trace. A VS_TRACE_LOG record stores the ID
+// of a VS_DEBUG call site in cmd and up to two of its arguments in reqid and
+// size.
+struct trace_record {
+    uint64_t timestamp; // CLOCK_MONOTONIC in ns, comparable across processes
+    uint64_t reqid;
+    uint64_t size; // Size of the message in bytes
+    uint32_t tid;
+    uint16_t event;
+    int16_t cmd; // -1 for results
+};
+
+// Whether all elements of a tuple can be stored in a trace record
+template <typename T> struct trace_args_integral;
+template <typename... Ts>
+struct trace_args_integral<std::tuple<Ts...>>
+    : std::bool_constant<((std::is_integral<Ts>::value ||
+                           std::is_enum<Ts>::value) &&
+                          ...)> {
+};
+
+struct trace_header {
+    char magic[8];
+    uint32_t pid;
+    uint32_t reserved;
+    uint64_t capacity; // Number of records
+    std::atomic<uint64_t> head; // Total number of records ever written
+};
+
+static const char TRACE_MAGIC[8] = {'V', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+
+// A lock-free ring buffer of trace records backed by a memory-mapped file.
+// Records survive a crash of the process and are decoded offline by
+// veo-trace. Recording costs a few stores per message.
+class trace_ring
+{
+    trace_header *header = NULL;
+    trace_record *records = NULL;
+    // Call sites are listed in dir/veo-trace.<pid>.fmt as "id nargs format"
+    int sites_fd = -1;
+    std::atomic<int16_t> num_sites{0};
+
+    void append(uint16_t event, int16_t cmd, uint64_t reqid, uint64_t size)
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        trace_record &rec =
+            records[header->head.fetch_add(1) % header->capacity];
+
+        rec.timestamp = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+        rec.reqid = reqid;
+        rec.size = size;
+        rec.tid = static_cast<uint32_t>(
+            std::hash<std::thread::id>()(std::this_thread::get_id()));
+        rec.event = event;
+        rec.cmd = cmd;
+    }
+
+    int16_t add_site(const char *fmt, size_t nargs)
+    {
+        const int16_t id = num_sites++;
+        const std::string line = std::to_string(id) + " " +
+                                 std::to_string(nargs) + " " + fmt + "\n";
+
+        if (write(sites_fd, line.data(), line.size()) !=
+            static_cast<ssize_t>(line.size())) {
+            spdlog::warn("Cannot record trace call site {}", fmt);
+        }
+
+        return id;
+    }
+
+public:
+    bool enabled() const { return header != NULL; }
+
+    // Start tracing to dir/veo-trace.<pid>.bin if VEO_STUBS_TRACE_DIR is set
+    void open_from_env()
+    {
+        const char *dir = getenv("VEO_STUBS_TRACE_DIR");
+
+        if (dir == NULL) {
+            return;
+        }
+
+        const char *capacity_env = getenv("VEO_STUBS_TRACE_RECORDS");
+        uint64_t capacity = 1 << 16;
+
+        if (capacity_env != NULL) {
+            char *end;
+            errno = 0;
+            uint64_t value = strtoull(capacity_env, &end, 10);
+
+            // The ring needs at least one record and must fit in memory
+            if (end == capacity_env || *end != '\0' || errno == ERANGE ||
+                value == 0 ||
+                value > (SIZE_MAX - sizeof(trace_header)) /
+                            sizeof(trace_record)) {
+                spdlog::warn("Invalid VEO_STUBS_TRACE_RECORDS {}, using {}",
+                             capacity_env, capacity);
+            } else {
+                capacity = value;
+            }
+        }
+
+        const std::string path = std::string(dir) + "/veo-trace." +
+                                 std::to_string(getpid()) + ".bin";
+        size_t len = sizeof(trace_header) + capacity * sizeof(trace_record);
+
+        int fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd == -1 || ftruncate(fd, len) == -1) {
+            spdlog::error("Cannot create trace file {}", path);
+            if (fd != -1) close(fd);
+            return;
+        }
+
+        void *ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+
+        if (ptr == MAP_FAILED) {
+            spdlog::error("Cannot map trace file {}", path);
+            return;
+        }
+
+        const std::string sites_path =
+            path.substr(0, path.size() - 4) + ".fmt";
+        sites_fd = open(sites_path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+                        0644);
+        if (sites_fd == -1) {
+            spdlog::error("Cannot create trace file {}", sites_path);
+            munmap(ptr, len);
+            return;
+        }
+
+        records = reinterpret_cast<trace_record *>(
+            static_cast<uint8_t *>(ptr) + sizeof(trace_header));
+        header = static_cast<trace_header *>(ptr);
+        std::copy(TRACE_MAGIC, TRACE_MAGIC + sizeof(TRACE_MAGIC),
+                  header->magic);
+        header->pid = getpid();
+        header->capacity = capacity;
+        header->head = 0;
+    }
+
+    void record(veo_stubs_trace_event event, const json &msg, size_t size)
+    {
+        const auto cmd = msg.find("cmd");
+        const auto reqid = msg.find("reqid");
+
+        append(event, cmd != msg.end() ? cmd->get<int16_t>() : -1,
+               reqid != msg.end() ? reqid->get<uint64_t>() : ~0ULL, size);
+    }
+
+    // Record a VS_DEBUG call site. Its arguments are returned by args, which
+    // is only called if all of them are integers, so that expensive ones
+    // (e.g. a dump of a message) are never evaluated here. The first two
+    // integers are recorded.
+    template <typename F> void log(const char *fmt, F &&args)
+    {
+        using tuple = decltype(args());
+        constexpr size_t nargs =
+            trace_args_integral<tuple>::value
+                ? std::min<size_t>(std::tuple_size<tuple>::value, 2)
+                : 0;
+
+        // Each call site has its own lambda type and thus its own ID
+        static const int16_t site = add_site(fmt, nargs);
+
+        uint64_t vals[2] = {0, 0};
+        if constexpr (nargs > 0) {
+            const tuple t = args();
+            vals[0] = static_cast<uint64_t>(std::get<0>(t));
+            if constexpr (nargs > 1) {
+                vals[1] = static_cast<uint64_t>(std::get<1>(t));
+            }
+        }
+
+        append(VS_TRACE_LOG, site, vals[0], vals[1]);
+    }
+};
+
+static trace_ring tracer;
+
 bool do_write(int fd, const uint8_t *buf, size_t count)
 {
     while (count > 0) {
         ssize_t written_bytes = write(fd, buf, count);
+        if (written_bytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            // A non-blocking socket is full, so wait until it drains
+            struct pollfd pfd = {fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        if (written_bytes == -1 && errno == EINTR) {
+            continue;
+        }
         if (written_bytes == 0 || written_bytes == -1) {
             return false;
         }
@@ -337,35 +1794,80 @@ bool do_read(int fd, uint8_t *buf, size_t count)
     return true;
 }
 
-bool send_msg(int sock, const json &msg)
+#ifdef __linux__
+bool do_write(shm_channel &ch, const uint8_t *buf, size_t count)
+{
+    return ch.write(buf, count);
+}
+
+bool do_read(shm_channel &ch, uint8_t *buf, size_t count)
+{
+    return ch.read(buf, count);
+}
+#endif
+
+template <typename Transport> bool send_msg(Transport &&out, const json &msg)
 {
     std::vector<std::uint8_t> buffer = json::to_msgpack(msg);
     uint32_t size = buffer.size();
 
-    if (!do_write(sock, reinterpret_cast<uint8_t *>(&size), sizeof(size))) {
+    if (tracer.enabled()) {
+        tracer.record(VS_TRACE_SEND, msg, size);
+    }
+
+    if (!do_write(out, reinterpret_cast<uint8_t *>(&size), sizeof(size))) {
         return false;
     }
-    if (!do_write(sock, buffer.data(), size)) {
+    if (!do_write(out, buffer.data(), size)) {
         return false;
     }
 
     return true;
 }
 
-bool recv_msg(int sock, json &msg)
+template <typename Transport> bool recv_msg(Transport &&in, json &msg)
 {
     uint32_t size;
-    if (!do_read(sock, reinterpret_cast<uint8_t *>(&size), sizeof(size))) {
+    if (!do_read(in, reinterpret_cast<uint8_t *>(&size), sizeof(size))) {
         return false;
     }
 
     std::vector<std::uint8_t> buffer(size);
-    if (!do_read(sock, buffer.data(), size)) {
+    if (!do_read(in, buffer.data(), size)) {
         return false;
     }
 
     msg = json::from_msgpack(buffer);
 
+    if (tracer.enabled()) {
+        tracer.record(VS_TRACE_RECV, msg, size);
+    }
+
+    return true;
+}
+
+// Extract the message starting at pos from len bytes received so far and
+// advance pos past it. Returns false if the message is not complete yet.
+inline bool parse_msg(const uint8_t *buf, size_t len, size_t &pos, json &msg)
+{
+    uint32_t size;
+    if (len - pos < sizeof(size)) {
+        return false;
+    }
+
+    std::memcpy(&size, buf + pos, sizeof(size));
+    if (len - pos - sizeof(size) < size) {
+        return false;
+    }
+
+    const uint8_t *payload = buf + pos + sizeof(size);
+    msg = json::from_msgpack(payload, payload + size);
+    pos += sizeof(size) + size;
+
+    if (tracer.enabled()) {
+        tracer.record(VS_TRACE_RECV, msg, size);
+    }
+
     return true;
 }
 
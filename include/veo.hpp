@@ -0,0 +1,120 @@
+/**
+ * @file veo.hpp
+ *
+ * Typed C++ interface for calling VE functions. The argument types are
+ * deduced at compile time, and the arguments are packed into an array on the
+ * stack without building a veo_args object.
+ *
+ *   uint64_t sym = veo_get_sym(proc, handle, "axpy");
+ *   int64_t ret = veo::call<int64_t>(ctx, sym, n, 2.0, x_ptr, y_ptr);
+ */
+#ifndef _VEO_HPP_
+#define _VEO_HPP_
+
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+#include "ve_offload.h"
+#include "veo_stubs.h"
+
+namespace veo
+{
+
+class error : public std::runtime_error
+{
+public:
+    explicit error(const std::string &what) : std::runtime_error(what) {}
+};
+
+namespace detail
+{
+
+template <typename T> struct always_false : std::false_type {
+};
+
+// Type tag of an argument
+template <typename T> constexpr uint8_t arg_type()
+{
+    if constexpr (std::is_pointer_v<T>) {
+        return VEO_PACKED_U64;
+    } else if constexpr (std::is_same_v<T, double>) {
+        return VEO_PACKED_DOUBLE;
+    } else if constexpr (std::is_same_v<T, float>) {
+        return VEO_PACKED_FLOAT;
+    } else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>) {
+        constexpr bool is_signed = std::is_signed_v<T>;
+
+        if constexpr (sizeof(T) == 8) {
+            return is_signed ? VEO_PACKED_I64 : VEO_PACKED_U64;
+        } else if constexpr (sizeof(T) == 4) {
+            return is_signed ? VEO_PACKED_I32 : VEO_PACKED_U32;
+        } else if constexpr (sizeof(T) == 2) {
+            return is_signed ? VEO_PACKED_I16 : VEO_PACKED_U16;
+        } else {
+            return is_signed ? VEO_PACKED_I8 : VEO_PACKED_U8;
+        }
+    } else {
+        static_assert(always_false<T>::value, "Unsupported argument type");
+    }
+}
+
+// Store an argument in the low bytes of a 64-bit word
+template <typename T> uint64_t pack(T val)
+{
+    uint64_t word = 0;
+
+    if constexpr (std::is_pointer_v<T>) {
+        word = reinterpret_cast<uintptr_t>(val);
+    } else {
+        std::memcpy(&word, &val, sizeof(T));
+    }
+
+    return word;
+}
+
+} // namespace detail
+
+// Call a function without waiting for its result. Returns the request ID.
+template <typename... Args>
+uint64_t call_async(struct veo_thr_ctxt *ctx, uint64_t addr, Args... args)
+{
+    // One extra element avoids zero-length arrays
+    static constexpr uint8_t types[] = {detail::arg_type<Args>()..., 0};
+    const uint64_t vals[] = {detail::pack(args)..., 0};
+
+    return veo_call_async_packed(ctx, addr, types, vals, sizeof...(Args));
+}
+
+// Call a function and wait for its result. Throws veo::error on failure.
+template <typename R = uint64_t, typename... Args>
+R call(struct veo_thr_ctxt *ctx, uint64_t addr, Args... args)
+{
+    static_assert(std::is_void_v<R> || std::is_integral_v<R> ||
+                      std::is_enum_v<R> || std::is_pointer_v<R>,
+                  "Unsupported return type");
+
+    uint64_t reqid = call_async(ctx, addr, args...);
+    if (reqid == VEO_REQUEST_ID_INVALID) {
+        throw error("Cannot submit call");
+    }
+
+    uint64_t ret;
+    if (veo_call_wait_result(ctx, reqid, &ret) != VEO_COMMAND_OK) {
+        throw error("Call failed");
+    }
+
+    if constexpr (std::is_void_v<R>) {
+        return;
+    } else if constexpr (std::is_pointer_v<R>) {
+        return reinterpret_cast<R>(ret);
+    } else {
+        return static_cast<R>(ret);
+    }
+}
+
+} // namespace veo
+
+#endif
@@ -0,0 +1,115 @@
+/**
+ * @file veo_stubs.h
+ *
+ * Extensions to the VEO API that are only provided by veo-stubs
+ */
+#ifndef _VEO_STUBS_H_
+#define _VEO_STUBS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "ve_offload.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+struct veo_graph;
+
+/* Argument types of veo_call_async_packed */
+enum veo_packed_arg_type {
+  VEO_PACKED_I64,
+  VEO_PACKED_U64,
+  VEO_PACKED_I32,
+  VEO_PACKED_U32,
+  VEO_PACKED_I16,
+  VEO_PACKED_U16,
+  VEO_PACKED_I8,
+  VEO_PACKED_U8,
+  VEO_PACKED_DOUBLE,
+  VEO_PACKED_FLOAT,
+};
+
+/* VE memory allocated with veo_alloc_mem, in bytes */
+struct veo_mem_usage {
+  uint64_t current;
+  uint64_t peak;
+  /* Set by VEO_STUBS_MEM_LIMIT. Zero means unlimited. */
+  uint64_t limit;
+  uint64_t num_buffers;
+};
+
+struct veo_call_handle {
+  struct veo_thr_ctxt *ctx;
+  uint64_t reqid;
+};
+
+/* Until poll or wait reports success, only veo_proc_create_poll,
+   veo_proc_create_wait and veo_proc_destroy may be used on the proc; other
+   functions fail. */
+struct veo_proc_handle *veo_proc_create_async(int);
+int veo_proc_create_poll(struct veo_proc_handle *);
+int veo_proc_create_wait(struct veo_proc_handle *);
+/* Fails without destroying anything if a proc is listed twice. */
+int veo_proc_destroy_many(struct veo_proc_handle **, int);
+int veo_get_syms(struct veo_proc_handle *, uint64_t, const char **, int,
+                 uint64_t *);
+int veo_get_mem_usage(struct veo_proc_handle *, struct veo_mem_usage *);
+int veo_proc_checkpoint(struct veo_proc_handle *, const char *);
+int veo_proc_restore(struct veo_proc_handle *, const char *);
+uint64_t veo_proc_translate(struct veo_proc_handle *, uint64_t);
+int veo_write_mem_from_file(struct veo_proc_handle *, uint64_t, const char *,
+                            off_t, size_t);
+int veo_read_mem_to_file(struct veo_proc_handle *, const char *, off_t,
+                         uint64_t, size_t);
+int veo_read_mem_2d(struct veo_proc_handle *, void *, size_t, uint64_t,
+                    size_t, size_t, size_t);
+int veo_write_mem_2d(struct veo_proc_handle *, uint64_t, size_t, const void *,
+                     size_t, size_t, size_t);
+uint64_t veo_async_read_mem_2d(struct veo_thr_ctxt *, void *, size_t,
+                               uint64_t, size_t, size_t, size_t);
+uint64_t veo_async_write_mem_2d(struct veo_thr_ctxt *, uint64_t, size_t,
+                                const void *, size_t, size_t, size_t);
+uint64_t veo_async_write_mem_from_file(struct veo_thr_ctxt *, uint64_t,
+                                       const char *, off_t, size_t);
+uint64_t veo_async_read_mem_to_file(struct veo_thr_ctxt *, const char *, off_t,
+                                    uint64_t, size_t);
+int veo_call_wait_result_timeout(struct veo_thr_ctxt *, uint64_t, uint64_t,
+                                 uint64_t *);
+int veo_call_cancel(struct veo_thr_ctxt *, uint64_t);
+int veo_context_event_fd(struct veo_thr_ctxt *);
+int veo_context_vtime(struct veo_thr_ctxt *, uint64_t *);
+int veo_call_peek_vtime(struct veo_thr_ctxt *, uint64_t, uint64_t *,
+                        uint64_t *);
+int veo_call_wait_any(const struct veo_call_handle *, int, int *, uint64_t *);
+int veo_call_wait_all(const struct veo_call_handle *, int, uint64_t *);
+int veo_call_async_batch(struct veo_thr_ctxt *, uint64_t, struct veo_args **,
+                         int, uint64_t *);
+int veo_call_async_batch_by_name(struct veo_thr_ctxt *, uint64_t,
+                                 const char *, struct veo_args **, int,
+                                 uint64_t *);
+
+uint64_t veo_call_async_packed(struct veo_thr_ctxt *, uint64_t,
+                               const uint8_t *, const uint64_t *, int);
+
+int veo_set_thr_ctxt_unordered(struct veo_thr_ctxt_attr *, int);
+int veo_get_thr_ctxt_unordered(struct veo_thr_ctxt_attr *, int *);
+int veo_set_thr_ctxt_limits(struct veo_thr_ctxt_attr *, uint64_t, uint64_t,
+                            int);
+int veo_get_thr_ctxt_limits(struct veo_thr_ctxt_attr *, uint64_t *,
+                            uint64_t *, int *);
+
+struct veo_graph *veo_graph_alloc(void);
+void veo_graph_free(struct veo_graph *);
+int veo_graph_add_write_mem(struct veo_graph *, uint64_t, const void *,
+                            size_t);
+int veo_graph_add_call(struct veo_graph *, uint64_t, struct veo_args *);
+int veo_graph_add_read_mem(struct veo_graph *, void *, uint64_t, size_t);
+int veo_graph_set_call_args(struct veo_graph *, int, struct veo_args *);
+int veo_graph_instantiate(struct veo_thr_ctxt *, struct veo_graph *);
+uint64_t veo_graph_launch(struct veo_thr_ctxt *, struct veo_graph *);
+#ifdef __cplusplus
+} // extern "C"
+#endif
+#endif
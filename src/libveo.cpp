@@ -1,7 +1,10 @@
 #include <algorithm>
 #include <cstdint>
+#include <dlfcn.h>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <signal.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -13,6 +16,7 @@
 
 #include "stub.hpp"
 #include "ve_offload.h"
+#include "veo_stubs.h"
 
 extern "C" {
 
@@ -22,6 +26,115 @@ static __attribute__((constructor)) void init()
 {
     spdlog::cfg::load_env_levels();
     spdlog::set_pattern("[%^%l%$] [VH] [PID %P] [TID %t] %v");
+
+    tracer.open_from_env();
+}
+
+static void perform_copy_in(json &req)
+{
+    if (req.contains("copy_in")) {
+        for (auto &j : req["copy_in"]) {
+            copy_descriptor desc = j;
+            desc.gather(desc.vh_ptr, desc.vh_pitch);
+            j["data"] = std::move(desc.data);
+        }
+    }
+
+    if (req.contains("calls")) {
+        for (auto &call : req["calls"]) {
+            perform_copy_in(call);
+        }
+    }
+}
+
+static void perform_copy_out(const json &res)
+{
+    if (res.contains("copy_out")) {
+        for (const copy_descriptor &desc : res["copy_out"]) {
+            desc.scatter(desc.vh_ptr, desc.vh_pitch);
+        }
+    }
+}
+
+static void _store_result(struct veo_thr_ctxt *ctx, const json &res)
+{
+    perform_copy_out(res);
+
+    if (res.contains("vend")) {
+        uint64_t vend = res["vend"].get<uint64_t>();
+        uint64_t cur = ctx->vtime;
+
+        while (vend > cur && !ctx->vtime.compare_exchange_weak(cur, vend)) {
+        }
+    }
+
+    if (recorder.enabled()) {
+        recorder.record_result(ctx, res);
+    }
+
+    // The data is already in the VH buffers, so results that are never
+    // waited for do not hold on to it
+    if (res.contains("copy_out")) {
+        json stripped = res;
+        stripped.erase("copy_out");
+        ctx->store_result(res["reqid"].get<uint64_t>(), stripped);
+        return;
+    }
+
+    ctx->store_result(res["reqid"].get<uint64_t>(), res);
+}
+
+static void _store_results(struct veo_thr_ctxt *ctx, const json &res)
+{
+    VS_DEBUG("Received result {}", res.dump());
+
+    // A batch of calls returns multiple results at once
+    if (res.contains("results")) {
+        for (const auto &r : res["results"]) {
+            _store_result(ctx, r);
+        }
+    } else {
+        _store_result(ctx, res);
+    }
+}
+
+static void _notify_exit(struct veo_thr_ctxt *ctx)
+{
+    // Notify main thread in case it's waiting for results
+    {
+        std::lock_guard<std::mutex> lock(ctx->results_mtx);
+
+        ctx->signal_event();
+        ctx->results_cv.notify_all();
+    }
+
+    // Submitters blocked by the limits give up as well
+    {
+        std::lock_guard<std::mutex> lock(ctx->inflight_mtx);
+        ctx->inflight_cv.notify_all();
+    }
+
+    completions.notify();
+}
+
+static bool _send_msg(struct veo_thr_ctxt *ctx, const json &msg)
+{
+#ifdef __linux__
+    if (ctx->shm) {
+        return send_msg(ctx->shm->tx, msg);
+    }
+#endif
+    return send_msg(ctx->sock, msg);
+}
+
+static bool _recv_msg(struct veo_thr_ctxt *ctx, json &msg)
+{
+#ifdef __linux__
+    if (ctx->shm) {
+        return recv_msg(ctx->shm->rx, msg);
+    }
+#endif
+    return recv_msg(ctx->sock, msg);
 }
 
 static void worker(struct veo_thr_ctxt *ctx)
@@ -32,16 +145,9 @@ static void worker(struct veo_thr_ctxt *ctx)
     while (true) {
         ctx->requests.wait_pop(req);
 
-        // Perform copy-in
-        if (req.contains("copy_in")) {
-            for (auto &j : req["copy_in"]) {
-                copy_descriptor desc = j;
-                j["data"] =
-                    std::vector<uint8_t>(desc.vh_ptr, desc.vh_ptr + desc.len);
-            }
-        }
+        perform_copy_in(req);
 
-        if (!send_msg(ctx->sock, req)) {
+        if (!_send_msg(ctx, req)) {
             spdlog::error("Failed to send command to VE");
             aborted = true;
             break;
@@ -51,38 +157,66 @@ static void worker(struct veo_thr_ctxt *ctx)
             break;
         }
 
-        if (!recv_msg(ctx->sock, res)) {
+        if (!_recv_msg(ctx, res)) {
             spdlog::error("Failed to receive result from VE");
             aborted = true;
             break;
         }
 
-        spdlog::debug("Received result {}", res.dump());
+        _store_results(ctx, res);
+    }
+
+    ctx->is_running = false;
 
-        // Perform copy-out
-        if (res.contains("copy_out")) {
-            for (const copy_descriptor &desc : res["copy_out"]) {
-                std::copy(desc.data.begin(), desc.data.end(), desc.vh_ptr);
-            }
-        }
+    if (aborted) {
+        _notify_exit(ctx);
+    }
+}
+
+// Sends requests of an unordered context without waiting for their results
+static void sender(struct veo_thr_ctxt *ctx)
+{
+    json req;
+
+    while (true) {
+        ctx->requests.wait_pop(req);
 
-        {
-            std::lock_guard<std::mutex> lock(ctx->results_mtx);
+        perform_copy_in(req);
 
-            ctx->results.insert({res["reqid"].get<uint64_t>(), res});
-            ctx->results_cv.notify_one();
+        if (!_send_msg(ctx, req)) {
+            spdlog::error("Failed to send command to VE");
+            break;
+        }
+
+        if (req["cmd"] == VS_CMD_CLOSE_CONTEXT) {
+            ctx->is_closing = true;
+            break;
         }
     }
+}
 
-    ctx->is_running = false;
+// Receives results of an unordered context in completion order. VE closes
+// the connection after all requests have finished.
+static void receiver(struct veo_thr_ctxt *ctx)
+{
+    json res;
 
-    if (aborted) {
-        // Notify main thread in case it's waiting for results
-        ctx->results_cv.notify_one();
+    while (_recv_msg(ctx, res)) {
+        _store_results(ctx, res);
+    }
+
+    if (!ctx->is_closing) {
+        spdlog::error("Failed to receive result from VE");
     }
+
+    ctx->is_running = false;
+
+    _notify_exit(ctx);
 }
 
-static veo_thr_ctxt *_veo_context_open(struct veo_proc_handle *proc)
+static veo_thr_ctxt *_veo_context_open(struct veo_proc_handle *proc,
+                                       bool unordered = false,
+                                       bool preload = false)
 {
     // We intentionally do not check if proc (or any pointer given by the user)
     // is valid to match the behavior with libveo
@@ -109,46 +243,124 @@ static veo_thr_ctxt *_veo_context_open(struct veo_proc_handle *proc)
         if (++retry_count >= MAX_RETRIES) {
             spdlog::error("Cannot connect to worker on VE");
 
+            close(sock);
             return NULL;
         }
     }
 
-    spdlog::debug("Connected to worker on VE (PID {})", proc->pid);
+    VS_DEBUG("Connected to worker on VE (PID {})", proc->pid);
 
     struct veo_thr_ctxt *ctx = new veo_thr_ctxt(proc, sock);
-    ctx->comm_thread = std::thread(worker, ctx);
+    ctx->limits = queue_limits::from_env();
+
+    json open_req = {{"cmd", VS_CMD_OPEN_CONTEXT},
+                     {"reqid", ctx->issue_reqid()},
+                     {"unordered", unordered}};
+    std::string shm_path;
+
+    const char *transport = getenv("VEO_STUBS_TRANSPORT");
+    if (transport && std::string(transport) == "shm") {
+#ifdef __linux__
+        static std::atomic<uint64_t> shm_count(0);
+        const char *size_env = getenv("VEO_STUBS_SHM_SIZE");
+        uint64_t size = size_env ? std::stoull(size_env) : 1 << 20;
+
+        shm_path = "/dev/shm/veo-stubs." + std::to_string(getpid()) + "." +
+                   std::to_string(shm_count++);
+        ctx->shm = std::make_unique<shm_transport>();
+
+        if (ctx->shm->create(shm_path, std::max<uint64_t>(size, 4096),
+                             sock)) {
+            open_req["shm"] = shm_path;
+        } else {
+            spdlog::warn("Cannot create {}, falling back to socket", shm_path);
+            ctx->shm.reset();
+            shm_path.clear();
+        }
+#else
+        spdlog::warn("Shared memory transport is only supported on Linux");
+#endif
+    }
+
+    // Preloaded libraries are only worth a handshake if there are any
+    preload = preload && getenv("VEO_STUBS_PRELOAD") != NULL;
+    if (preload) {
+        open_req["preload"] = true;
+    }
+
+    if (unordered || preload || !shm_path.empty()) {
+        json res;
+        bool ok = send_msg(sock, open_req) && recv_msg(sock, res);
+
+        // Both sides have the file mapped now
+        if (!shm_path.empty()) {
+            unlink(shm_path.c_str());
+        }
+
+        if (!ok || (res.contains("error") && res["error"].get<bool>())) {
+            spdlog::error("Cannot open context on VE");
+
+            delete ctx;
+            return NULL;
+        }
+
+        for (const auto &lib : res.value("libs", json::array())) {
+            proc->preloaded_libs[lib[0]] = lib[1];
+        }
+        for (const auto &sym : res.value("syms", json::array())) {
+            proc->preloaded_syms[{sym[0], sym[1]}] = sym[2];
+        }
+    }
+
+    if (unordered) {
+        ctx->unordered = true;
+        ctx->comm_thread = std::thread(sender, ctx);
+        ctx->recv_thread = std::thread(receiver, ctx);
+    } else {
+        ctx->comm_thread = std::thread(worker, ctx);
+    }
 
     return ctx;
 }
 
-struct veo_proc_handle *veo_proc_create(int venode)
+struct veo_proc_handle *veo_proc_create_async(int venode)
 {
     const char *VEORUN_BIN_ENV = getenv("VEORUN_BIN");
     const char *VEORUN_BIN = VEORUN_BIN_ENV
                                  ? VEORUN_BIN_ENV
                                  : "/opt/nec/ve/veos/libexec/stub-veorun";
 
-    spdlog::debug("Launching stub-veorun at {}", VEORUN_BIN);
+    VS_DEBUG("Launching stub-veorun at {}", VEORUN_BIN);
+
+    // Opened here rather than in init() because the recorder may not be
+    // constructed yet when init() runs
+    static std::once_flag recorder_flag;
+    std::call_once(recorder_flag, [] { recorder.open_from_env(); });
 
     pid_t child_pid = fork();
 
+    if (child_pid < 0) {
+        spdlog::error("Cannot fork stub-veorun: {}", strerror(errno));
+        return NULL;
+    }
+
     if (child_pid) {
         // TODO use VE_NODE_NUMBER if venode == -1
         struct veo_proc_handle *proc = new veo_proc_handle(venode, child_pid);
-        struct veo_thr_ctxt *ctx = _veo_context_open(proc);
-
-        if (ctx == NULL) {
-            delete proc;
-            return NULL;
-        }
 
-        proc->default_context = ctx;
+        // Connecting waits for stub-veorun to start listening, so it is done
+        // in the background
+        proc->pending_context =
+            std::async(std::launch::async, [proc] {
+                return _veo_context_open(proc, false, true);
+            }).share();
 
         procs.push_back(proc);
 
         return proc;
     } else {
-        const char *argv[] = {VEORUN_BIN, NULL};
+        const std::string venode_str = std::to_string(venode);
+        const char *argv[] = {VEORUN_BIN, venode_str.c_str(), NULL};
 
         execvp(VEORUN_BIN, const_cast<char *const *>(argv));
 
@@ -158,45 +370,259 @@ struct veo_proc_handle *veo_proc_create(int venode)
     }
 }
 
+// Take the default context once the background connection has finished
+static bool _finish_create(struct veo_proc_handle *proc)
+{
+    std::call_once(proc->create_flag, [proc] {
+        proc->default_context = proc->pending_context.get();
+    });
+
+    return proc->default_context != NULL;
+}
+
+int veo_proc_create_poll(struct veo_proc_handle *proc)
+{
+    if (proc->pending_context.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+        return VEO_COMMAND_UNFINISHED;
+    }
+
+    return _finish_create(proc) ? VEO_COMMAND_OK : VEO_COMMAND_ERROR;
+}
+
+int veo_proc_create_wait(struct veo_proc_handle *proc)
+{
+    return _finish_create(proc) ? 0 : -1;
+}
+
+// The default context of a proc, or NULL while veo_proc_create_async has not
+// completed. Only the poll, wait and destroy functions may be used until then.
+static struct veo_thr_ctxt *_default_context(struct veo_proc_handle *proc)
+{
+    if (proc->default_context == NULL) {
+        spdlog::error("Proc has not been created yet");
+    }
+
+    return proc->default_context;
+}
+
+struct veo_proc_handle *veo_proc_create(int venode)
+{
+    struct veo_proc_handle *proc = veo_proc_create_async(venode);
+
+    if (proc == NULL) {
+        return NULL;
+    }
+
+    if (veo_proc_create_wait(proc) != 0) {
+        veo_proc_destroy(proc);
+        return NULL;
+    }
+
+    return proc;
+}
+
 struct veo_proc_handle *veo_proc_create_static(int venode, char *tmp_veobin)
 {
     // Not implemented
     return NULL;
 }
 
-int veo_proc_destroy(struct veo_proc_handle *proc)
+static uint64_t _submit_get_mem_usage(struct veo_proc_handle *proc,
+                                      bool buffers)
+{
+    struct veo_thr_ctxt *ctx = proc->default_context;
+    uint64_t reqid = ctx->issue_reqid();
+
+    ctx->submit_request({{"cmd", VS_CMD_GET_MEM_USAGE},
+                         {"reqid", reqid},
+                         {"buffers", buffers}});
+
+    return reqid;
+}
+
+static bool _get_mem_usage(struct veo_proc_handle *proc, bool buffers,
+                           json &result)
+{
+    uint64_t reqid = _submit_get_mem_usage(proc, buffers);
+
+    return proc->default_context->wait_result(reqid, result);
+}
+
+// Describe a code address as symbol+offset or object+offset
+static std::string _describe_site(uint64_t site)
 {
-    // Close all open thread contexts
-    const std::vector<struct veo_thr_ctxt *> ctxts = proc->contexts;
-    for (auto ctx : ctxts) {
-        veo_context_close(ctx);
+    Dl_info info;
+
+    if (site == 0 || dladdr(reinterpret_cast<void *>(site), &info) == 0) {
+        return fmt::format("{:#x}", site);
+    }
+    if (info.dli_sname != NULL) {
+        return fmt::format("{}+{:#x}", info.dli_sname,
+                           site - reinterpret_cast<uint64_t>(info.dli_saddr));
+    }
+
+    return fmt::format("{}+{:#x}", info.dli_fname,
+                       site - reinterpret_cast<uint64_t>(info.dli_fbase));
+}
+
+static void _report_leaks(struct veo_proc_handle *proc, uint64_t reqid)
+{
+    json result;
+    if (!proc->default_context->wait_result(reqid, result) ||
+        result["buffers"].empty()) {
+        return;
+    }
+
+    spdlog::warn("{} buffers ({} bytes) were not freed before destroying "
+                 "the proc (peak usage {} bytes)",
+                 result["num_buffers"].get<uint64_t>(),
+                 result["current"].get<uint64_t>(),
+                 result["peak"].get<uint64_t>());
+
+    for (const auto &buf : result["buffers"]) {
+        spdlog::warn("  {} bytes at {:#x} allocated by request {} from {}",
+                     buf[1].get<uint64_t>(), buf[0].get<uint64_t>(),
+                     buf[2].get<uint64_t>(),
+                     _describe_site(buf[3].get<uint64_t>()));
+    }
+}
+
+// Ask the VE to close a context. Returns false if there is nothing to wait
+// for.
+static bool _begin_context_close(struct veo_thr_ctxt *ctx)
+{
+    // Do nothing if the context has already exited
+    if (!ctx->is_running) {
+        return false;
+    }
+
+    const auto it =
+        std::find(ctx->proc->contexts.begin(), ctx->proc->contexts.end(), ctx);
+
+    if (it != ctx->proc->contexts.end()) {
+        ctx->proc->contexts.erase(it);
+    }
+
+    // We do not close the default context
+    if (ctx == ctx->proc->default_context) {
+        return false;
     }
 
-    struct veo_thr_ctxt *ctx = proc->default_context;
     uint64_t reqid = ctx->issue_reqid();
+    ctx->submit_request({{"cmd", VS_CMD_CLOSE_CONTEXT}, {"reqid", reqid}});
 
-    ctx->submit_request({{"cmd", VS_CMD_QUIT}, {"reqid", reqid}});
+    return true;
+}
 
-    spdlog::debug("Waiting for VE to quit");
+// Graphs that outlive their context can only be freed afterwards
+static void _detach_graphs(struct veo_thr_ctxt *ctx)
+{
+    for (auto graph : ctx->graphs) {
+        graph->ctx = NULL;
+    }
+    ctx->graphs.clear();
+}
 
-    wait(NULL);
+static void _finish_context_close(struct veo_thr_ctxt *ctx)
+{
+    ctx->comm_thread.join();
 
-    // TODO make sure all cotexts are closed?
-    proc->default_context->comm_thread.join();
-    delete proc->default_context;
+    if (ctx->recv_thread.joinable()) {
+        ctx->recv_thread.join();
+    }
 
-    const auto it = std::find(procs.begin(), procs.end(), proc);
+    _detach_graphs(ctx);
+    delete ctx;
+}
+
+int veo_proc_destroy(struct veo_proc_handle *proc)
+{
+    return veo_proc_destroy_many(&proc, 1);
+}
+
+// Each step is started on all procs before waiting for any of them, so
+// tearing down many procs takes about as long as tearing down one
+int veo_proc_destroy_many(struct veo_proc_handle **handles, int n)
+{
+    // A proc listed twice would be freed twice
+    std::vector<struct veo_proc_handle *> sorted(handles, handles + n);
+    std::sort(sorted.begin(), sorted.end());
+    if (std::adjacent_find(sorted.begin(), sorted.end()) != sorted.end()) {
+        spdlog::error("Cannot destroy the same proc twice");
+        return -1;
+    }
+
+    std::vector<struct veo_proc_handle *> running;
+    std::vector<struct veo_thr_ctxt *> closing;
+
+    for (int i = 0; i < n; i++) {
+        struct veo_proc_handle *proc = handles[i];
+
+        if (!_finish_create(proc)) {
+            // stub-veorun never accepted a connection
+            if (proc->pid > 0) kill(proc->pid, SIGKILL);
+            continue;
+        }
+
+        running.push_back(proc);
+
+        // Close all open thread contexts
+        const std::vector<struct veo_thr_ctxt *> ctxts = proc->contexts;
+        for (auto ctx : ctxts) {
+            if (_begin_context_close(ctx)) {
+                closing.push_back(ctx);
+            }
+        }
+    }
 
-    if (it != procs.end()) {
-        procs.erase(it);
+    for (auto ctx : closing) {
+        _finish_context_close(ctx);
     }
 
-    // Technically, proc->pid could be reused by another process.
-    const std::string sock_path =
-        "/tmp/stub-veorun." + std::to_string(proc->pid) + ".sock";
-    unlink(sock_path.c_str());
+    std::vector<uint64_t> usage_reqids;
+    for (auto proc : running) {
+        usage_reqids.push_back(_submit_get_mem_usage(proc, true));
+    }
+    for (size_t i = 0; i < running.size(); i++) {
+        _report_leaks(running[i], usage_reqids[i]);
+    }
+
+    for (auto proc : running) {
+        struct veo_thr_ctxt *ctx = proc->default_context;
+        uint64_t reqid = ctx->issue_reqid();
+
+        ctx->submit_request({{"cmd", VS_CMD_QUIT}, {"reqid", reqid}});
+    }
+
+    VS_DEBUG("Waiting for VE to quit");
+
+    for (int i = 0; i < n; i++) {
+        struct veo_proc_handle *proc = handles[i];
+
+        if (proc->pid > 0) waitpid(proc->pid, NULL, 0);
+
+        if (proc->default_context != NULL) {
+            // TODO make sure all cotexts are closed?
+            proc->default_context->comm_thread.join();
+            _detach_graphs(proc->default_context);
+            delete proc->default_context;
+        }
+
+        const auto it = std::find(procs.begin(), procs.end(), proc);
+
+        if (it != procs.end()) {
+            procs.erase(it);
+        }
+
+        // Technically, proc->pid could be reused by another process.
+        const std::string sock_path =
+            "/tmp/stub-veorun." + std::to_string(proc->pid) + ".sock";
+        unlink(sock_path.c_str());
+
+        delete proc;
+    }
 
-    delete proc;
     return 0;
 }
 
@@ -213,7 +639,15 @@ int veo_proc_identifier(veo_proc_handle *proc)
 
 uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    const auto it = proc->preloaded_libs.find(libname);
+    if (it != proc->preloaded_libs.end()) {
+        return it->second;
+    }
+
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return 0;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     ctx->submit_request(
@@ -229,7 +663,15 @@ uint64_t veo_load_library(struct veo_proc_handle *proc, const char *libname)
 
 int veo_unload_library(veo_proc_handle *proc, const uint64_t libhdl)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    // Preloaded libraries stay loaded until the proc is destroyed
+    for (const auto &lib : proc->preloaded_libs) {
+        if (lib.second == libhdl) return 0;
+    }
+
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     ctx->submit_request(
@@ -246,7 +688,15 @@ int veo_unload_library(veo_proc_handle *proc, const uint64_t libhdl)
 uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl,
                      const char *symname)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    const auto it = proc->preloaded_syms.find({libhdl, symname});
+    if (it != proc->preloaded_syms.end()) {
+        return it->second;
+    }
+
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return 0;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     ctx->submit_request({{"cmd", VS_CMD_GET_SYM},
@@ -262,28 +712,91 @@ uint64_t veo_get_sym(struct veo_proc_handle *proc, uint64_t libhdl,
     return result["result"];
 }
 
-int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr,
-                  const size_t size)
+int veo_get_syms(struct veo_proc_handle *proc, uint64_t libhdl,
+                 const char **symnames, int n, uint64_t *addrs)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    // Only symbols that were not prebound are sent
+    std::vector<int> indices;
+    json names = json::array();
+
+    for (int i = 0; i < n; i++) {
+        const auto it = proc->preloaded_syms.find({libhdl, symnames[i]});
+
+        if (it != proc->preloaded_syms.end()) {
+            addrs[i] = it->second;
+        } else {
+            indices.push_back(i);
+            names.push_back(symnames[i]);
+        }
+    }
+
+    if (indices.empty()) {
+        return 0;
+    }
+
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
-    ctx->submit_request(
-        {{"cmd", VS_CMD_ALLOC_MEM}, {"reqid", reqid}, {"size", size}});
+    ctx->submit_request({{"cmd", VS_CMD_GET_SYMS},
+                         {"reqid", reqid},
+                         {"libhdl", libhdl},
+                         {"symnames", names}});
 
     json result;
     if (!ctx->wait_result(reqid, result)) {
         return -1;
     }
 
-    *addr = result["result"];
+    int ret = 0;
 
-    return *addr == 0 ? -1 : 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        addrs[indices[i]] = result["result"][i];
+
+        if (addrs[indices[i]] == 0) {
+            ret = -1;
+        }
+    }
+
+    return ret;
+}
+
+int veo_alloc_mem(struct veo_proc_handle *proc, uint64_t *addr,
+                  const size_t size)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid = ctx->issue_reqid();
+
+    // The caller is recorded so that leaked buffers can be traced back
+    const uint64_t site =
+        reinterpret_cast<uint64_t>(__builtin_return_address(0));
+
+    ctx->submit_request({{"cmd", VS_CMD_ALLOC_MEM},
+                         {"reqid", reqid},
+                         {"size", size},
+                         {"site", site}});
+
+    json result;
+    if (!ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    *addr = result["result"];
+
+    return *addr == 0 ? -1 : 0;
 }
 
 int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     ctx->submit_request(
@@ -297,10 +810,103 @@ int veo_free_mem(struct veo_proc_handle *proc, uint64_t addr)
     return result["result"];
 }
 
+int veo_get_mem_usage(struct veo_proc_handle *proc,
+                      struct veo_mem_usage *usage)
+{
+    json result;
+    if (_default_context(proc) == NULL ||
+        !_get_mem_usage(proc, false, result)) {
+        return -1;
+    }
+
+    usage->current = result["current"];
+    usage->peak = result["peak"];
+    usage->limit = result["limit"];
+    usage->num_buffers = result["num_buffers"];
+
+    return 0;
+}
+
+int veo_proc_checkpoint(struct veo_proc_handle *proc, const char *path)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid = ctx->issue_reqid();
+
+    ctx->submit_request(
+        {{"cmd", VS_CMD_CHECKPOINT}, {"reqid", reqid}, {"path", path}});
+
+    json result;
+    if (!ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    return result["result"];
+}
+
+int veo_proc_restore(struct veo_proc_handle *proc, const char *path)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid = ctx->issue_reqid();
+
+    ctx->submit_request(
+        {{"cmd", VS_CMD_RESTORE}, {"reqid", reqid}, {"path", path}});
+
+    json result;
+    if (!ctx->wait_result(reqid, result) || result["result"] != 0) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(proc->restored_mtx);
+
+    for (const auto &pair : result["libs"]) {
+        proc->restored_handles[pair[0]] = pair[1];
+    }
+    for (const auto &pair : result["syms"]) {
+        proc->restored_handles[pair[0]] = pair[1];
+    }
+    for (const auto &buf : result["bufs"]) {
+        proc->restored_bufs[buf[0]] = {buf[1], buf[2]};
+    }
+
+    return 0;
+}
+
+uint64_t veo_proc_translate(struct veo_proc_handle *proc, uint64_t addr)
+{
+    std::lock_guard<std::mutex> lock(proc->restored_mtx);
+
+    const auto handle = proc->restored_handles.find(addr);
+    if (handle != proc->restored_handles.end()) {
+        return handle->second;
+    }
+
+    // Find the last buffer that starts at or before addr
+    auto buf = proc->restored_bufs.upper_bound(addr);
+    if (buf != proc->restored_bufs.begin()) {
+        --buf;
+
+        const uint64_t offset = addr - buf->first;
+        if (offset < std::max<uint64_t>(buf->second.second, 1)) {
+            return buf->second.first + offset;
+        }
+    }
+
+    return addr;
+}
+
 int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src,
                  size_t size)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     ctx->submit_request({{"cmd", VS_CMD_READ_MEM},
@@ -323,7 +929,10 @@ int veo_read_mem(struct veo_proc_handle *proc, void *dst, uint64_t src,
 int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src,
                   size_t size)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
     uint64_t reqid = ctx->issue_reqid();
 
     std::vector<uint8_t> data(reinterpret_cast<const uint8_t *>(src),
@@ -343,85 +952,212 @@ int veo_write_mem(struct veo_proc_handle *proc, uint64_t dst, const void *src,
     return result["result"];
 }
 
+int veo_write_mem_from_file(struct veo_proc_handle *proc, uint64_t dst,
+                            const char *path, off_t offset, size_t size)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid =
+        veo_async_write_mem_from_file(ctx, dst, path, offset, size);
+
+    json result;
+    if (!ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    return result["result"];
+}
+
+int veo_read_mem_to_file(struct veo_proc_handle *proc, const char *path,
+                         off_t offset, uint64_t src, size_t size)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid = veo_async_read_mem_to_file(ctx, path, offset, src, size);
+
+    json result;
+    if (!ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    return result["result"];
+}
+
+int veo_read_mem_2d(struct veo_proc_handle *proc, void *dst, size_t dpitch,
+                    uint64_t src, size_t spitch, size_t width, size_t height)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid =
+        veo_async_read_mem_2d(ctx, dst, dpitch, src, spitch, width, height);
+
+    json result;
+    if (reqid == VEO_REQUEST_ID_INVALID || !ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    return result["result"];
+}
+
+int veo_write_mem_2d(struct veo_proc_handle *proc, uint64_t dst, size_t dpitch,
+                     const void *src, size_t spitch, size_t width,
+                     size_t height)
+{
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return -1;
+    }
+    uint64_t reqid =
+        veo_async_write_mem_2d(ctx, dst, dpitch, src, spitch, width, height);
+
+    json result;
+    if (reqid == VEO_REQUEST_ID_INVALID || !ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    return result["result"];
+}
+
 struct veo_thr_ctxt *veo_context_open(struct veo_proc_handle *proc)
 {
+    if (_default_context(proc) == NULL) {
+        return NULL;
+    }
+
     if (proc->contexts.empty()) {
         proc->contexts.push_back(proc->default_context);
         return proc->default_context;
     }
 
     struct veo_thr_ctxt *ctx = _veo_context_open(proc);
-    proc->contexts.push_back(ctx);
+
+    if (ctx != NULL) {
+        proc->contexts.push_back(ctx);
+    }
 
     return ctx;
 }
 
-int veo_context_close(struct veo_thr_ctxt *ctx)
+struct veo_thr_ctxt *veo_context_open_with_attr(struct veo_proc_handle *proc,
+                                                struct veo_thr_ctxt_attr *attr)
 {
-    // Do nothing if the context has already exited
-    if (!ctx->is_running) {
-        return 0;
-    }
+    struct veo_thr_ctxt *ctx;
 
-    struct veo_proc_handle *proc = ctx->proc;
+    if (_default_context(proc) == NULL) {
+        return NULL;
+    }
 
-    const auto it =
-        std::find(ctx->proc->contexts.begin(), ctx->proc->contexts.end(), ctx);
+    // The default context always executes requests in order and carries
+    // the synchronous functions, so it never gets limits either
+    if (attr == NULL || (!attr->unordered && !attr->has_limits)) {
+        ctx = veo_context_open(proc);
+    } else {
+        ctx = _veo_context_open(proc, attr->unordered);
 
-    if (it != ctx->proc->contexts.end()) {
-        ctx->proc->contexts.erase(it);
+        if (ctx != NULL) {
+            proc->contexts.push_back(ctx);
+        }
     }
 
-    // We do not close the default context
-    if (ctx == ctx->proc->default_context) {
-        return 0;
+    if (ctx != NULL && attr != NULL && attr->has_limits) {
+        std::lock_guard<std::mutex> lock(ctx->inflight_mtx);
+        ctx->limits = attr->limits;
     }
 
-    uint64_t reqid = ctx->issue_reqid();
-    ctx->submit_request({{"cmd", VS_CMD_CLOSE_CONTEXT}, {"reqid", reqid}});
+    return ctx;
+}
 
-    ctx->comm_thread.join();
+struct veo_thr_ctxt_attr *veo_alloc_thr_ctxt_attr(void)
+{
+    return new veo_thr_ctxt_attr;
+}
 
-    delete ctx;
+int veo_free_thr_ctxt_attr(struct veo_thr_ctxt_attr *attr)
+{
+    delete attr;
     return 0;
 }
 
-static json copy_in_for_stack_args(struct veo_args *argp)
+int veo_set_thr_ctxt_stacksize(struct veo_thr_ctxt_attr *attr, size_t size)
 {
-    json copy = json::array();
+    // Stored only. Worker threads on VH use the default stack size.
+    attr->stacksize = size;
+    return 0;
+}
 
-    for (const auto &arg : argp->args) {
-        if (arg.val.index() != VS_ARG_TYPE_STACK) continue;
-        stack_arg sa = std::get<stack_arg>(arg.val);
+int veo_get_thr_ctxt_stacksize(struct veo_thr_ctxt_attr *attr, size_t *size)
+{
+    *size = attr->stacksize;
+    return 0;
+}
 
-        if (sa.inout == VEO_INTENT_IN || sa.inout == VEO_INTENT_INOUT) {
-            copy.push_back(copy_descriptor{
-                NULL, reinterpret_cast<uint8_t *>(sa.buff), sa.len});
-        }
-    }
+int veo_set_thr_ctxt_unordered(struct veo_thr_ctxt_attr *attr, int unordered)
+{
+    attr->unordered = unordered != 0;
+    return 0;
+}
 
-    return copy;
+int veo_get_thr_ctxt_unordered(struct veo_thr_ctxt_attr *attr, int *unordered)
+{
+    *unordered = attr->unordered;
+    return 0;
 }
 
-static json copy_out_for_stack_args(struct veo_args *argp)
+int veo_set_thr_ctxt_limits(struct veo_thr_ctxt_attr *attr,
+                            uint64_t max_requests, uint64_t max_bytes,
+                            int nonblock)
 {
-    json copy = json::array();
+    attr->has_limits = true;
+    attr->limits.max_requests = max_requests;
+    attr->limits.max_bytes = max_bytes;
+    attr->limits.nonblock = nonblock != 0;
+    return 0;
+}
 
-    for (const auto &arg : argp->args) {
-        if (arg.val.index() != VS_ARG_TYPE_STACK) continue;
-        stack_arg sa = std::get<stack_arg>(arg.val);
+int veo_get_thr_ctxt_limits(struct veo_thr_ctxt_attr *attr,
+                            uint64_t *max_requests, uint64_t *max_bytes,
+                            int *nonblock)
+{
+    const queue_limits limits =
+        attr->has_limits ? attr->limits : queue_limits::from_env();
 
-        if (sa.inout == VEO_INTENT_OUT || sa.inout == VEO_INTENT_INOUT) {
-            copy.push_back(copy_descriptor{
-                NULL, reinterpret_cast<uint8_t *>(sa.buff), sa.len});
-        }
+    *max_requests = limits.max_requests;
+    *max_bytes = limits.max_bytes;
+    *nonblock = limits.nonblock;
+    return 0;
+}
+
+int veo_context_close(struct veo_thr_ctxt *ctx)
+{
+    if (_begin_context_close(ctx)) {
+        _finish_context_close(ctx);
     }
 
-    return copy;
+    return 0;
 }
 
-uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr,
-                        struct veo_args *argp)
+static json copy_in_for_stack_args(struct veo_args *argp)
+{
+    argp->encode();
+
+    return argp->copy_in;
+}
+
+static json copy_out_for_stack_args(struct veo_args *argp)
+{
+    argp->encode();
+
+    return argp->copy_out;
+}
+
+static uint64_t _call_async(struct veo_thr_ctxt *ctx, uint64_t addr,
+                            struct veo_args *argp, bool may_fail)
 {
     uint64_t reqid = ctx->issue_reqid();
 
@@ -432,7 +1168,56 @@ uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr,
                 {"copy_in", copy_in_for_stack_args(argp)},
                 {"copy_out", copy_out_for_stack_args(argp)}};
 
-    ctx->submit_request(req);
+    if (!ctx->submit_request(req, may_fail)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+uint64_t veo_call_async(struct veo_thr_ctxt *ctx, uint64_t addr,
+                        struct veo_args *argp)
+{
+    return _call_async(ctx, addr, argp, true);
+}
+
+static_assert(static_cast<int>(VEO_PACKED_I64) ==
+                      static_cast<int>(VS_ARG_TYPE_I64) &&
+                  static_cast<int>(VEO_PACKED_FLOAT) ==
+                      static_cast<int>(VS_ARG_TYPE_FLOAT),
+              "Packed argument types must match veo_stubs_arg_type");
+
+// Call a function with arguments given as an array of type tags and an array
+// of values. Each value occupies the low bytes of a 64-bit word.
+uint64_t veo_call_async_packed(struct veo_thr_ctxt *ctx, uint64_t addr,
+                               const uint8_t *types, const uint64_t *vals,
+                               int nargs)
+{
+    if (nargs < 0 || (nargs > 0 && (types == NULL || vals == NULL))) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    for (int i = 0; i < nargs; i++) {
+        if (types[i] > VEO_PACKED_FLOAT) {
+            return VEO_REQUEST_ID_INVALID;
+        }
+    }
+
+    uint64_t reqid = ctx->issue_reqid();
+
+    const uint8_t *vals_begin = reinterpret_cast<const uint8_t *>(vals);
+
+    json req = {
+        {"cmd", VS_CMD_CALL_ASYNC_PACKED},
+        {"reqid", reqid},
+        {"addr", addr},
+        {"types", json::binary(std::vector<uint8_t>(types, types + nargs))},
+        {"vals", json::binary(std::vector<uint8_t>(
+                     vals_begin, vals_begin + nargs * sizeof(uint64_t)))}};
+
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
 
     return reqid;
 }
@@ -450,26 +1235,106 @@ uint64_t veo_call_async_by_name(struct veo_thr_ctxt *ctx, uint64_t libhdl,
                 {"copy_in", copy_in_for_stack_args(argp)},
                 {"copy_out", copy_out_for_stack_args(argp)}};
 
-    ctx->submit_request(req);
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
 
     return reqid;
 }
 
+static json _batch_calls(struct veo_thr_ctxt *ctx, struct veo_args **argps,
+                         int n, uint64_t *reqids)
+{
+    json calls = json::array();
+
+    for (int i = 0; i < n; i++) {
+        reqids[i] = ctx->issue_reqid();
+
+        calls.push_back({{"reqid", reqids[i]},
+                         {"args", *argps[i]},
+                         {"copy_in", copy_in_for_stack_args(argps[i])},
+                         {"copy_out", copy_out_for_stack_args(argps[i])}});
+    }
+
+    return calls;
+}
+
+int veo_call_async_batch(struct veo_thr_ctxt *ctx, uint64_t addr,
+                         struct veo_args **argps, int n, uint64_t *reqids)
+{
+    if (n <= 0) {
+        return -1;
+    }
+
+    json calls = _batch_calls(ctx, argps, n, reqids);
+
+    if (!ctx->submit_request({{"cmd", VS_CMD_CALL_ASYNC_BATCH},
+                             {"reqid", reqids[0]},
+                             {"addr", addr},
+                             {"calls", calls}},
+                             true)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int veo_call_async_batch_by_name(struct veo_thr_ctxt *ctx, uint64_t libhdl,
+                                 const char *symname, struct veo_args **argps,
+                                 int n, uint64_t *reqids)
+{
+    if (n <= 0) {
+        return -1;
+    }
+
+    json calls = _batch_calls(ctx, argps, n, reqids);
+
+    if (!ctx->submit_request({{"cmd", VS_CMD_CALL_ASYNC_BATCH_BY_NAME},
+                             {"reqid", reqids[0]},
+                             {"libhdl", libhdl},
+                             {"symname", symname},
+                             {"calls", calls}},
+                             true)) {
+        return -1;
+    }
+
+    return 0;
+}
+
 int veo_call_sync(struct veo_proc_handle *proc, uint64_t addr,
                   struct veo_args *args, uint64_t *result)
 {
-    struct veo_thr_ctxt *ctx = proc->default_context;
+    struct veo_thr_ctxt *ctx = _default_context(proc);
+    if (ctx == NULL) {
+        return VEO_COMMAND_ERROR;
+    }
 
-    uint64_t reqid = veo_call_async(ctx, addr, args);
+    // Synchronous functions block instead of failing at the limits
+    uint64_t reqid = _call_async(ctx, addr, args, false);
+    if (reqid == VEO_REQUEST_ID_INVALID) {
+        return VEO_COMMAND_ERROR;
+    }
 
     return veo_call_wait_result(ctx, reqid, result);
 }
 
+// Translate a result received from the VE into a command state
+static int _result_state(const json &result, uint64_t *retp)
+{
+    if (result.contains("cancelled")) {
+        return VEO_COMMAND_ERROR;
+    }
+
+    *retp = result["result"];
+
+    return VEO_COMMAND_OK;
+}
+
 // TODO how do we now this reqid is valid?
 int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid,
                          uint64_t *retp)
 {
-    spdlog::debug("Waiting for request {}", reqid);
+    VS_DEBUG("Waiting for request {}", reqid);
 
     json result;
     if (!ctx->wait_result(reqid, result)) {
@@ -477,36 +1342,177 @@ int veo_call_wait_result(struct veo_thr_ctxt *ctx, uint64_t reqid,
         return VEO_COMMAND_ERROR;
     }
 
-    *retp = result["result"];
-
-    spdlog::debug("Request {} completed", reqid);
+    VS_DEBUG("Request {} completed", reqid);
 
     // TODO return VEO_COMMAND_ERROR if symbol cannot be found
     // TODO return VEO_COMMAND_ERROR if reqid is invalid
     // TODO what if the command has already finished?
 
-    return VEO_COMMAND_OK;
+    return _result_state(result, retp);
+}
+
+int veo_call_wait_result_timeout(struct veo_thr_ctxt *ctx, uint64_t reqid,
+                                 uint64_t timeout_us, uint64_t *retp)
+{
+    VS_DEBUG("Waiting for request {} up to {} us", reqid, timeout_us);
+
+    // Deadlines this far out would overflow the clock, so wait without one
+    constexpr uint64_t MAX_TIMEOUT_US =
+        std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::duration::max())
+            .count() /
+        2;
+
+    json result;
+    bool timed_out = false;
+    bool finished =
+        timeout_us > MAX_TIMEOUT_US
+            ? ctx->wait_result(reqid, result)
+            : ctx->wait_result_for(reqid,
+                                   std::chrono::microseconds(timeout_us),
+                                   result, timed_out);
+
+    if (!finished) {
+        if (timed_out) {
+            VS_DEBUG("Request {} timed out", reqid);
+            return VEO_COMMAND_UNFINISHED;
+        }
+
+        spdlog::error("Context is not running");
+        return VEO_COMMAND_ERROR;
+    }
+
+    VS_DEBUG("Request {} completed", reqid);
+
+    return _result_state(result, retp);
 }
 
 int veo_call_peek_result(struct veo_thr_ctxt *ctx, uint64_t reqid,
                          uint64_t *retp)
 {
-    spdlog::debug("Peeking request {}", reqid);
+    VS_DEBUG("Peeking request {}", reqid);
 
     json result;
     bool finished = ctx->peek_result(reqid, result);
 
     if (!finished) {
-        spdlog::debug("Request {} is pending", reqid);
+        VS_DEBUG("Request {} is pending", reqid);
 
         return VEO_COMMAND_UNFINISHED;
     }
 
-    *retp = result["result"];
+    return _result_state(result, retp);
+}
+
+int veo_context_vtime(struct veo_thr_ctxt *ctx, uint64_t *vtime)
+{
+    *vtime = ctx->vtime;
+
+    return 0;
+}
+
+int veo_call_peek_vtime(struct veo_thr_ctxt *ctx, uint64_t reqid,
+                        uint64_t *vstart, uint64_t *vend)
+{
+    std::lock_guard<std::mutex> lock(ctx->results_mtx);
+
+    const auto it = ctx->results.find(reqid);
+
+    if (it == ctx->results.end()) {
+        return VEO_COMMAND_UNFINISHED;
+    }
+    if (!it->second.contains("vend")) {
+        return VEO_COMMAND_ERROR;
+    }
+
+    *vstart = it->second["vstart"].get<uint64_t>();
+    *vend = it->second["vend"].get<uint64_t>();
 
     return VEO_COMMAND_OK;
 }
 
+int veo_call_wait_any(const struct veo_call_handle *calls, int n, int *idx,
+                      uint64_t *retp)
+{
+    // Nothing to wait for
+    if (n <= 0) {
+        spdlog::error("No requests to wait for");
+        *idx = -1;
+        return VEO_COMMAND_ERROR;
+    }
+
+    while (true) {
+        uint64_t gen = completions.current();
+
+        for (int i = 0; i < n; i++) {
+            json result;
+
+            if (calls[i].ctx->peek_result(calls[i].reqid, result)) {
+                *idx = i;
+                return _result_state(result, retp);
+            }
+
+            if (!calls[i].ctx->is_running) {
+                spdlog::error("Context is not running");
+                *idx = i;
+                return VEO_COMMAND_ERROR;
+            }
+        }
+
+        completions.wait_change(gen);
+    }
+}
+
+int veo_call_wait_all(const struct veo_call_handle *calls, int n,
+                      uint64_t *retps)
+{
+    std::vector<bool> done(n, false);
+    int remaining = n;
+    int state = VEO_COMMAND_OK;
+
+    while (remaining > 0) {
+        uint64_t gen = completions.current();
+
+        for (int i = 0; i < n; i++) {
+            if (done[i]) continue;
+
+            json result;
+
+            if (calls[i].ctx->peek_result(calls[i].reqid, result)) {
+                if (_result_state(result, &retps[i]) != VEO_COMMAND_OK) {
+                    state = VEO_COMMAND_ERROR;
+                }
+            } else if (!calls[i].ctx->is_running) {
+                spdlog::error("Context is not running");
+                state = VEO_COMMAND_ERROR;
+            } else {
+                continue;
+            }
+
+            done[i] = true;
+            remaining--;
+        }
+
+        if (remaining > 0) {
+            completions.wait_change(gen);
+        }
+    }
+
+    return state;
+}
+
+int veo_call_cancel(struct veo_thr_ctxt *ctx, uint64_t reqid)
+{
+    if (!ctx->cancel_request(reqid)) {
+        VS_DEBUG("Request {} has already been sent to VE", reqid);
+        return -1;
+    }
+
+    VS_DEBUG("Request {} cancelled", reqid);
+
+    return 0;
+}
+
 uint64_t veo_async_read_mem(struct veo_thr_ctxt *ctx, void *dst, uint64_t src,
                             size_t size)
 {
@@ -519,7 +1525,9 @@ uint64_t veo_async_read_mem(struct veo_thr_ctxt *ctx, void *dst, uint64_t src,
                 {"reqid", reqid},
                 {"copy_out", json::array({desc})}};
 
-    ctx->submit_request(req);
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
 
     return reqid;
 }
@@ -537,7 +1545,285 @@ uint64_t veo_async_write_mem(struct veo_thr_ctxt *ctx, uint64_t dst,
                 {"reqid", reqid},
                 {"copy_in", json::array({desc})}};
 
-    ctx->submit_request(req);
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+// Describe a copy of height rows of width bytes. Returns false if the rows
+// would overlap on either side.
+static bool _make_2d_descriptor(copy_descriptor &desc, size_t ve_pitch,
+                                size_t vh_pitch, size_t width, size_t height)
+{
+    if (width > ve_pitch || width > vh_pitch) {
+        errno = EINVAL;
+        return false;
+    }
+
+    desc.len = width * height;
+    desc.width = width;
+    desc.ve_pitch = ve_pitch;
+    desc.vh_pitch = vh_pitch;
+
+    return true;
+}
+
+uint64_t veo_async_read_mem_2d(struct veo_thr_ctxt *ctx, void *dst,
+                               size_t dpitch, uint64_t src, size_t spitch,
+                               size_t width, size_t height)
+{
+    copy_descriptor desc{reinterpret_cast<uint8_t *>(src),
+                         reinterpret_cast<uint8_t *>(dst), 0};
+
+    if (!_make_2d_descriptor(desc, spitch, dpitch, width, height)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    uint64_t reqid = ctx->issue_reqid();
+
+    json req = {{"cmd", VS_CMD_ASYNC_READ_MEM},
+                {"reqid", reqid},
+                {"copy_out", json::array({desc})}};
+
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+uint64_t veo_async_write_mem_2d(struct veo_thr_ctxt *ctx, uint64_t dst,
+                                size_t dpitch, const void *src, size_t spitch,
+                                size_t width, size_t height)
+{
+    copy_descriptor desc{reinterpret_cast<uint8_t *>(dst),
+                         reinterpret_cast<uint8_t *>(const_cast<void *>(src)),
+                         0};
+
+    if (!_make_2d_descriptor(desc, dpitch, spitch, width, height)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    uint64_t reqid = ctx->issue_reqid();
+
+    json req = {{"cmd", VS_CMD_ASYNC_WRITE_MEM},
+                {"reqid", reqid},
+                {"copy_in", json::array({desc})}};
+
+    if (!ctx->submit_request(req, true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+uint64_t veo_async_write_mem_from_file(struct veo_thr_ctxt *ctx, uint64_t dst,
+                                       const char *path, off_t offset,
+                                       size_t size)
+{
+    uint64_t reqid = ctx->issue_reqid();
+
+    if (!ctx->submit_request({{"cmd", VS_CMD_WRITE_MEM_FROM_FILE},
+                             {"reqid", reqid},
+                             {"dst", dst},
+                             {"path", path},
+                             {"offset", offset},
+                             {"size", size}},
+                             true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+uint64_t veo_async_read_mem_to_file(struct veo_thr_ctxt *ctx, const char *path,
+                                    off_t offset, uint64_t src, size_t size)
+{
+    uint64_t reqid = ctx->issue_reqid();
+
+    if (!ctx->submit_request({{"cmd", VS_CMD_READ_MEM_TO_FILE},
+                             {"reqid", reqid},
+                             {"src", src},
+                             {"path", path},
+                             {"offset", offset},
+                             {"size", size}},
+                             true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    return reqid;
+}
+
+int veo_context_event_fd(struct veo_thr_ctxt *ctx)
+{
+    return ctx->get_event_fd();
+}
+
+struct veo_graph *veo_graph_alloc(void) { return new veo_graph; }
+
+void veo_graph_free(struct veo_graph *graph)
+{
+    if (graph->ctx != NULL) {
+        struct veo_thr_ctxt *ctx = graph->ctx;
+        uint64_t reqid = ctx->issue_reqid();
+
+        ctx->submit_request({{"cmd", VS_CMD_GRAPH_DESTROY},
+                             {"reqid", reqid},
+                             {"graph", graph->id}});
+
+        json result;
+        ctx->wait_result(reqid, result);
+
+        ctx->graphs.erase(
+            std::find(ctx->graphs.begin(), ctx->graphs.end(), graph));
+    }
+
+    delete graph;
+}
+
+static int _graph_add_node(struct veo_graph *graph, graph_node node)
+{
+    // Nodes cannot be added once the graph is resident on the VE
+    if (graph->ctx != NULL) {
+        return -1;
+    }
+
+    graph->nodes.push_back(node);
+
+    return graph->nodes.size() - 1;
+}
+
+int veo_graph_add_write_mem(struct veo_graph *graph, uint64_t dst,
+                            const void *src, size_t size)
+{
+    return _graph_add_node(
+        graph, {VS_GRAPH_NODE_WRITE_MEM, dst,
+                reinterpret_cast<uint8_t *>(const_cast<void *>(src)), size});
+}
+
+int veo_graph_add_call(struct veo_graph *graph, uint64_t addr,
+                       struct veo_args *argp)
+{
+    // Stack arguments would require copy-in/out on every launch
+    for (const auto &arg : argp->args) {
+        if (arg.val.index() == VS_ARG_TYPE_STACK) {
+            spdlog::error("Stack arguments are not supported in graphs");
+            return -1;
+        }
+    }
+
+    return _graph_add_node(graph,
+                           {VS_GRAPH_NODE_CALL, 0, NULL, 0, addr, *argp});
+}
+
+int veo_graph_add_read_mem(struct veo_graph *graph, void *dst, uint64_t src,
+                           size_t size)
+{
+    return _graph_add_node(graph, {VS_GRAPH_NODE_READ_MEM, src,
+                                   reinterpret_cast<uint8_t *>(dst), size});
+}
+
+int veo_graph_set_call_args(struct veo_graph *graph, int idx,
+                            struct veo_args *argp)
+{
+    if (idx < 0 || static_cast<size_t>(idx) >= graph->nodes.size() ||
+        graph->nodes[idx].type != VS_GRAPH_NODE_CALL) {
+        return -1;
+    }
+
+    for (const auto &arg : argp->args) {
+        if (arg.val.index() == VS_ARG_TYPE_STACK) {
+            spdlog::error("Stack arguments are not supported in graphs");
+            return -1;
+        }
+    }
+
+    graph->nodes[idx].args = *argp;
+    graph->nodes[idx].dirty = true;
+
+    return 0;
+}
+
+int veo_graph_instantiate(struct veo_thr_ctxt *ctx, struct veo_graph *graph)
+{
+    if (graph->ctx != NULL) {
+        return -1;
+    }
+
+    json nodes = json::array();
+
+    for (auto &node : graph->nodes) {
+        nodes.push_back({{"type", node.type},
+                         {"ve_ptr", node.ve_ptr},
+                         {"len", node.len},
+                         {"addr", node.addr},
+                         {"args", node.args}});
+        node.dirty = false;
+    }
+
+    uint64_t reqid = ctx->issue_reqid();
+
+    ctx->submit_request(
+        {{"cmd", VS_CMD_GRAPH_CREATE}, {"reqid", reqid}, {"nodes", nodes}});
+
+    json result;
+    if (!ctx->wait_result(reqid, result)) {
+        return -1;
+    }
+
+    graph->ctx = ctx;
+    graph->id = result["result"];
+    ctx->graphs.push_back(graph);
+
+    return 0;
+}
+
+uint64_t veo_graph_launch(struct veo_thr_ctxt *ctx, struct veo_graph *graph)
+{
+    if (graph->ctx == NULL || graph->ctx->proc != ctx->proc) {
+        return VEO_REQUEST_ID_INVALID;
+    }
+
+    json patches = json::array();
+    json copy_in = json::array();
+    json copy_out = json::array();
+
+    for (size_t i = 0; i < graph->nodes.size(); i++) {
+        auto &node = graph->nodes[i];
+
+        switch (node.type) {
+        case VS_GRAPH_NODE_WRITE_MEM:
+            copy_in.push_back(
+                copy_descriptor{reinterpret_cast<uint8_t *>(node.ve_ptr),
+                                node.vh_ptr, node.len});
+            break;
+        case VS_GRAPH_NODE_CALL:
+            if (node.dirty) {
+                patches.push_back({{"node", i}, {"args", node.args}});
+                node.dirty = false;
+            }
+            break;
+        case VS_GRAPH_NODE_READ_MEM:
+            copy_out.push_back(
+                copy_descriptor{reinterpret_cast<uint8_t *>(node.ve_ptr),
+                                node.vh_ptr, node.len});
+            break;
+        }
+    }
+
+    uint64_t reqid = ctx->issue_reqid();
+
+    if (!ctx->submit_request({{"cmd", VS_CMD_GRAPH_LAUNCH},
+                             {"reqid", reqid},
+                             {"graph", graph->id},
+                             {"patches", patches},
+                             {"copy_in", copy_in},
+                             {"copy_out", copy_out}},
+                             true)) {
+        return VEO_REQUEST_ID_INVALID;
+    }
 
     return reqid;
 }
@@ -574,7 +1860,7 @@ struct veo_args *veo_args_alloc(void) { return new veo_args; }
 
 void veo_args_free(struct veo_args *ca) { delete ca; }
 
-void veo_args_clear(struct veo_args *ca) { ca->args.clear(); }
+void veo_args_clear(struct veo_args *ca) { ca->clear(); }
 
 int veo_args_set_i64(struct veo_args *ca, int argnum, int64_t val)
 {
@@ -1,12 +1,33 @@
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <deque>
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <sched.h>
+#include <sstream>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#else
+#include <poll.h>
+#endif
+
 #include <ffi.h>
 #include <spdlog/cfg/env.h>
 #include <spdlog/spdlog.h>
@@ -14,7 +35,746 @@
 #include "stub.hpp"
 #include "ve_offload.h"
 
-static void handle_load_library(int sock, const json &req)
+enum ve_hugepage_mode {
+    VE_HUGEPAGE_NONE,
+    VE_HUGEPAGE_THP,
+    VE_HUGEPAGE_HUGETLB,
+};
+
+static const size_t HUGEPAGE_SIZE = 2 * 1024 * 1024;
+
+static ve_hugepage_mode hugepage_mode = VE_HUGEPAGE_NONE;
+
+// Mapping that backs a buffer. The buffer may start inside the mapping.
+struct ve_mapping {
+    void *start;
+    size_t len;
+};
+
+// Buffers backed by mmap (instead of malloc) and their mappings
+static std::unordered_map<uint64_t, ve_mapping> mapped_bufs;
+static std::mutex mapped_bufs_mtx;
+
+static void *_alloc_mapped(size_t size)
+{
+    size_t len = (size + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+    void *ptr = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (hugepage_mode == VE_HUGEPAGE_HUGETLB) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+        if (ptr == MAP_FAILED) {
+            spdlog::warn("No explicit huge pages available, falling back to "
+                         "transparent huge pages");
+        }
+    }
+#endif
+
+    if (ptr == MAP_FAILED) {
+        // Over-allocate so that the buffer can be aligned to a huge page
+        uint8_t *raw =
+            static_cast<uint8_t *>(mmap(NULL, len + HUGEPAGE_SIZE,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+
+        uintptr_t addr = reinterpret_cast<uintptr_t>(raw);
+        uintptr_t aligned =
+            (addr + HUGEPAGE_SIZE - 1) / HUGEPAGE_SIZE * HUGEPAGE_SIZE;
+
+        if (aligned > addr) {
+            munmap(raw, aligned - addr);
+        }
+        munmap(reinterpret_cast<uint8_t *>(aligned) + len,
+               addr + HUGEPAGE_SIZE - aligned);
+
+        ptr = reinterpret_cast<void *>(aligned);
+
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+    }
+
+    std::lock_guard<std::mutex> lock(mapped_bufs_mtx);
+    mapped_bufs.insert({reinterpret_cast<uint64_t>(ptr), {ptr, len}});
+
+    return ptr;
+}
+
+static void *ve_alloc(size_t size)
+{
+    if (hugepage_mode == VE_HUGEPAGE_NONE) {
+        return malloc(size);
+    }
+
+    return _alloc_mapped(size);
+}
+
+static void ve_free(void *ptr)
+{
+    {
+        std::lock_guard<std::mutex> lock(mapped_bufs_mtx);
+
+        const auto it = mapped_bufs.find(reinterpret_cast<uint64_t>(ptr));
+
+        if (it != mapped_bufs.end()) {
+            munmap(it->second.start, it->second.len);
+            mapped_bufs.erase(it);
+            return;
+        }
+    }
+
+    free(ptr);
+}
+
+// Buffer allocated through veo_alloc_mem
+struct ve_buffer {
+    uint64_t size;
+    uint64_t reqid;
+    // Return address of the veo_alloc_mem call on the VH
+    uint64_t site;
+};
+
+// Accounting of live buffers. A limit of zero means unlimited.
+static std::unordered_map<uint64_t, ve_buffer> live_bufs;
+static uint64_t mem_current = 0;
+static uint64_t mem_peak = 0;
+static uint64_t mem_limit = 0;
+static std::mutex live_bufs_mtx;
+
+// Parse a cpulist string such as "0-3,8,10-11"
+static std::vector<int> parse_cpulist(const std::string &str)
+{
+    std::vector<int> cpus;
+    std::stringstream ss(str);
+    std::string range;
+
+    while (std::getline(ss, range, ',')) {
+        if (range.empty()) continue;
+
+        size_t dash = range.find('-');
+        int first = std::stoi(range.substr(0, dash));
+        int last =
+            dash == std::string::npos ? first
+                                      : std::stoi(range.substr(dash + 1));
+
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+static int num_numa_nodes()
+{
+    std::ifstream ifs("/sys/devices/system/node/online");
+    std::string online;
+
+    if (!std::getline(ifs, online)) {
+        return 1;
+    }
+
+    std::vector<int> nodes = parse_cpulist(online);
+
+    return nodes.empty() ? 1 : nodes.size();
+}
+
+#ifdef __linux__
+static std::vector<int> numa_node_cpus(int node)
+{
+    std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) +
+                      "/cpulist");
+    std::string cpulist;
+
+    if (!std::getline(ifs, cpulist)) {
+        return {};
+    }
+
+    return parse_cpulist(cpulist);
+}
+
+static int numa_node_of_cpu(int cpu)
+{
+    for (int node = 0; node < num_numa_nodes(); node++) {
+        std::vector<int> cpus = numa_node_cpus(node);
+
+        if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+            return node;
+        }
+    }
+
+    return 0;
+}
+
+// CPUs this process may run on
+static std::vector<int> allowed_cpus()
+{
+    std::vector<int> cpus;
+    cpu_set_t cpuset;
+
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &cpuset)) cpus.push_back(cpu);
+        }
+    }
+
+    return cpus;
+}
+
+// Bind this process and all threads created afterwards to the given CPUs
+static bool set_affinity(const std::vector<int> &cpus)
+{
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+
+    for (int cpu : cpus) {
+        if (cpu >= 0 && cpu < CPU_SETSIZE) CPU_SET(cpu, &cpuset);
+    }
+
+    return sched_setaffinity(0, sizeof(cpuset), &cpuset) == 0;
+}
+
+// Prefer (rather than strictly bind to) the given node so that allocations
+// do not fail when the node runs out of memory
+static void prefer_numa_node(int node)
+{
+    unsigned long nodemask[16] = {0};
+    nodemask[node / (8 * sizeof(unsigned long))] |=
+        1UL << (node % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodemask,
+                sizeof(nodemask) * 8) == -1) {
+        spdlog::warn("Failed to set memory policy for NUMA node {}", node);
+    }
+}
+#endif
+
+// Bind this process (memory and all threads created afterwards) to the NUMA
+// node corresponding to the given VE node
+static void bind_numa_node(int32_t venode)
+{
+#ifdef __linux__
+    int node = std::max(venode, 0) % num_numa_nodes();
+    std::vector<int> cpus = numa_node_cpus(node);
+
+    if (cpus.empty()) {
+        spdlog::warn("Cannot read CPUs of NUMA node {}", node);
+        return;
+    }
+
+    if (!set_affinity(cpus)) {
+        spdlog::warn("Failed to bind to CPUs of NUMA node {}", node);
+    }
+    prefer_numa_node(node);
+
+    VS_DEBUG("Bound to NUMA node {}", node);
+#else
+    spdlog::warn("NUMA binding is not supported on this platform");
+#endif
+}
+
+// Look up the CPUs assigned to a VE node. The partition is either "auto" or
+// "auto:<n>", which splits the allowed CPUs into slices of n (8 by default)
+// cores, or an explicit map such as "0=0-7;1=8-15".
+static std::vector<int> partition_cpus(int32_t venode,
+                                       const std::string &partition)
+{
+#ifdef __linux__
+    if (partition.compare(0, 4, "auto") == 0) {
+        size_t slice_size = 8;
+        if (partition.size() > 5 && partition[4] == ':') {
+            slice_size = std::max(std::atoi(partition.c_str() + 5), 1);
+        }
+
+        std::vector<int> cpus = allowed_cpus();
+        if (cpus.size() <= slice_size) {
+            return cpus;
+        }
+
+        size_t num_slices = cpus.size() / slice_size;
+        size_t slice = std::max(venode, 0) % num_slices;
+
+        return std::vector<int>(cpus.begin() + slice * slice_size,
+                                cpus.begin() + (slice + 1) * slice_size);
+    }
+
+    std::stringstream ss(partition);
+    std::string entry;
+
+    while (std::getline(ss, entry, ';')) {
+        size_t eq = entry.find('=');
+
+        if (eq != std::string::npos &&
+            std::atoi(entry.substr(0, eq).c_str()) == venode) {
+            return parse_cpulist(entry.substr(eq + 1));
+        }
+    }
+
+    spdlog::warn("No CPUs assigned to VE node {} in VEO_STUBS_CPU_PARTITION",
+                 venode);
+#else
+    spdlog::warn("CPU partitioning is not supported on this platform");
+#endif
+
+    return {};
+}
+
+static void load_placement_config(int32_t venode)
+{
+    const char *hugepage_env = getenv("VEO_STUBS_HUGEPAGE");
+
+    if (hugepage_env != NULL) {
+        const std::string mode = hugepage_env;
+
+        if (mode == "thp") {
+            hugepage_mode = VE_HUGEPAGE_THP;
+        } else if (mode == "hugetlb") {
+            hugepage_mode = VE_HUGEPAGE_HUGETLB;
+        } else if (mode != "none") {
+            spdlog::warn("Unknown VEO_STUBS_HUGEPAGE value {}", mode);
+        }
+    }
+
+    const char *limit_env = getenv("VEO_STUBS_MEM_LIMIT");
+
+    if (limit_env != NULL) {
+        try {
+            mem_limit = parse_size(limit_env);
+        } catch (const std::exception &) {
+            spdlog::warn("Invalid VEO_STUBS_MEM_LIMIT value {}", limit_env);
+        }
+    }
+
+    const char *numa_env = getenv("VEO_STUBS_NUMA");
+    const bool numa = numa_env != NULL && std::string(numa_env) == "1";
+
+    const char *partition_env = getenv("VEO_STUBS_CPU_PARTITION");
+    std::vector<int> cpus;
+
+    if (partition_env != NULL) {
+        cpus = partition_cpus(venode, partition_env);
+    }
+
+#ifdef __linux__
+    if (!cpus.empty()) {
+        if (!set_affinity(cpus)) {
+            spdlog::warn("Failed to bind to CPUs of VE node {}", venode);
+        }
+
+        // Kernels using OpenMP get one thread per core of the slice, unless
+        // the user has chosen a thread count
+        setenv("OMP_NUM_THREADS", std::to_string(cpus.size()).c_str(), 0);
+
+        // The partition decides the CPUs, so only the memory policy follows
+        // the NUMA node of the slice
+        if (numa) {
+            prefer_numa_node(numa_node_of_cpu(cpus.front()));
+        }
+
+        VS_DEBUG("Bound to {} CPUs starting at CPU {}", cpus.size(),
+                 cpus.front());
+        return;
+    }
+#endif
+
+    if (numa) {
+        bind_numa_node(venode);
+    }
+}
+
+// Optional model of the time an operation would take on a real VE. Costs
+// are accumulated on a virtual clock per connection, and transfers of all
+// connections share a virtual PCIe link.
+struct timing_model {
+    bool enabled = false;
+    // Fixed cost of each transfer in ns
+    double latency = 5000;
+    // Transfer bandwidth in bytes per ns (= GB/s)
+    double bandwidth = 10;
+    // Fixed cost of each kernel launch in ns
+    double launch = 10000;
+    // Factor applied to the kernel execution time measured on the host
+    double kernel_scale = 1;
+    // Delay replies until the modeled time has passed in real time
+    bool realtime = false;
+};
+
+static timing_model timing;
+
+static std::mutex link_mtx;
+static uint64_t link_clock = 0;
+
+static void parse_timing_spec(const std::string &spec)
+{
+    std::stringstream ss(spec);
+    std::string entry;
+
+    while (std::getline(ss, entry, ',')) {
+        entry.erase(std::remove_if(entry.begin(), entry.end(), ::isspace),
+                    entry.end());
+        if (entry.empty() || entry == "default") continue;
+
+        size_t eq = entry.find('=');
+        const std::string key = entry.substr(0, eq);
+        const double val =
+            eq == std::string::npos ? 0 : std::atof(entry.c_str() + eq + 1);
+
+        if (key == "latency") {
+            timing.latency = val * 1000;
+        } else if (key == "bandwidth") {
+            timing.bandwidth = val;
+        } else if (key == "launch") {
+            timing.launch = val * 1000;
+        } else if (key == "kernel_scale") {
+            timing.kernel_scale = val;
+        } else if (key == "realtime") {
+            timing.realtime = val != 0;
+        } else {
+            spdlog::warn("Unknown timing parameter {}", entry);
+        }
+    }
+}
+
+// Read the timing model from VEO_STUBS_TIMING_FILE (one key=value per line)
+// and VEO_STUBS_TIMING (comma separated key=value), in that order
+static void load_timing_config()
+{
+    const char *file_env = getenv("VEO_STUBS_TIMING_FILE");
+    const char *spec_env = getenv("VEO_STUBS_TIMING");
+
+    if (file_env != NULL) {
+        std::ifstream ifs(file_env);
+        std::string line;
+
+        if (!ifs) {
+            spdlog::warn("Cannot open timing model {}", file_env);
+        }
+
+        while (std::getline(ifs, line)) {
+            parse_timing_spec(line.substr(0, line.find('#')));
+        }
+        timing.enabled = true;
+    }
+
+    if (spec_env != NULL) {
+        parse_timing_spec(spec_env);
+        timing.enabled = true;
+    }
+
+    if (timing.enabled) {
+        VS_DEBUG("Timing model: latency {} ns, bandwidth {} GB/s, launch {} "
+                 "ns, kernel scale {}",
+                 timing.latency, timing.bandwidth, timing.launch,
+                 timing.kernel_scale);
+    }
+}
+
+// The request being executed by this thread and when it started
+struct current_request {
+    const json *req = NULL;
+    std::chrono::steady_clock::time_point start;
+};
+
+static thread_local current_request current;
+
+struct timed_scope {
+    timed_scope(const json &req)
+    {
+        if (timing.enabled) {
+            current.req = &req;
+            current.start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~timed_scope() { current.req = NULL; }
+};
+
+// Number of open ordered contexts whose requests run on the thread pool
+static std::atomic<size_t> num_ordered(0);
+
+// A connection from a thread context on the VH
+struct connection {
+    int sock;
+    // Requests may be executed out of order by the thread pool
+    bool unordered = false;
+    // Counted in num_ordered. Set when the first request is queued on an
+    // ordered context.
+    bool reserved = false;
+
+    // Bytes received on sock (non-blocking) that do not form a complete
+    // request yet. Only rlen bytes of rbuf are valid.
+    std::vector<uint8_t> rbuf;
+    size_t rlen = 0;
+
+    // Serializes replies sent from multiple threads
+    std::mutex send_mtx;
+
+    std::mutex mtx;
+    // Requests of an ordered context waiting to be executed
+    std::deque<json> pending;
+    // A pool thread is draining pending
+    bool running = false;
+    // Number of requests of an unordered context dispatched to the thread
+    // pool but not finished
+    int inflight = 0;
+    // Sync requests of an unordered context waiting for inflight to drop to 0
+    std::vector<json> syncs;
+
+#ifdef __linux__
+    // Set if messages are exchanged over shared memory instead of sock
+    std::unique_ptr<shm_transport> shm;
+#endif
+
+    // Virtual time in ns at which the last request finished. Protected by
+    // mtx.
+    uint64_t vclock = 0;
+
+    connection(int sock) : sock(sock) {}
+
+    // The VH sees the connection closed once all requests have finished
+    ~connection()
+    {
+#ifdef __linux__
+        if (shm) shm->tx.close();
+#endif
+        close(sock);
+
+        if (reserved) num_ordered--;
+    }
+};
+
+static uint64_t transfer_cost(uint64_t bytes)
+{
+    return timing.latency + (timing.bandwidth > 0 ? bytes / timing.bandwidth
+                                                  : 0);
+}
+
+static uint64_t transfer_cost(const json &descs)
+{
+    uint64_t cost = 0;
+
+    for (const auto &desc : descs) {
+        cost += transfer_cost(desc["len"].get<uint64_t>());
+    }
+
+    return cost;
+}
+
+// Charge the modeled cost of the current request to the virtual clock of the
+// connection and record the virtual start and end times in the reply.
+// Returns the time (in ns) to wait before replying in realtime mode.
+static uint64_t apply_timing(connection &conn, json &msg)
+{
+    const json *req = current.req;
+    uint64_t elapsed = 0, transfer = 0, compute = 0;
+
+    if (req != NULL) {
+        elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::steady_clock::now() - current.start)
+                      .count();
+        const uint64_t kernel = elapsed * timing.kernel_scale;
+
+        switch ((*req)["cmd"].get<int32_t>()) {
+        case VS_CMD_READ_MEM:
+        case VS_CMD_WRITE_MEM:
+            transfer = transfer_cost((*req)["size"].get<uint64_t>());
+            break;
+        case VS_CMD_ASYNC_READ_MEM:
+            transfer = transfer_cost((*req)["copy_out"]);
+            break;
+        case VS_CMD_ASYNC_WRITE_MEM:
+            transfer = transfer_cost((*req)["copy_in"]);
+            break;
+        case VS_CMD_CALL_ASYNC:
+        case VS_CMD_CALL_ASYNC_BY_NAME:
+        case VS_CMD_CALL_ASYNC_PACKED:
+            if (req->contains("copy_in")) {
+                transfer = transfer_cost((*req)["copy_in"]) +
+                           transfer_cost((*req)["copy_out"]);
+            }
+            compute = timing.launch + kernel;
+            break;
+        case VS_CMD_CALL_ASYNC_BATCH:
+        case VS_CMD_CALL_ASYNC_BATCH_BY_NAME:
+            // Stack arguments of each call are copied as for a single call
+            for (const auto &call : (*req)["calls"]) {
+                if (call.contains("copy_in")) {
+                    transfer += transfer_cost(call["copy_in"]) +
+                                transfer_cost(call["copy_out"]);
+                }
+            }
+            compute = (*req)["calls"].size() * timing.launch + kernel;
+            break;
+        case VS_CMD_GRAPH_LAUNCH:
+            // A graph is launched once regardless of its number of calls
+            transfer = transfer_cost((*req)["copy_in"]) +
+                       transfer_cost((*req)["copy_out"]);
+            compute = timing.launch + kernel;
+            break;
+        default:
+            break;
+        }
+    }
+
+    uint64_t start, end;
+    {
+        std::lock_guard<std::mutex> lock(conn.mtx);
+
+        start = conn.vclock;
+
+        // Transfers of all connections are serialized on the link
+        if (transfer > 0) {
+            std::lock_guard<std::mutex> lock(link_mtx);
+
+            start = std::max(start, link_clock);
+            link_clock = start + transfer;
+        }
+
+        end = start + transfer + compute;
+        conn.vclock = end;
+    }
+
+    if (msg.contains("results")) {
+        // Split the time of a batch evenly among its calls
+        auto &results = msg["results"];
+        const uint64_t n = std::max<uint64_t>(results.size(), 1);
+
+        for (uint64_t i = 0; i < results.size(); i++) {
+            results[i]["vstart"] = start + (end - start) * i / n;
+            results[i]["vend"] = start + (end - start) * (i + 1) / n;
+        }
+    } else {
+        msg["vstart"] = start;
+        msg["vend"] = end;
+    }
+
+    return end - start > elapsed ? end - start - elapsed : 0;
+}
+
+static bool send_reply(connection &conn, const json &msg)
+{
+    std::lock_guard<std::mutex> lock(conn.send_mtx);
+
+#ifdef __linux__
+    if (conn.shm) {
+        return send_msg(conn.shm->tx, msg);
+    }
+#endif
+    return send_msg(conn.sock, msg);
+}
+
+static bool reply(connection &conn, const json &msg)
+{
+    if (!timing.enabled) {
+        return send_reply(conn, msg);
+    }
+
+    json timed = msg;
+    uint64_t delay = apply_timing(conn, timed);
+
+    if (timing.realtime && delay > 0) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(delay));
+    }
+
+    return send_reply(conn, timed);
+}
+
+// Loaded libraries and resolved symbols, kept for checkpoints
+struct ve_library {
+    std::string name;
+    uint64_t refcount;
+};
+
+struct ve_symbol {
+    uint64_t libhdl;
+    std::string name;
+};
+
+static std::unordered_map<uint64_t, ve_library> loaded_libs;
+// Handles of loaded libraries in the order they were first loaded
+static std::vector<uint64_t> lib_order;
+static std::unordered_map<uint64_t, ve_symbol> resolved_syms;
+static std::mutex loaded_libs_mtx;
+
+// Count references to a library. Must be called with loaded_libs_mtx held.
+static void _track_library(uint64_t handle, const std::string &name,
+                           uint64_t refcount)
+{
+    ve_library &lib = loaded_libs[handle];
+
+    if (lib.refcount == 0) {
+        lib_order.push_back(handle);
+    }
+
+    lib.name = name;
+    lib.refcount += refcount;
+}
+
+// Libraries and symbols loaded at startup, sent to libveo when the default
+// context is opened as [[name, handle]] and [[libhdl, name, addr]]
+static json preloaded = {{"libs", json::array()}, {"syms", json::array()}};
+
+// Load the libraries in VEO_STUBS_PRELOAD (separated by colons) with all
+// symbols bound immediately, and resolve the symbols in VEO_STUBS_PREBIND
+// (separated by commas) in each of them
+static void preload_libraries()
+{
+    const char *preload_env = getenv("VEO_STUBS_PRELOAD");
+    const char *prebind_env = getenv("VEO_STUBS_PREBIND");
+
+    if (preload_env == NULL) {
+        return;
+    }
+
+    std::vector<std::string> symnames;
+    std::stringstream syms_ss(prebind_env ? prebind_env : "");
+    std::string symname;
+
+    while (std::getline(syms_ss, symname, ',')) {
+        if (!symname.empty()) symnames.push_back(symname);
+    }
+
+    std::stringstream libs_ss(preload_env);
+    std::string libname;
+
+    std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+    while (std::getline(libs_ss, libname, ':')) {
+        if (libname.empty()) continue;
+
+        void *libhdl = dlopen(libname.c_str(), RTLD_NOW);
+
+        if (libhdl == NULL) {
+            spdlog::error("{}", dlerror());
+            continue;
+        }
+
+        const uint64_t handle = reinterpret_cast<uint64_t>(libhdl);
+
+        _track_library(handle, libname, 1);
+
+        preloaded["libs"].push_back({libname, handle});
+
+        for (const auto &name : symnames) {
+            void *fn = dlsym(libhdl, name.c_str());
+            if (fn == NULL) continue;
+
+            const uint64_t addr = reinterpret_cast<uint64_t>(fn);
+
+            resolved_syms[addr] = {handle, name};
+            preloaded["syms"].push_back({handle, name, addr});
+        }
+
+        VS_DEBUG("Preloaded {}", libname);
+    }
+}
+
+static void handle_load_library(connection &conn, const json &req)
 {
     std::string libname = req["libname"];
 
@@ -22,22 +782,48 @@ static void handle_load_library(int sock, const json &req)
 
     if (libhdl == NULL) {
         spdlog::error("{}", dlerror());
+    } else {
+        std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+        _track_library(reinterpret_cast<uint64_t>(libhdl), libname, 1);
     }
 
-    send_msg(sock, {{"result", reinterpret_cast<uint64_t>(libhdl)},
+    reply(conn, {{"result", reinterpret_cast<uint64_t>(libhdl)},
                     {"reqid", req["reqid"]}});
 }
 
-static void handle_unload_library(int sock, const json &req)
+static void handle_unload_library(connection &conn, const json &req)
 {
     void *libhdl = reinterpret_cast<void *>((req["libhdl"].get<uint64_t>()));
 
     int32_t result = dlclose(libhdl);
 
-    send_msg(sock, {{"result", result}, {"reqid", req["reqid"]}});
+    if (result == 0) {
+        std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+        const uint64_t handle = reinterpret_cast<uint64_t>(libhdl);
+        const auto it = loaded_libs.find(handle);
+
+        if (it != loaded_libs.end() && --it->second.refcount == 0) {
+            loaded_libs.erase(it);
+            lib_order.erase(
+                std::find(lib_order.begin(), lib_order.end(), handle));
+
+            for (auto sym = resolved_syms.begin();
+                 sym != resolved_syms.end();) {
+                if (sym->second.libhdl == handle) {
+                    sym = resolved_syms.erase(sym);
+                } else {
+                    ++sym;
+                }
+            }
+        }
+    }
+
+    reply(conn, {{"result", result}, {"reqid", req["reqid"]}});
 }
 
-static void handle_get_sym(int sock, const json &req)
+static void handle_get_sym(connection &conn, const json &req)
 {
     void *libhdl = reinterpret_cast<void *>((req["libhdl"].get<uint64_t>()));
     std::string symname = req["symname"];
@@ -46,49 +832,498 @@ static void handle_get_sym(int sock, const json &req)
 
     if (fn == NULL) {
         spdlog::error("{}", dlerror());
+    } else {
+        std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+        resolved_syms[reinterpret_cast<uint64_t>(fn)] = {
+            reinterpret_cast<uint64_t>(libhdl), symname};
+    }
+
+    reply(conn, {{"result", reinterpret_cast<uint64_t>(fn)},
+                    {"reqid", req["reqid"]}});
+}
+
+// Resolve many symbols at once. A handle of zero searches all loaded
+// libraries. The result is an array with zero for unresolved symbols.
+static void handle_get_syms(connection &conn, const json &req)
+{
+    const uint64_t libhdl = req["libhdl"];
+    std::vector<uint64_t> addrs;
+
+    std::unique_lock<std::mutex> lock(loaded_libs_mtx);
+
+    for (const auto &symname : req["symnames"]) {
+        const std::string name = symname;
+        uint64_t handle = libhdl;
+        void *fn = NULL;
+
+        if (libhdl != 0) {
+            fn = dlsym(reinterpret_cast<void *>(libhdl), name.c_str());
+        } else {
+            // Libraries loaded earlier take precedence
+            for (uint64_t lib : lib_order) {
+                fn = dlsym(reinterpret_cast<void *>(lib), name.c_str());
+
+                if (fn != NULL) {
+                    handle = lib;
+                    break;
+                }
+            }
+        }
+
+        if (fn == NULL) {
+            spdlog::error("Cannot find symbol {}", name);
+        } else {
+            resolved_syms[reinterpret_cast<uint64_t>(fn)] = {handle, name};
+        }
+
+        addrs.push_back(reinterpret_cast<uint64_t>(fn));
+    }
+
+    lock.unlock();
+
+    reply(conn, {{"result", addrs}, {"reqid", req["reqid"]}});
+}
+
+static void handle_alloc_mem(connection &conn, const json &req)
+{
+    uint64_t size = req["size"];
+
+    // Reserve the size first so that concurrent allocations cannot exceed
+    // the limit together
+    {
+        std::unique_lock<std::mutex> lock(live_bufs_mtx);
+
+        if (mem_limit > 0 && mem_current + size > mem_limit) {
+            spdlog::warn("Allocating {} bytes exceeds the memory limit ({} of "
+                         "{} bytes in use)",
+                         size, mem_current, mem_limit);
+            lock.unlock();
+
+            reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
+            return;
+        }
+
+        mem_current += size;
     }
 
-    send_msg(sock, {{"result", reinterpret_cast<uint64_t>(fn)},
+    void *ptr = ve_alloc(size);
+
+    {
+        std::lock_guard<std::mutex> lock(live_bufs_mtx);
+
+        if (ptr == NULL) {
+            mem_current -= size;
+        } else {
+            live_bufs[reinterpret_cast<uint64_t>(ptr)] = {
+                size, req["reqid"], req.value("site", uint64_t(0))};
+            mem_peak = std::max(mem_peak, mem_current);
+        }
+    }
+
+    reply(conn, {{"result", reinterpret_cast<uint64_t>(ptr)},
                     {"reqid", req["reqid"]}});
 }
 
-static void handle_alloc_mem(int sock, const json &req)
+static void handle_free_mem(connection &conn, json req)
 {
+    uint64_t addr = req["addr"];
+
+    {
+        std::lock_guard<std::mutex> lock(live_bufs_mtx);
+
+        const auto it = live_bufs.find(addr);
+        if (it != live_bufs.end()) {
+            mem_current -= it->second.size;
+            live_bufs.erase(it);
+        } else if (addr != 0) {
+            spdlog::warn("Freeing unknown buffer {:#x}", addr);
+        }
+    }
+
+    ve_free(reinterpret_cast<void *>(addr));
+
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
+}
+
+static void handle_get_mem_usage(connection &conn, const json &req)
+{
+    json res = {{"result", 0}, {"reqid", req["reqid"]}};
+
+    {
+        std::lock_guard<std::mutex> lock(live_bufs_mtx);
+
+        res["current"] = mem_current;
+        res["peak"] = mem_peak;
+        res["limit"] = mem_limit;
+        res["num_buffers"] = live_bufs.size();
+
+        // Each buffer is sent as [addr, size, reqid, site]
+        if (req.value("buffers", false)) {
+            json bufs = json::array();
+            for (const auto &entry : live_bufs) {
+                bufs.push_back({entry.first, entry.second.size,
+                                entry.second.reqid, entry.second.site});
+            }
+            res["buffers"] = bufs;
+        }
+    }
+
+    reply(conn, res);
+}
+
+static void handle_read_mem(connection &conn, const json &req)
+{
+    const uint8_t *src =
+        reinterpret_cast<uint8_t *>(req["src"].get<uint64_t>());
     uint64_t size = req["size"];
-    const void *ptr = malloc(size);
 
-    send_msg(sock, {{"result", reinterpret_cast<uint64_t>(ptr)},
-                    {"reqid", req["reqid"]}});
-}
+    std::vector<uint8_t> data(src, src + size);
+
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}, {"data", data}});
+}
+
+static void handle_write_mem(connection &conn, const json &req)
+{
+    uint8_t *dst = reinterpret_cast<uint8_t *>(req["dst"].get<uint64_t>());
+    uint64_t size = req["size"];
+    std::vector<uint8_t> data(req["data"]);
+
+    std::copy(data.begin(), data.end(), dst);
+
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
+}
+
+// Transfer data between an open file and VE memory. Returns 0 on success and
+// -1 on failure.
+static int32_t _transfer_fd(int fd, off_t offset, uint8_t *buf, size_t size,
+                            bool to_file)
+{
+    while (size > 0) {
+        ssize_t bytes = to_file ? pwrite(fd, buf, size, offset)
+                                : pread(fd, buf, size, offset);
+
+        if (bytes <= 0) {
+            if (bytes == -1 && errno == EINTR) continue;
+            return -1;
+        }
+
+        buf += bytes;
+        offset += bytes;
+        size -= bytes;
+    }
+
+    return 0;
+}
+
+// Transfer data directly between a file and VE memory without staging it on
+// the VH. Returns 0 on success and -1 on failure.
+static int32_t _transfer_file(const std::string &path, off_t offset,
+                              uint8_t *buf, size_t size, bool to_file)
+{
+    int fd = to_file ? open(path.c_str(), O_WRONLY | O_CREAT, 0644)
+                     : open(path.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        spdlog::error("Cannot open {}: {}", path, strerror(errno));
+        return -1;
+    }
+
+    int32_t result = _transfer_fd(fd, offset, buf, size, to_file);
+
+    if (result != 0) {
+        spdlog::error("Cannot transfer {} bytes from/to {}", size, path);
+    }
+
+    close(fd);
+
+    return result;
+}
+
+static void handle_write_mem_from_file(connection &conn,
+                                       const json &req)
+{
+    uint8_t *dst = reinterpret_cast<uint8_t *>(req["dst"].get<uint64_t>());
+
+    int32_t result = _transfer_file(req["path"], req["offset"].get<off_t>(),
+                                    dst, req["size"], false);
+
+    reply(conn, {{"result", result}, {"reqid", req["reqid"]}});
+}
+
+static void handle_read_mem_to_file(connection &conn, const json &req)
+{
+    uint8_t *src = reinterpret_cast<uint8_t *>(req["src"].get<uint64_t>());
+
+    int32_t result = _transfer_file(req["path"], req["offset"].get<off_t>(),
+                                    src, req["size"], true);
+
+    reply(conn, {{"result", result}, {"reqid", req["reqid"]}});
+}
+
+// A checkpoint file starts with this header, padded to a page. The contents
+// of the buffers follow, each at the same offset within a page as in memory
+// so that it can be mapped back at its original address. The libraries,
+// symbols and buffers are described by msgpack metadata at the end.
+struct checkpoint_header {
+    char magic[8];
+    uint64_t meta_offset;
+    uint64_t meta_size;
+};
+
+static const char CHECKPOINT_MAGIC[] = "VSCKPT01";
+
+static uint64_t page_floor(uint64_t addr)
+{
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    return addr / page * page;
+}
+
+static uint64_t page_ceil(uint64_t addr)
+{
+    const uint64_t page = sysconf(_SC_PAGESIZE);
+    return (addr + page - 1) / page * page;
+}
+
+static int32_t _write_checkpoint(int fd)
+{
+    json libs = json::array(), syms = json::array(), bufs = json::array();
+
+    {
+        std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+        // Libraries are restored in the order they were loaded
+        for (uint64_t handle : lib_order) {
+            const ve_library &lib = loaded_libs[handle];
+            libs.push_back({handle, lib.name, lib.refcount});
+        }
+        for (const auto &entry : resolved_syms) {
+            syms.push_back(
+                {entry.first, entry.second.libhdl, entry.second.name});
+        }
+    }
+
+    // Buffers cannot be freed while their contents are written
+    std::lock_guard<std::mutex> lock(live_bufs_mtx);
+
+    std::vector<uint64_t> addrs;
+    for (const auto &entry : live_bufs) {
+        addrs.push_back(entry.first);
+    }
+    std::sort(addrs.begin(), addrs.end());
+
+    uint64_t offset = page_ceil(sizeof(checkpoint_header));
+
+    for (uint64_t addr : addrs) {
+        const ve_buffer &buf = live_bufs[addr];
+
+        offset = page_ceil(offset) + (addr - page_floor(addr));
+
+        if (_transfer_fd(fd, offset, reinterpret_cast<uint8_t *>(addr),
+                         buf.size, true) != 0) {
+            return -1;
+        }
+
+        bufs.push_back({addr, buf.size, buf.reqid, buf.site, offset});
+        offset += buf.size;
+    }
+
+    std::vector<uint8_t> meta =
+        json::to_msgpack({{"libs", libs}, {"syms", syms}, {"bufs", bufs}});
+
+    checkpoint_header header;
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.meta_offset = offset;
+    header.meta_size = meta.size();
+
+    if (_transfer_fd(fd, offset, meta.data(), meta.size(), true) != 0 ||
+        _transfer_fd(fd, 0, reinterpret_cast<uint8_t *>(&header),
+                     sizeof(header), true) != 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void handle_checkpoint(connection &conn, const json &req)
+{
+    const std::string path = req["path"];
+    int32_t result = -1;
+
+    // Buffers restored from the same file are mapped from it, so it must not
+    // be truncated. The checkpoint is written next to it and renamed. It
+    // keeps the mode 0600 of mkstemp since it holds all VE memory.
+    std::string tmp_path = path + ".XXXXXX";
+    int fd = mkstemp(&tmp_path[0]);
+
+    if (fd == -1) {
+        spdlog::error("Cannot create {}: {}", tmp_path, strerror(errno));
+    } else {
+        result = _write_checkpoint(fd);
+
+        if (result == 0 && rename(tmp_path.c_str(), path.c_str()) != 0) {
+            result = -1;
+        }
+        if (result != 0) {
+            spdlog::error("Cannot write checkpoint to {}", path);
+            unlink(tmp_path.c_str());
+        }
+        close(fd);
+    }
+
+    reply(conn, {{"result", result}, {"reqid", req["reqid"]}});
+}
+
+// Map the contents of a buffer from a checkpoint file. The buffer is placed
+// at its original address if that range is still free.
+static void *_map_buffer(int fd, uint64_t addr, uint64_t size, uint64_t offset)
+{
+    const uint64_t start = page_floor(addr);
+    const size_t len = std::max(page_ceil(addr + size) - start,
+                                page_ceil(1));
+    const off_t file_offset = page_floor(offset);
+    int flags = MAP_PRIVATE;
+
+#ifdef MAP_FIXED_NOREPLACE
+    flags |= MAP_FIXED_NOREPLACE;
+#endif
+
+    void *ptr = mmap(reinterpret_cast<void *>(start), len,
+                     PROT_READ | PROT_WRITE, flags, fd, file_offset);
+
+    if (ptr == MAP_FAILED) {
+        ptr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                   file_offset);
+    }
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint8_t *buf = static_cast<uint8_t *>(ptr) + (addr - start);
+
+    std::lock_guard<std::mutex> lock(mapped_bufs_mtx);
+    mapped_bufs.insert({reinterpret_cast<uint64_t>(buf), {ptr, len}});
+
+    return buf;
+}
+
+static int32_t _restore_checkpoint(int fd, json &res)
+{
+    checkpoint_header header;
+
+    if (_transfer_fd(fd, 0, reinterpret_cast<uint8_t *>(&header),
+                     sizeof(header), false) != 0 ||
+        std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic))) {
+        spdlog::error("Not a checkpoint file");
+        return -1;
+    }
+
+    std::vector<uint8_t> buf(header.meta_size);
+    if (_transfer_fd(fd, header.meta_offset, buf.data(), buf.size(),
+                     false) != 0) {
+        return -1;
+    }
+
+    const json meta = json::from_msgpack(buf);
+    std::unordered_map<uint64_t, uint64_t> libs;
+
+    // Old and new addresses are sent as pairs
+    res["libs"] = json::array();
+    res["syms"] = json::array();
+    res["bufs"] = json::array();
+
+    for (const auto &lib : meta["libs"]) {
+        const std::string name = lib[1];
+        void *libhdl = NULL;
+
+        // Keep the reference count so that unloading works the same
+        for (uint64_t i = 0; i < lib[2].get<uint64_t>(); i++) {
+            libhdl = dlopen(name.c_str(), RTLD_LAZY);
+
+            if (libhdl == NULL) {
+                spdlog::error("{}", dlerror());
+                return -1;
+            }
+        }
+
+        const uint64_t handle = reinterpret_cast<uint64_t>(libhdl);
+        {
+            std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+
+            _track_library(handle, name, lib[2]);
+        }
+
+        libs[lib[0]] = handle;
+        res["libs"].push_back({lib[0], handle});
+    }
+
+    for (const auto &sym : meta["syms"]) {
+        const std::string name = sym[2];
+        void *fn = dlsym(reinterpret_cast<void *>(libs[sym[1]]), name.c_str());
+
+        if (fn == NULL) {
+            spdlog::error("{}", dlerror());
+            return -1;
+        }
+
+        std::lock_guard<std::mutex> lock(loaded_libs_mtx);
+        resolved_syms[reinterpret_cast<uint64_t>(fn)] = {libs[sym[1]], name};
+
+        res["syms"].push_back({sym[0], reinterpret_cast<uint64_t>(fn)});
+    }
+
+    uint64_t total = 0;
+    for (const auto &b : meta["bufs"]) {
+        total += b[1].get<uint64_t>();
+    }
+
+    std::lock_guard<std::mutex> lock(live_bufs_mtx);
+
+    if (mem_limit > 0 && mem_current + total > mem_limit) {
+        spdlog::warn("Restoring {} bytes exceeds the memory limit ({} of {} "
+                     "bytes in use)",
+                     total, mem_current, mem_limit);
+        return -1;
+    }
 
-static void handle_free_mem(int sock, json req)
-{
-    uint64_t addr = req["addr"];
-    free(reinterpret_cast<void *>(addr));
+    for (const auto &b : meta["bufs"]) {
+        void *ptr = _map_buffer(fd, b[0], b[1], b[4]);
 
-    send_msg(sock, {{"result", 0}, {"reqid", req["reqid"]}});
-}
+        if (ptr == NULL) {
+            spdlog::error("Cannot map buffer {:#x}: {}", b[0].get<uint64_t>(),
+                          strerror(errno));
+            return -1;
+        }
 
-static void handle_read_mem(int sock, const json &req)
-{
-    const uint8_t *src =
-        reinterpret_cast<uint8_t *>(req["src"].get<uint64_t>());
-    uint64_t size = req["size"];
+        const uint64_t addr = reinterpret_cast<uint64_t>(ptr);
 
-    std::vector<uint8_t> data(src, src + size);
+        live_bufs[addr] = {b[1], b[2], b[3]};
+        mem_current += b[1].get<uint64_t>();
+        mem_peak = std::max(mem_peak, mem_current);
 
-    send_msg(sock, {{"result", 0}, {"reqid", req["reqid"]}, {"data", data}});
+        res["bufs"].push_back({b[0], addr, b[1]});
+    }
+
+    return 0;
 }
 
-static void handle_write_mem(int sock, const json &req)
+static void handle_restore(connection &conn, const json &req)
 {
-    uint8_t *dst = reinterpret_cast<uint8_t *>(req["dst"].get<uint64_t>());
-    uint64_t size = req["size"];
-    std::vector<uint8_t> data(req["data"]);
-
-    std::copy(data.begin(), data.end(), dst);
+    const std::string path = req["path"];
+    json res = {{"reqid", req["reqid"]}};
+
+    int fd = open(path.c_str(), O_RDONLY);
+
+    if (fd == -1) {
+        spdlog::error("Cannot open {}: {}", path, strerror(errno));
+        res["result"] = -1;
+    } else {
+        // The mappings stay valid after the file is closed
+        res["result"] = _restore_checkpoint(fd, res);
+        close(fd);
+    }
 
-    send_msg(sock, {{"result", 0}, {"reqid", req["reqid"]}});
+    reply(conn, res);
 }
 
 static uint64_t _call_func(const void *fn, struct veo_args *args)
@@ -155,7 +1390,39 @@ static uint64_t _call_func(const void *fn, struct veo_args *args)
     return res;
 }
 
-static void handle_call_common(int sock, const json &req, const void *fn)
+// Call a function with arguments packed into 64-bit words. Each value is
+// read from the low bytes of its word (VH and VE are little endian).
+static uint64_t _call_func_packed(const void *fn,
+                                  const std::vector<uint8_t> &types,
+                                  std::vector<uint64_t> &vals)
+{
+    static ffi_type *const ffi_types[] = {
+        &ffi_type_sint64, &ffi_type_uint64, &ffi_type_sint32,
+        &ffi_type_uint32, &ffi_type_sint16, &ffi_type_uint16,
+        &ffi_type_sint8,  &ffi_type_uint8,  &ffi_type_double,
+        &ffi_type_float,
+    };
+
+    ffi_cif cif;
+    std::vector<ffi_type *> arg_types(types.size());
+    std::vector<void *> arg_values(types.size());
+
+    for (size_t i = 0; i < types.size(); i++) {
+        arg_types[i] = ffi_types[types[i]];
+        arg_values[i] = &vals[i];
+    }
+
+    ffi_prep_cif(&cif, FFI_DEFAULT_ABI, arg_types.size(), &ffi_type_uint64,
+                 arg_types.data());
+
+    uint64_t res;
+    ffi_call(&cif, FFI_FN(fn), &res, arg_values.data());
+
+    return res;
+}
+
+// Execute a single call and return its result message
+static json _call_common(const json &req, const void *fn)
 {
     struct veo_args argp = req["args"];
     std::vector<copy_descriptor> copy_in = req["copy_in"];
@@ -190,19 +1457,80 @@ static void handle_call_common(int sock, const json &req, const void *fn)
         }
     }
 
-    send_msg(
-        sock,
-        {{"result", res}, {"reqid", req["reqid"]}, {"copy_out", copy_out}});
+    return {{"result", res}, {"reqid", req["reqid"]}, {"copy_out", copy_out}};
+}
+
+static void handle_call_common(connection &conn, const json &req,
+                               const void *fn)
+{
+    reply(conn, _call_common(req, fn));
+}
+
+// Execute a batch of calls to the same function back to back and return all
+// results in a single message
+static void handle_call_batch_common(connection &conn, const json &req,
+                                     const void *fn)
+{
+    json results = json::array();
+
+    for (const auto &call : req["calls"]) {
+        results.push_back(_call_common(call, fn));
+    }
+
+    reply(conn, {{"reqid", req["reqid"]}, {"results", results}});
+}
+
+static void handle_call_async(connection &conn, const json &req)
+{
+    void *fn = reinterpret_cast<void *>(req["addr"].get<uint64_t>());
+
+    handle_call_common(conn, req, fn);
+}
+
+static void handle_call_async_packed(connection &conn, const json &req)
+{
+    void *fn = reinterpret_cast<void *>(req["addr"].get<uint64_t>());
+    const auto &types = req["types"].get_binary();
+    const auto &blob = req["vals"].get_binary();
+
+    std::vector<uint64_t> vals(types.size());
+    std::memcpy(vals.data(), blob.data(),
+                std::min(blob.size(), vals.size() * sizeof(uint64_t)));
+
+    for (uint8_t type : types) {
+        if (type > VS_ARG_TYPE_FLOAT) {
+            spdlog::error("Invalid packed argument type {}", type);
+            reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
+            return;
+        }
+    }
+
+    uint64_t res = _call_func_packed(fn, types, vals);
+
+    reply(conn, {{"result", res}, {"reqid", req["reqid"]}});
+}
+
+static void handle_call_async_by_name(connection &conn, const json &req)
+{
+    void *libhdl = reinterpret_cast<void *>((req["libhdl"].get<uint64_t>()));
+    void *fn = dlsym(libhdl, req["symname"].get<std::string>().c_str());
+
+    if (fn == NULL) {
+        spdlog::error("{}", dlerror());
+    }
+
+    handle_call_common(conn, req, fn);
 }
 
-static void handle_call_async(int sock, const json &req)
+static void handle_call_async_batch(connection &conn, const json &req)
 {
     void *fn = reinterpret_cast<void *>(req["addr"].get<uint64_t>());
 
-    handle_call_common(sock, req, fn);
+    handle_call_batch_common(conn, req, fn);
 }
 
-static void handle_call_async_by_name(int sock, const json &req)
+static void handle_call_async_batch_by_name(connection &conn,
+                                            const json &req)
 {
     void *libhdl = reinterpret_cast<void *>((req["libhdl"].get<uint64_t>()));
     void *fn = dlsym(libhdl, req["symname"].get<std::string>().c_str());
@@ -211,118 +1539,685 @@ static void handle_call_async_by_name(int sock, const json &req)
         spdlog::error("{}", dlerror());
     }
 
-    handle_call_common(sock, req, fn);
+    handle_call_batch_common(conn, req, fn);
+}
+
+struct ve_graph_node {
+    veo_stubs_graph_node_type type;
+    uint8_t *ve_ptr;
+    size_t len;
+    void *fn;
+    struct veo_args args;
+};
+
+struct ve_graph {
+    std::vector<ve_graph_node> nodes;
+    // Serializes launches of the same graph from multiple contexts
+    std::mutex mtx;
+};
+
+// Graphs instantiated by the VH, shared by all contexts of this process
+static std::unordered_map<uint64_t, std::shared_ptr<ve_graph>> graphs;
+static uint64_t num_graphs = 0;
+static std::mutex graphs_mtx;
+
+static void handle_graph_create(connection &conn, const json &req)
+{
+    auto graph = std::make_shared<ve_graph>();
+
+    for (const auto &j : req["nodes"]) {
+        graph->nodes.push_back(
+            {static_cast<veo_stubs_graph_node_type>(j["type"].get<int32_t>()),
+             reinterpret_cast<uint8_t *>(j["ve_ptr"].get<uint64_t>()),
+             j["len"].get<size_t>(),
+             reinterpret_cast<void *>(j["addr"].get<uint64_t>()),
+             j["args"].get<veo_args>()});
+    }
+
+    uint64_t id;
+    {
+        std::lock_guard<std::mutex> lock(graphs_mtx);
+
+        id = ++num_graphs;
+        graphs.insert({id, graph});
+    }
+
+    reply(conn, {{"result", id}, {"reqid", req["reqid"]}});
+}
+
+static void handle_graph_launch(connection &conn, const json &req)
+{
+    std::shared_ptr<ve_graph> graph;
+    {
+        std::lock_guard<std::mutex> lock(graphs_mtx);
+
+        const auto it = graphs.find(req["graph"].get<uint64_t>());
+
+        if (it == graphs.end()) {
+            spdlog::error("Unknown graph {}", req["graph"].get<uint64_t>());
+            reply(conn, {{"result", -1}, {"reqid", req["reqid"]}});
+            return;
+        }
+
+        graph = it->second;
+    }
+
+    std::lock_guard<std::mutex> lock(graph->mtx);
+
+    // Patched arguments stay in effect for subsequent launches
+    for (const auto &patch : req["patches"]) {
+        graph->nodes[patch["node"].get<size_t>()].args = patch["args"];
+    }
+
+    std::vector<copy_descriptor> copy_in = req["copy_in"];
+    std::vector<copy_descriptor> copy_out = req["copy_out"];
+    size_t in_idx = 0, out_idx = 0;
+    uint64_t res = 0;
+
+    for (auto &node : graph->nodes) {
+        switch (node.type) {
+        case VS_GRAPH_NODE_WRITE_MEM: {
+            auto &desc = copy_in[in_idx++];
+            std::copy(desc.data.begin(), desc.data.end(), node.ve_ptr);
+            break;
+        }
+        case VS_GRAPH_NODE_CALL:
+            res = _call_func(node.fn, &node.args);
+            break;
+        case VS_GRAPH_NODE_READ_MEM: {
+            auto &desc = copy_out[out_idx++];
+            desc.data.resize(desc.len);
+            std::copy(node.ve_ptr, node.ve_ptr + node.len, desc.data.begin());
+            break;
+        }
+        }
+    }
+
+    reply(
+        conn,
+        {{"result", res}, {"reqid", req["reqid"]}, {"copy_out", copy_out}});
+}
+
+static void handle_graph_destroy(connection &conn, const json &req)
+{
+    {
+        std::lock_guard<std::mutex> lock(graphs_mtx);
+
+        graphs.erase(req["graph"].get<uint64_t>());
+    }
+
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
 }
 
-static void handle_async_read_mem(int sock, const json &req)
+static void handle_async_read_mem(connection &conn, const json &req)
 {
     std::vector<copy_descriptor> descs = req["copy_out"];
 
     for (auto &desc : descs) {
-        desc.data.resize(desc.len);
-        std::copy(desc.ve_ptr, desc.ve_ptr + desc.len, desc.data.begin());
+        desc.gather(desc.ve_ptr, desc.ve_pitch);
     }
 
-    send_msg(sock,
+    reply(conn,
              {{"result", 0}, {"reqid", req["reqid"]}, {"copy_out", descs}});
 }
 
-static void handle_async_write_mem(int sock, const json &req)
+static void handle_async_write_mem(connection &conn, const json &req)
 {
     std::vector<copy_descriptor> descs = req["copy_in"];
 
-    for (auto &desc : descs) {
-        std::copy(desc.data.begin(), desc.data.end(), desc.ve_ptr);
+    for (const auto &desc : descs) {
+        desc.scatter(desc.ve_ptr, desc.ve_pitch);
     }
 
-    send_msg(sock, {{"result", 0}, {"reqid", req["reqid"]}});
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
+}
+
+static void handle_sync_context(connection &conn, const json &req)
+{
+    reply(conn, {{"result", 0}, {"reqid", req["reqid"]}});
 }
 
-static void handle_sync_context(int sock, const json &req)
+static void handle_open_context(connection &conn, const json &req)
 {
-    send_msg(sock, {{"result", 0}, {"reqid", req["reqid"]}});
+    conn.unordered = req.value("unordered", false);
+
+    json res = {{"result", 0}, {"reqid", req["reqid"]}};
+
+    if (req.value("preload", false)) {
+        res["libs"] = preloaded["libs"];
+        res["syms"] = preloaded["syms"];
+    }
+
+#ifdef __linux__
+    if (req.contains("shm")) {
+        auto shm = std::make_unique<shm_transport>();
+
+        if (!shm->attach(req["shm"].get<std::string>(), conn.sock)) {
+            spdlog::error("Cannot map {}", req["shm"].get<std::string>());
+            reply(conn,
+                  {{"result", 0}, {"reqid", req["reqid"]}, {"error", true}});
+            return;
+        }
+
+        // The reply still goes over the socket, where the VH is waiting
+        reply(conn, res);
+        conn.shm = std::move(shm);
+        return;
+    }
+#endif
+
+    reply(conn, res);
 }
 
-static void handle_quit(int sock, json req) {}
+// Execute a request that operates on the VE
+static void dispatch(connection &conn, const json &req)
+{
+    timed_scope scope(req);
+
+    switch (req["cmd"].get<int32_t>()) {
+    case VS_CMD_LOAD_LIBRARY:
+        handle_load_library(conn, req);
+        break;
+    case VS_CMD_UNLOAD_LIBRARY:
+        handle_unload_library(conn, req);
+        break;
+    case VS_CMD_GET_SYM:
+        handle_get_sym(conn, req);
+        break;
+    case VS_CMD_GET_SYMS:
+        handle_get_syms(conn, req);
+        break;
+    case VS_CMD_ALLOC_MEM:
+        handle_alloc_mem(conn, req);
+        break;
+    case VS_CMD_FREE_MEM:
+        handle_free_mem(conn, req);
+        break;
+    case VS_CMD_GET_MEM_USAGE:
+        handle_get_mem_usage(conn, req);
+        break;
+    case VS_CMD_READ_MEM:
+        handle_read_mem(conn, req);
+        break;
+    case VS_CMD_WRITE_MEM:
+        handle_write_mem(conn, req);
+        break;
+    case VS_CMD_CALL_ASYNC:
+        handle_call_async(conn, req);
+        break;
+    case VS_CMD_CALL_ASYNC_BY_NAME:
+        handle_call_async_by_name(conn, req);
+        break;
+    case VS_CMD_CALL_ASYNC_PACKED:
+        handle_call_async_packed(conn, req);
+        break;
+    case VS_CMD_CALL_ASYNC_BATCH:
+        handle_call_async_batch(conn, req);
+        break;
+    case VS_CMD_CALL_ASYNC_BATCH_BY_NAME:
+        handle_call_async_batch_by_name(conn, req);
+        break;
+    case VS_CMD_ASYNC_READ_MEM:
+        handle_async_read_mem(conn, req);
+        break;
+    case VS_CMD_ASYNC_WRITE_MEM:
+        handle_async_write_mem(conn, req);
+        break;
+    case VS_CMD_WRITE_MEM_FROM_FILE:
+        handle_write_mem_from_file(conn, req);
+        break;
+    case VS_CMD_READ_MEM_TO_FILE:
+        handle_read_mem_to_file(conn, req);
+        break;
+    case VS_CMD_CHECKPOINT:
+        handle_checkpoint(conn, req);
+        break;
+    case VS_CMD_RESTORE:
+        handle_restore(conn, req);
+        break;
+    case VS_CMD_GRAPH_CREATE:
+        handle_graph_create(conn, req);
+        break;
+    case VS_CMD_GRAPH_LAUNCH:
+        handle_graph_launch(conn, req);
+        break;
+    case VS_CMD_GRAPH_DESTROY:
+        handle_graph_destroy(conn, req);
+        break;
+    default:
+        break;
+    }
+}
 
-static void close_server_sock(int server_sock)
+static size_t num_pool_threads()
 {
-    shutdown(server_sock, SHUT_RDWR);
-    close(server_sock);
+    const char *env = getenv("VEO_STUBS_NUM_THREADS");
+
+    if (env != NULL && std::atoi(env) > 0) {
+        return std::atoi(env);
+    }
+
+#ifdef __linux__
+    // Only count the CPUs this process is bound to
+    size_t num_cpus = allowed_cpus().size();
+#else
+    size_t num_cpus = std::thread::hardware_concurrency();
+#endif
+
+    // A VE has 8 cores, so emulate at least as many even on small hosts
+    return std::max(num_cpus, static_cast<size_t>(8));
 }
 
-static void worker(int server_sock, int worker_sock)
+// Thread pool executing requests from all contexts
+static thread_pool &get_pool()
 {
-    bool active = true;
+    static thread_pool pool(num_pool_threads());
+
+    return pool;
+}
 
-    spdlog::debug("Starting up worker thread");
+// Kernels of different ordered contexts may wait for each other, so the pool
+// keeps at least one thread per open ordered context
+static void reserve_ordered_runner(connection &conn)
+{
+    conn.reserved = true;
+    get_pool().grow(++num_ordered);
+}
 
-    while (active) {
+// Execute the pending requests of an ordered context one by one. At most one
+// pool thread drains a connection at a time, which preserves the order.
+static void drain_ordered(std::shared_ptr<connection> conn)
+{
+    while (true) {
         json req;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
 
-        if (!recv_msg(worker_sock, req)) {
-            // We reach here if the VH disconnects unexpectedly. This usually
-            // means that the VH crashed, so we clean up and exit.
-            spdlog::error("Failed to receive command from VH");
-            close_server_sock(server_sock);
-            break;
+            if (conn->pending.empty()) {
+                conn->running = false;
+                return;
+            }
+
+            req = std::move(conn->pending.front());
+            conn->pending.pop_front();
+        }
+
+        if (req["cmd"] == VS_CMD_SYNC_CONTEXT) {
+            handle_sync_context(*conn, req);
+        } else {
+            dispatch(*conn, req);
+        }
+    }
+}
+
+static void dispatch_ordered(std::shared_ptr<connection> conn, json req)
+{
+    if (!conn->reserved) {
+        reserve_ordered_runner(*conn);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+
+        conn->pending.push_back(std::move(req));
+
+        if (conn->running) {
+            return;
+        }
+
+        conn->running = true;
+    }
+
+    get_pool().submit([conn] { drain_ordered(conn); });
+}
+
+static void dispatch_unordered(std::shared_ptr<connection> conn, json req)
+{
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+        conn->inflight++;
+    }
+
+    get_pool().submit([conn, req] {
+        dispatch(*conn, req);
+
+        std::vector<json> syncs;
+        {
+            std::lock_guard<std::mutex> lock(conn->mtx);
+
+            if (--conn->inflight == 0) {
+                syncs.swap(conn->syncs);
+            }
+        }
+
+        for (const auto &sync : syncs) {
+            handle_sync_context(*conn, sync);
+        }
+    });
+}
+
+// Reply to a sync request of an unordered context once all requests
+// dispatched so far have finished
+static void sync_unordered(std::shared_ptr<connection> conn, json req)
+{
+    {
+        std::lock_guard<std::mutex> lock(conn->mtx);
+
+        if (conn->inflight > 0) {
+            conn->syncs.push_back(std::move(req));
+            return;
+        }
+    }
+
+    handle_sync_context(*conn, req);
+}
+
+// Waits for readability of many file descriptors
+class poller
+{
+#ifdef __linux__
+    int epfd;
+#else
+    std::vector<struct pollfd> fds;
+#endif
+
+public:
+#ifdef __linux__
+    poller() : epfd(epoll_create1(EPOLL_CLOEXEC)) {}
+    ~poller() { close(epfd); }
+#endif
+
+    void add(int fd)
+    {
+#ifdef __linux__
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = fd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+#else
+        fds.push_back({fd, POLLIN, 0});
+#endif
+    }
+
+    void remove(int fd)
+    {
+#ifdef __linux__
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, NULL);
+#else
+        fds.erase(std::remove_if(fds.begin(), fds.end(),
+                                 [=](const pollfd &p) { return p.fd == fd; }),
+                  fds.end());
+#endif
+    }
+
+    // Block until some file descriptors become readable (or hang up)
+    bool wait(std::vector<int> &ready)
+    {
+        ready.clear();
+
+#ifdef __linux__
+        struct epoll_event evs[64];
+        int n = epoll_wait(epfd, evs, 64, -1);
+
+        for (int i = 0; i < n; i++) {
+            ready.push_back(evs[i].data.fd);
+        }
+#else
+        int n = ::poll(fds.data(), fds.size(), -1);
+
+        for (const auto &p : fds) {
+            if (p.revents) ready.push_back(p.fd);
+        }
+#endif
+
+        return n >= 0 || errno == EINTR;
+    }
+};
+
+#ifdef __linux__
+static std::vector<std::pair<std::thread, std::weak_ptr<connection>>>
+    shm_readers;
+static std::atomic<bool> quitting(false);
+// Readable when a shm_reader has seen the VH quit or disconnect
+static int wake_fds[2] = {-1, -1};
+
+static void wake_event_loop()
+{
+    const char c = 0;
+
+    if (write(wake_fds[1], &c, 1) != 1) {
+        spdlog::error("Cannot wake up event loop: {}", strerror(errno));
+    }
+}
+
+// Join the readers of closed contexts. A connection expires once its reader
+// has returned and no request holds it anymore.
+static void reap_shm_readers()
+{
+    auto it = shm_readers.begin();
+
+    while (it != shm_readers.end()) {
+        if (it->second.expired()) {
+            it->first.join();
+            it = shm_readers.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+// Read requests of a connection that uses the shared memory transport.
+// Requests of an ordered context are executed right away on this thread to
+// avoid waking up another one.
+static void shm_reader(std::shared_ptr<connection> conn)
+{
+    json req;
+
+    while (true) {
+        if (!recv_msg(conn->shm->rx, req)) {
+            if (!quitting) {
+                spdlog::error("Failed to receive command from VH");
+                wake_event_loop();
+            }
+            return;
         }
 
-        spdlog::debug("Received command {}", req.dump());
+        VS_DEBUG("Received command {}", req.dump());
 
         switch (req["cmd"].get<int32_t>()) {
-        case VS_CMD_LOAD_LIBRARY:
-            handle_load_library(worker_sock, req);
-            break;
-        case VS_CMD_UNLOAD_LIBRARY:
-            handle_unload_library(worker_sock, req);
-            break;
-        case VS_CMD_GET_SYM:
-            handle_get_sym(worker_sock, req);
-            break;
-        case VS_CMD_ALLOC_MEM:
-            handle_alloc_mem(worker_sock, req);
-            break;
-        case VS_CMD_FREE_MEM:
-            handle_free_mem(worker_sock, req);
-            break;
-        case VS_CMD_READ_MEM:
-            handle_read_mem(worker_sock, req);
-            break;
-        case VS_CMD_WRITE_MEM:
-            handle_write_mem(worker_sock, req);
-            break;
-        case VS_CMD_CALL_ASYNC:
-            handle_call_async(worker_sock, req);
-            break;
-        case VS_CMD_CALL_ASYNC_BY_NAME:
-            handle_call_async_by_name(worker_sock, req);
-            break;
-        case VS_CMD_ASYNC_READ_MEM:
-            handle_async_read_mem(worker_sock, req);
-            break;
-        case VS_CMD_ASYNC_WRITE_MEM:
-            handle_async_write_mem(worker_sock, req);
-            break;
         case VS_CMD_CLOSE_CONTEXT:
-            active = false;
-            break;
-        case VS_CMD_SYNC_CONTEXT:
-            handle_sync_context(worker_sock, req);
-            break;
+            return;
         case VS_CMD_QUIT:
-            handle_quit(worker_sock, req);
-            active = false;
-            close_server_sock(server_sock);
+            wake_event_loop();
+            return;
+        case VS_CMD_SYNC_CONTEXT:
+            if (conn->unordered) {
+                sync_unordered(conn, req);
+            } else {
+                handle_sync_context(*conn, req);
+            }
             break;
         default:
+            if (conn->unordered) {
+                dispatch_unordered(conn, req);
+            } else {
+                dispatch(*conn, req);
+            }
             break;
         }
     }
+}
+#endif
+
+#ifdef __linux__
+// Readers of contexts that are still open are stopped by marking their
+// request rings as closed
+static void stop_shm_readers()
+{
+    quitting = true;
+
+    for (auto &reader : shm_readers) {
+        if (auto conn = reader.second.lock()) {
+            conn->shm->rx.close();
+        }
+        reader.first.join();
+    }
+    shm_readers.clear();
+
+    close(wake_fds[0]);
+    close(wake_fds[1]);
+}
+#endif
+
+// Receive what has arrived on the socket of a connection without waiting for
+// the rest of a partially sent request, so that a large request does not hold
+// up other connections. Complete requests are appended to reqs. Returns false
+// if the VH disconnected.
+static bool recv_requests(connection &conn, std::vector<json> &reqs)
+{
+    // Make room for the rest of the current request, or for a chunk of the
+    // next ones
+    size_t want = conn.rlen + (1 << 16);
+    uint32_t size;
+    if (conn.rlen >= sizeof(size)) {
+        std::memcpy(&size, conn.rbuf.data(), sizeof(size));
+        want = std::max(want, sizeof(size) + size);
+    }
+    if (conn.rbuf.size() < want) {
+        conn.rbuf.resize(want);
+    }
+
+    ssize_t n;
+    do {
+        n = recv(conn.sock, conn.rbuf.data() + conn.rlen,
+                 conn.rbuf.size() - conn.rlen, 0);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == 0) {
+        return false;
+    }
+    if (n == -1) {
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn.rlen += n;
+
+    size_t pos = 0;
+    json req;
+    while (parse_msg(conn.rbuf.data(), conn.rlen, pos, req)) {
+        reqs.push_back(std::move(req));
+    }
+
+    // Keep the incomplete request at the front
+    std::memmove(conn.rbuf.data(), conn.rbuf.data() + pos, conn.rlen - pos);
+    conn.rlen -= pos;
+
+    // Do not hold on to the buffer of a large request
+    if (conn.rlen == 0 && conn.rbuf.size() > (1 << 16)) {
+        conn.rbuf.clear();
+        conn.rbuf.shrink_to_fit();
+    }
+
+    return true;
+}
+
+// Read requests from all connections on a single thread and execute them on
+// the thread pool. Returns when the VH quits or disconnects.
+static void event_loop(int server_sock)
+{
+    poller poll;
+    std::unordered_map<int, std::shared_ptr<connection>> conns;
+    std::vector<int> ready;
+
+    poll.add(server_sock);
 
-    close(worker_sock);
+#ifdef __linux__
+    if (pipe2(wake_fds, O_CLOEXEC) == 0) {
+        poll.add(wake_fds[0]);
+    }
+#endif
+
+    while (poll.wait(ready)) {
+        for (int fd : ready) {
+#ifdef __linux__
+            if (fd == wake_fds[0]) {
+                return;
+            }
+#endif
+
+            if (fd == server_sock) {
+                int worker_sock = accept(server_sock, NULL, NULL);
+
+                if (worker_sock != -1) {
+                    VS_DEBUG("Accepted connection {}", worker_sock);
+
+                    fcntl(worker_sock, F_SETFL,
+                          fcntl(worker_sock, F_GETFL) | O_NONBLOCK);
+
+                    conns[worker_sock] =
+                        std::make_shared<connection>(worker_sock);
+                    poll.add(worker_sock);
+                }
+                continue;
+            }
+
+            const auto it = conns.find(fd);
+            if (it == conns.end()) continue;
+
+            std::shared_ptr<connection> conn = it->second;
+            std::vector<json> reqs;
+
+            if (!recv_requests(*conn, reqs)) {
+                // We reach here if the VH disconnects unexpectedly. This
+                // usually means that the VH crashed, so we clean up and exit.
+                spdlog::error("Failed to receive command from VH");
+                return;
+            }
+
+            for (json &req : reqs) {
+                VS_DEBUG("Received command {}", req.dump());
+
+                switch (req["cmd"].get<int32_t>()) {
+                case VS_CMD_OPEN_CONTEXT:
+                    handle_open_context(*conn, req);
+#ifdef __linux__
+                    if (conn->shm) {
+                        // Further requests arrive through shared memory
+                        poll.remove(fd);
+                        conns.erase(fd);
+                        reap_shm_readers();
+                        shm_readers.emplace_back(std::thread(shm_reader, conn),
+                                                 conn);
+                    }
+#endif
+                    break;
+                case VS_CMD_CLOSE_CONTEXT:
+                    // The socket is closed when the last in-flight request of
+                    // this connection releases it
+                    poll.remove(fd);
+                    conns.erase(fd);
+                    break;
+                case VS_CMD_QUIT:
+                    return;
+                case VS_CMD_SYNC_CONTEXT:
+                    if (conn->unordered) {
+                        sync_unordered(conn, req);
+                    } else {
+                        dispatch_ordered(conn, req);
+                    }
+                    break;
+                default:
+                    if (conn->unordered) {
+                        dispatch_unordered(conn, req);
+                    } else {
+                        dispatch_ordered(conn, req);
+                    }
+                    break;
+                }
+            }
+        }
+    }
 
-    spdlog::debug("Shutting down worker thread");
+    spdlog::error("Failed to wait for commands from VH");
 }
 
 int main(int argc, char *argv[])
@@ -330,7 +2225,14 @@ int main(int argc, char *argv[])
     spdlog::cfg::load_env_levels();
     spdlog::set_pattern("[%^%l%$] [VE] [PID %P] [TID %t] %v");
 
-    spdlog::debug("Starting server");
+    tracer.open_from_env();
+
+    VS_DEBUG("Starting server");
+
+    int32_t venode = argc > 1 ? std::atoi(argv[1]) : 0;
+
+    load_placement_config(venode);
+    load_timing_config();
 
     const std::string sock_path =
         "/tmp/stub-veorun." + std::to_string(getpid()) + ".sock";
@@ -351,27 +2253,21 @@ int main(int argc, char *argv[])
         spdlog::error("Listen() failed");
     }
 
-    spdlog::debug("Server is listening at {}", sock_path);
+    VS_DEBUG("Server is listening at {}", sock_path);
 
-    std::vector<std::thread> worker_threads;
+    // Clients may connect already and wait for the event loop
+    preload_libraries();
 
-    while (true) {
-        int worker_sock = accept(server_sock, NULL, NULL);
-
-        if (worker_sock == -1) {
-            break;
-        }
+    event_loop(server_sock);
 
-        worker_threads.emplace_back(worker, server_sock, worker_sock);
-    }
-
-    for (auto &thread : worker_threads) {
-        thread.join();
-    }
+#ifdef __linux__
+    stop_shm_readers();
+#endif
 
+    close(server_sock);
     unlink(sock_path.c_str());
 
-    spdlog::debug("Exiting server");
+    VS_DEBUG("Exiting server");
 
     return 0;
 }
@@ -0,0 +1,530 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "stub.hpp"
+#include "ve_offload.h"
+#include "veo_stubs.h"
+
+using replay_clock = std::chrono::steady_clock;
+
+// A request issued during replay whose result has not been collected
+struct pending_request {
+    int32_t cmd;
+    replay_clock::time_point submitted;
+    // Request ID on the replayed context, or the return value of a
+    // synchronous function
+    uint64_t reqid;
+    bool sync;
+    // Size of an allocation
+    uint64_t size = 0;
+    // Addresses resolved by GET_SYMS
+    std::vector<uint64_t> addrs;
+    // Buffers that must outlive the request
+    std::shared_ptr<std::vector<uint8_t>> buf;
+    std::vector<std::shared_ptr<std::vector<char>>> stack;
+};
+
+struct replay_context {
+    struct veo_proc_handle *proc = NULL;
+    struct veo_thr_ctxt *ctx = NULL;
+    std::unordered_map<uint64_t, pending_request> pending;
+};
+
+struct allocation {
+    uint64_t addr;
+    uint64_t size;
+};
+
+class replayer
+{
+    std::unordered_map<uint64_t, struct veo_proc_handle *> procs;
+    std::unordered_map<uint64_t, struct veo_thr_ctxt *> defaults;
+    std::unordered_map<uint64_t, replay_context> ctxs;
+
+    // Handles and addresses in the recording mapped to the replayed ones
+    std::unordered_map<uint64_t, uint64_t> libs;
+    std::unordered_map<uint64_t, uint64_t> syms;
+    std::map<uint64_t, allocation> allocs;
+
+    std::map<std::string, std::vector<double>> latencies;
+    size_t num_skipped = 0;
+
+    // Map a value to the replayed address if it points into an allocation
+    uint64_t remap(uint64_t addr) const
+    {
+        auto it = allocs.upper_bound(addr);
+        if (it != allocs.begin()) {
+            --it;
+            if (addr - it->first < std::max<uint64_t>(it->second.size, 1)) {
+                return it->second.addr + (addr - it->first);
+            }
+        }
+
+        const auto sym = syms.find(addr);
+        return sym != syms.end() ? sym->second : addr;
+    }
+
+    uint64_t remap_lib(uint64_t libhdl) const
+    {
+        const auto it = libs.find(libhdl);
+        return it != libs.end() ? it->second : libhdl;
+    }
+
+    // Rebuild the arguments of a call. Buffers of stack arguments are kept
+    // in the pending request.
+    struct veo_args *make_args(const json &j, pending_request &p)
+    {
+        struct veo_args *argp = veo_args_alloc();
+        const auto &types = j["types"].get_binary();
+        const auto &vals = j["vals"].get_binary();
+        size_t num_stack = 0;
+
+        for (size_t i = 0; i < types.size(); i++) {
+            const uint8_t *word = &vals[i * sizeof(uint64_t)];
+
+            switch (types[i]) {
+            case VS_ARG_TYPE_I64:
+                veo_args_set_i64(argp, i, remap(decode_arg<int64_t>(word)));
+                break;
+            case VS_ARG_TYPE_U64:
+                veo_args_set_u64(argp, i, remap(decode_arg<uint64_t>(word)));
+                break;
+            case VS_ARG_TYPE_I32:
+                veo_args_set_i32(argp, i, decode_arg<int32_t>(word));
+                break;
+            case VS_ARG_TYPE_U32:
+                veo_args_set_u32(argp, i, decode_arg<uint32_t>(word));
+                break;
+            case VS_ARG_TYPE_I16:
+                veo_args_set_i16(argp, i, decode_arg<int16_t>(word));
+                break;
+            case VS_ARG_TYPE_U16:
+                veo_args_set_u16(argp, i, decode_arg<uint16_t>(word));
+                break;
+            case VS_ARG_TYPE_I8:
+                veo_args_set_i8(argp, i, decode_arg<int8_t>(word));
+                break;
+            case VS_ARG_TYPE_U8:
+                veo_args_set_u8(argp, i, decode_arg<uint8_t>(word));
+                break;
+            case VS_ARG_TYPE_DOUBLE:
+                veo_args_set_double(argp, i, decode_arg<double>(word));
+                break;
+            case VS_ARG_TYPE_FLOAT:
+                veo_args_set_float(argp, i, decode_arg<float>(word));
+                break;
+            case VS_ARG_TYPE_STACK: {
+                stack_arg sa = j["stack"][num_stack++];
+                auto buf = std::make_shared<std::vector<char>>(sa.len);
+                veo_args_set_stack(argp, sa.inout, i, buf->data(), sa.len);
+                p.stack.push_back(buf);
+                break;
+            }
+            }
+        }
+
+        return argp;
+    }
+
+    void submit_call(replay_context &rc, const json &req, pending_request p)
+    {
+        struct veo_args *argp = make_args(req["args"], p);
+
+        if (p.cmd == VS_CMD_CALL_ASYNC) {
+            p.reqid = veo_call_async(rc.ctx, remap(req["addr"]), argp);
+        } else {
+            const std::string symname = req["symname"];
+            p.reqid = veo_call_async_by_name(rc.ctx, remap_lib(req["libhdl"]),
+                                             symname.c_str(), argp);
+        }
+
+        veo_args_free(argp);
+        rc.pending[req["reqid"]] = std::move(p);
+    }
+
+    void submit_batch(replay_context &rc, const json &req,
+                      const pending_request &proto)
+    {
+        const auto &calls = req["calls"];
+        std::vector<pending_request> ps(calls.size(), proto);
+        std::vector<struct veo_args *> argps;
+        std::vector<uint64_t> reqids(calls.size());
+
+        for (size_t i = 0; i < calls.size(); i++) {
+            argps.push_back(make_args(calls[i]["args"], ps[i]));
+        }
+
+        if (proto.cmd == VS_CMD_CALL_ASYNC_BATCH) {
+            veo_call_async_batch(rc.ctx, remap(req["addr"]), argps.data(),
+                                 argps.size(), reqids.data());
+        } else {
+            veo_call_async_batch_by_name(
+                rc.ctx, remap_lib(req["libhdl"]),
+                req["symname"].get<std::string>().c_str(), argps.data(),
+                argps.size(), reqids.data());
+        }
+
+        for (size_t i = 0; i < calls.size(); i++) {
+            veo_args_free(argps[i]);
+            ps[i].reqid = reqids[i];
+            rc.pending[calls[i]["reqid"]] = std::move(ps[i]);
+        }
+    }
+
+    void record_latency(int32_t cmd, replay_clock::time_point start)
+    {
+        latencies[cmd_name(cmd)].push_back(
+            std::chrono::duration<double, std::micro>(replay_clock::now() -
+                                                      start)
+                .count());
+    }
+
+    replay_context &get_context(const json &rec)
+    {
+        replay_context &rc = ctxs[rec["ctx"]];
+
+        if (rc.proc == NULL) {
+            const uint64_t pid = rec["pid"];
+
+            if (procs.find(pid) == procs.end()) {
+                procs[pid] = veo_proc_create(rec["venode"]);
+                // The first context opened on a process is the default one
+                if (procs[pid] != NULL) {
+                    defaults[pid] = veo_context_open(procs[pid]);
+                }
+            }
+            rc.proc = procs[pid];
+
+            if (rec["default"].get<bool>()) {
+                rc.ctx = defaults[pid];
+            } else if (rc.proc != NULL) {
+                struct veo_thr_ctxt_attr *attr = veo_alloc_thr_ctxt_attr();
+                veo_set_thr_ctxt_unordered(attr, rec["unordered"].get<bool>());
+                rc.ctx = veo_context_open_with_attr(rc.proc, attr);
+                veo_free_thr_ctxt_attr(attr);
+            }
+        }
+
+        return rc;
+    }
+
+public:
+    void submit(const json &rec)
+    {
+        replay_context &rc = get_context(rec);
+        const json &req = rec["req"];
+        struct veo_proc_handle *proc = rc.proc;
+
+        pending_request p;
+        p.cmd = req["cmd"];
+        p.submitted = replay_clock::now();
+        p.sync = true;
+        p.reqid = 0;
+
+        if (proc == NULL) {
+            return;
+        }
+
+        switch (p.cmd) {
+        case VS_CMD_LOAD_LIBRARY:
+            p.reqid = veo_load_library(
+                proc, req["libname"].get<std::string>().c_str());
+            break;
+        case VS_CMD_UNLOAD_LIBRARY:
+            veo_unload_library(proc, remap_lib(req["libhdl"]));
+            break;
+        case VS_CMD_GET_SYM:
+            p.reqid = veo_get_sym(proc, remap_lib(req["libhdl"]),
+                                  req["symname"].get<std::string>().c_str());
+            break;
+        case VS_CMD_GET_SYMS: {
+            const std::vector<std::string> names = req["symnames"];
+            std::vector<const char *> ptrs;
+            for (const auto &name : names) ptrs.push_back(name.c_str());
+
+            p.addrs.resize(names.size());
+            veo_get_syms(proc, remap_lib(req["libhdl"]), ptrs.data(),
+                         ptrs.size(), p.addrs.data());
+            break;
+        }
+        case VS_CMD_ALLOC_MEM:
+            p.size = req["size"];
+            veo_alloc_mem(proc, &p.reqid, p.size);
+            break;
+        case VS_CMD_FREE_MEM: {
+            uint64_t addr = req["addr"];
+            veo_free_mem(proc, remap(addr));
+            allocs.erase(addr);
+            break;
+        }
+        case VS_CMD_GET_MEM_USAGE: {
+            // veo_proc_destroy lists leaked buffers by itself
+            if (req.value("buffers", false)) return;
+
+            struct veo_mem_usage usage;
+            veo_get_mem_usage(proc, &usage);
+            break;
+        }
+        case VS_CMD_READ_MEM: {
+            std::vector<uint8_t> buf(req["size"].get<uint64_t>());
+            veo_read_mem(proc, buf.data(), remap(req["src"]), buf.size());
+            break;
+        }
+        case VS_CMD_WRITE_MEM: {
+            std::vector<uint8_t> buf(req["data"]["len"].get<uint64_t>());
+            veo_write_mem(proc, remap(req["dst"]), buf.data(), buf.size());
+            break;
+        }
+        case VS_CMD_WRITE_MEM_FROM_FILE:
+        case VS_CMD_READ_MEM_TO_FILE: {
+            bool to_file = p.cmd == VS_CMD_READ_MEM_TO_FILE;
+            // Never overwrite files when replaying
+            const std::string path = to_file ? "/dev/null" : req["path"];
+            uint64_t addr = remap(to_file ? req["src"] : req["dst"]);
+
+            if (rc.ctx == NULL) {
+                to_file ? veo_read_mem_to_file(proc, path.c_str(), 0, addr,
+                                               req["size"])
+                        : veo_write_mem_from_file(proc, addr, path.c_str(),
+                                                  req["offset"], req["size"]);
+            } else {
+                p.sync = false;
+                p.reqid = to_file ? veo_async_read_mem_to_file(
+                                        rc.ctx, path.c_str(), 0, addr,
+                                        req["size"])
+                                  : veo_async_write_mem_from_file(
+                                        rc.ctx, addr, path.c_str(),
+                                        req["offset"], req["size"]);
+            }
+            break;
+        }
+        case VS_CMD_ASYNC_READ_MEM:
+        case VS_CMD_ASYNC_WRITE_MEM: {
+            bool read = p.cmd == VS_CMD_ASYNC_READ_MEM;
+            const json &desc = req[read ? "copy_out" : "copy_in"][0];
+            uint64_t ve_ptr = remap(desc["ve_ptr"]);
+
+            p.sync = false;
+            p.buf = std::make_shared<std::vector<uint8_t>>(
+                desc["len"].get<uint64_t>());
+
+            // Strided copies keep their VE layout and are packed on the VH
+            if (desc.contains("width")) {
+                const uint64_t width = desc["width"];
+                const uint64_t pitch = desc["ve_pitch"];
+                const uint64_t height = width ? p.buf->size() / width : 0;
+
+                p.reqid = read ? veo_async_read_mem_2d(rc.ctx, p.buf->data(),
+                                                       width, ve_ptr, pitch,
+                                                       width, height)
+                               : veo_async_write_mem_2d(rc.ctx, ve_ptr, pitch,
+                                                        p.buf->data(), width,
+                                                        width, height);
+                break;
+            }
+
+            p.reqid = read ? veo_async_read_mem(rc.ctx, p.buf->data(), ve_ptr,
+                                                p.buf->size())
+                           : veo_async_write_mem(rc.ctx, ve_ptr, p.buf->data(),
+                                                 p.buf->size());
+            break;
+        }
+        case VS_CMD_CALL_ASYNC:
+        case VS_CMD_CALL_ASYNC_BY_NAME:
+            p.sync = false;
+            submit_call(rc, req, std::move(p));
+            return;
+        case VS_CMD_CALL_ASYNC_PACKED: {
+            const auto &types = req["types"].get_binary();
+            std::vector<uint64_t> vals(types.size());
+            std::memcpy(vals.data(), req["vals"].get_binary().data(),
+                        vals.size() * sizeof(uint64_t));
+
+            for (size_t i = 0; i < vals.size(); i++) {
+                if (types[i] <= VS_ARG_TYPE_U64) vals[i] = remap(vals[i]);
+            }
+
+            p.sync = false;
+            p.reqid = veo_call_async_packed(rc.ctx, remap(req["addr"]),
+                                            types.data(), vals.data(),
+                                            types.size());
+            break;
+        }
+        case VS_CMD_CALL_ASYNC_BATCH:
+        case VS_CMD_CALL_ASYNC_BATCH_BY_NAME:
+            p.sync = false;
+            submit_batch(rc, req, p);
+            return;
+        case VS_CMD_SYNC_CONTEXT:
+            veo_context_sync(rc.ctx);
+            record_latency(p.cmd, p.submitted);
+            return;
+        case VS_CMD_CLOSE_CONTEXT:
+            veo_context_close(rc.ctx);
+            ctxs.erase(rec["ctx"]);
+            return;
+        case VS_CMD_QUIT:
+            veo_proc_destroy(proc);
+            procs.erase(rec["pid"].get<uint64_t>());
+            defaults.erase(rec["pid"].get<uint64_t>());
+            ctxs.erase(rec["ctx"]);
+            return;
+        default:
+            num_skipped++;
+            return;
+        }
+
+        if (p.sync) {
+            record_latency(p.cmd, p.submitted);
+        }
+
+        rc.pending[req["reqid"]] = std::move(p);
+    }
+
+    // Collect a result at the point where it arrived in the recording
+    void complete(const json &rec)
+    {
+        const auto ctx_it = ctxs.find(rec["ctx"]);
+        if (ctx_it == ctxs.end()) return;
+
+        replay_context &rc = ctx_it->second;
+        const auto it = rc.pending.find(rec["reqid"]);
+        if (it == rc.pending.end()) return;
+
+        pending_request &p = it->second;
+        const json &old_result = rec["result"];
+
+        if (p.sync) {
+            switch (p.cmd) {
+            case VS_CMD_LOAD_LIBRARY:
+                libs[old_result] = p.reqid;
+                break;
+            case VS_CMD_GET_SYM:
+                syms[old_result] = p.reqid;
+                break;
+            case VS_CMD_GET_SYMS:
+                for (size_t i = 0; i < p.addrs.size(); i++) {
+                    syms[old_result[i]] = p.addrs[i];
+                }
+                break;
+            case VS_CMD_ALLOC_MEM:
+                allocs[old_result] = allocation{p.reqid, p.size};
+                break;
+            }
+        } else {
+            uint64_t retval;
+            veo_call_wait_result(rc.ctx, p.reqid, &retval);
+            record_latency(p.cmd, p.submitted);
+        }
+
+        rc.pending.erase(it);
+    }
+
+    void report(double seconds) const
+    {
+        size_t total = 0;
+
+        printf("%-24s %10s %12s %12s %12s\n", "cmd", "count", "mean_us",
+               "p50_us", "p99_us");
+
+        for (const auto &entry : latencies) {
+            std::vector<double> v = entry.second;
+            std::sort(v.begin(), v.end());
+
+            double sum = 0;
+            for (double x : v) sum += x;
+
+            printf("%-24s %10zu %12.2f %12.2f %12.2f\n", entry.first.c_str(),
+                   v.size(), sum / v.size(), v[v.size() / 2],
+                   v[std::min(v.size() - 1, v.size() * 99 / 100)]);
+            total += v.size();
+        }
+
+        printf("\n%zu requests in %.3f s (%.0f requests/s), %zu skipped\n",
+               total, seconds, total / seconds, num_skipped);
+    }
+};
+
+static bool read_records(const char *path, std::vector<json> &records)
+{
+    std::ifstream ifs(path, std::ios::binary);
+    char magic[sizeof(request_recorder::MAGIC)];
+
+    if (!ifs.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, request_recorder::MAGIC, sizeof(magic)) != 0) {
+        fprintf(stderr, "%s is not a request recording\n", path);
+        return false;
+    }
+
+    uint32_t size;
+    while (ifs.read(reinterpret_cast<char *>(&size), sizeof(size))) {
+        std::vector<uint8_t> buf(size);
+
+        if (!ifs.read(reinterpret_cast<char *>(buf.data()), size)) {
+            fprintf(stderr, "%s is truncated\n", path);
+            break;
+        }
+
+        records.push_back(json::from_msgpack(buf));
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    // Speed relative to the recording. 0 means as fast as possible.
+    double speed = 0;
+    const char *path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            const std::string s = argv[++i];
+            speed = s == "max" ? 0 : std::atof(s.c_str());
+        } else {
+            path = argv[i];
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "Usage: %s [--speed max|FACTOR] RECORDING\n",
+                argv[0]);
+        return 1;
+    }
+
+    std::vector<json> records;
+    if (!read_records(path, records)) {
+        return 1;
+    }
+
+    replayer r;
+    const auto start = replay_clock::now();
+
+    for (const auto &rec : records) {
+        if (speed > 0) {
+            std::this_thread::sleep_until(
+                start + std::chrono::nanoseconds(static_cast<uint64_t>(
+                            rec["t"].get<uint64_t>() / speed)));
+        }
+
+        if (rec["type"] == "submit") {
+            r.submit(rec);
+        } else {
+            r.complete(rec);
+        }
+    }
+
+    r.report(std::chrono::duration<double>(replay_clock::now() - start)
+                 .count());
+
+    return 0;
+}
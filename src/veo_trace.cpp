@@ -0,0 +1,138 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "stub.hpp"
+
+struct decoded_record {
+    uint32_t pid;
+    trace_record rec;
+};
+
+// A VS_DEBUG call site
+struct log_site {
+    size_t nargs;
+    std::string fmt;
+};
+
+// Call sites of all traces by PID and ID
+static std::map<std::pair<uint32_t, int16_t>, log_site> sites;
+
+// Read the call sites listed next to a trace file
+static void read_sites(const std::string &path, uint32_t pid)
+{
+    std::ifstream ifs(path.substr(0, path.size() - 4) + ".fmt");
+    int16_t id;
+    log_site site;
+
+    while (ifs >> id >> site.nargs && ifs.get() == ' ' &&
+           std::getline(ifs, site.fmt)) {
+        sites[{pid, id}] = site;
+    }
+}
+
+// Substitute the recorded arguments into the format of a call site
+static std::string format_log(uint32_t pid, const trace_record &rec)
+{
+    const auto it = sites.find({pid, rec.cmd});
+    if (it == sites.end()) {
+        return "unknown call site " + std::to_string(rec.cmd);
+    }
+
+    const uint64_t args[2] = {rec.reqid, rec.size};
+    std::string msg = it->second.fmt;
+    size_t pos = 0;
+
+    for (size_t i = 0; i < it->second.nargs; i++) {
+        pos = msg.find("{}", pos);
+        if (pos == std::string::npos) break;
+
+        const std::string arg = std::to_string(args[i]);
+        msg.replace(pos, 2, arg);
+        pos += arg.size();
+    }
+
+    return msg;
+}
+
+// Read the valid records of a trace file in the order they were written
+static bool read_trace(const char *path, std::vector<decoded_record> &out)
+{
+    std::ifstream ifs(path, std::ios::binary);
+
+    char magic[sizeof(TRACE_MAGIC)];
+    uint32_t pid, reserved;
+    uint64_t capacity, head;
+
+    ifs.read(magic, sizeof(magic));
+    ifs.read(reinterpret_cast<char *>(&pid), sizeof(pid));
+    ifs.read(reinterpret_cast<char *>(&reserved), sizeof(reserved));
+    ifs.read(reinterpret_cast<char *>(&capacity), sizeof(capacity));
+    ifs.read(reinterpret_cast<char *>(&head), sizeof(head));
+
+    if (!ifs || !std::equal(magic, magic + sizeof(magic), TRACE_MAGIC)) {
+        fprintf(stderr, "%s is not a veo-stubs trace\n", path);
+        return false;
+    }
+
+    std::vector<trace_record> records(capacity);
+    ifs.read(reinterpret_cast<char *>(records.data()),
+             capacity * sizeof(trace_record));
+
+    read_sites(path, pid);
+
+    uint64_t first = head > capacity ? head - capacity : 0;
+
+    for (uint64_t i = first; i < head; i++) {
+        out.push_back({pid, records[i % capacity]});
+    }
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s TRACE_FILE...\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<decoded_record> records;
+
+    for (int i = 1; i < argc; i++) {
+        if (!read_trace(argv[i], records)) {
+            return 1;
+        }
+    }
+
+    // Traces of the VH and VE share the same clock, so they can be merged
+    std::stable_sort(records.begin(), records.end(),
+                     [](const decoded_record &a, const decoded_record &b) {
+                         return a.rec.timestamp < b.rec.timestamp;
+                     });
+
+    uint64_t start = records.empty() ? 0 : records.front().rec.timestamp;
+
+    printf("%12s %8s %10s %5s %-24s %20s %12s\n", "time_us", "pid", "tid",
+           "event", "cmd", "reqid", "bytes");
+
+    for (const auto &r : records) {
+        if (r.rec.event == VS_TRACE_LOG) {
+            printf("%12.3f %8u %10u %5s %s\n",
+                   (r.rec.timestamp - start) / 1e3, r.pid, r.rec.tid, "log",
+                   format_log(r.pid, r.rec).c_str());
+            continue;
+        }
+
+        printf("%12.3f %8u %10u %5s %-24s %20lld %12llu\n",
+               (r.rec.timestamp - start) / 1e3, r.pid, r.rec.tid,
+               r.rec.event == VS_TRACE_SEND ? "send" : "recv",
+               cmd_name(r.rec.cmd), static_cast<long long>(r.rec.reqid),
+               static_cast<unsigned long long>(r.rec.size));
+    }
+
+    return 0;
+}
@@ -1,5 +1,11 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#endif
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 #include "crc32.h"
 
@@ -22,6 +28,50 @@ uint64_t iota(uint64_t ptr, uint64_t size)
     return 0;
 }
 
+uint64_t sleep_ms(uint64_t ms)
+{
+    usleep(ms * 1000);
+    return ms;
+}
+
+int64_t sum_mixed(int8_t a, uint16_t b, int32_t c, int64_t d, double e,
+                  float f)
+{
+    return a + b + c + d + (int64_t)e + (int64_t)f;
+}
+
+uint64_t num_allowed_cpus()
+{
+#ifdef __linux__
+    cpu_set_t cpuset;
+    if (sched_getaffinity(0, sizeof(cpuset), &cpuset) == 0) {
+        return CPU_COUNT(&cpuset);
+    }
+#endif
+    return 0;
+}
+
+uint64_t omp_num_threads()
+{
+    const char *env = getenv("OMP_NUM_THREADS");
+    return env ? atoi(env) : 0;
+}
+
+// Wait until n callers have arrived, giving up after about 5 seconds.
+// Returns the number of callers that have arrived.
+uint64_t barrier_wait(uint64_t n)
+{
+    static uint64_t arrived = 0;
+    uint64_t count = __atomic_add_fetch(&arrived, 1, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < 5000 && count < n; i++) {
+        usleep(1000);
+        count = __atomic_load_n(&arrived, __ATOMIC_SEQ_CST);
+    }
+
+    return count;
+}
+
 uint64_t raise_sigabrt()
 {
     raise(SIGABRT);
@@ -0,0 +1,502 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fstream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include "crc32.h"
+#include "ve_offload.h"
+#include "veo_stubs.h"
+
+using stress_clock = std::chrono::steady_clock;
+
+enum stress_op {
+    OP_CALL,
+    OP_WRITE,
+    OP_READ,
+    OP_ASYNC,
+    OP_ALLOC,
+    OP_REOPEN,
+    NUM_OPS,
+};
+
+static const char *op_names[NUM_OPS] = {"call",  "write", "read",
+                                        "async", "alloc", "reopen"};
+
+struct stress_config {
+    double duration = 10;
+    size_t num_procs = 2;
+    size_t num_threads = 8;
+    size_t max_size = 1 << 20;
+    // Close and reopen the context after this many operations
+    size_t churn = 100;
+    uint64_t seed = 0xdeadbeef;
+};
+
+// Latency histogram with 16 buckets per power of two
+class histogram
+{
+    static constexpr size_t NUM_BUCKETS = 64 * 16;
+    std::array<uint64_t, NUM_BUCKETS> buckets{};
+
+public:
+    uint64_t count = 0;
+    double sum_ns = 0;
+
+    void add(uint64_t ns)
+    {
+        size_t idx = ns > 0 ? static_cast<size_t>(std::log2(ns) * 16) : 0;
+        buckets[std::min(idx, NUM_BUCKETS - 1)]++;
+        count++;
+        sum_ns += ns;
+    }
+
+    void merge(const histogram &other)
+    {
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        sum_ns += other.sum_ns;
+    }
+
+    // Upper bound of the bucket containing the given quantile
+    double percentile_us(double q) const
+    {
+        uint64_t rank = static_cast<uint64_t>(std::ceil(q * count));
+        uint64_t seen = 0;
+
+        for (size_t i = 0; i < NUM_BUCKETS; i++) {
+            seen += buckets[i];
+            if (seen >= rank && seen > 0) {
+                return std::exp2((i + 1) / 16.0) / 1e3;
+            }
+        }
+
+        return 0;
+    }
+};
+
+struct worker_stats {
+    histogram latency[NUM_OPS];
+    uint64_t bytes = 0;
+    uint64_t errors = 0;
+};
+
+struct stress_proc {
+    struct veo_proc_handle *proc;
+    uint64_t handle;
+    // veo_context_open and veo_context_close are not safe to call
+    // concurrently on the same proc
+    std::mutex ctx_mtx;
+};
+
+static size_t count_threads()
+{
+    size_t n = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == NULL) return 0;
+
+    while (struct dirent *ent = readdir(dir)) {
+        if (ent->d_name[0] != '.') n++;
+    }
+
+    closedir(dir);
+    return n;
+}
+
+static size_t resident_kib()
+{
+    std::ifstream ifs("/proc/self/statm");
+    size_t total = 0, resident = 0;
+    ifs >> total >> resident;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+class stress_worker
+{
+    const stress_config &config;
+    stress_proc &sp;
+    struct veo_thr_ctxt *ctx = NULL;
+    std::mt19937_64 engine;
+    worker_stats &stats;
+
+    uint64_t checksum_sym = 0;
+    uint64_t iota_sym = 0;
+    uint64_t increment_sym = 0;
+
+    void fail(const char *what)
+    {
+        fprintf(stderr, "%s failed\n", what);
+        stats.errors++;
+    }
+
+    // Transfer sizes are log-uniformly distributed
+    size_t random_size()
+    {
+        std::uniform_real_distribution<double> dist(
+            0, std::log2(static_cast<double>(config.max_size)));
+        return static_cast<size_t>(std::exp2(dist(engine)));
+    }
+
+    void fill_random(std::vector<uint8_t> &buf)
+    {
+        for (auto &b : buf) {
+            b = static_cast<uint8_t>(engine());
+        }
+    }
+
+    uint64_t call(uint64_t sym, uint64_t arg0, uint64_t arg1)
+    {
+        struct veo_args *argp = veo_args_alloc();
+        veo_args_set_u64(argp, 0, arg0);
+        veo_args_set_u64(argp, 1, arg1);
+
+        uint64_t retval = 0;
+        uint64_t reqid = veo_call_async(ctx, sym, argp);
+        if (reqid == VEO_REQUEST_ID_INVALID ||
+            veo_call_wait_result(ctx, reqid, &retval) != VEO_COMMAND_OK) {
+            fail("call");
+        }
+
+        veo_args_free(argp);
+        return retval;
+    }
+
+    void do_call()
+    {
+        uint64_t x = engine();
+        if (call(increment_sym, x, 0) != x + 1) fail("increment");
+    }
+
+    // Write a random buffer and verify its checksum on the VE
+    void do_write()
+    {
+        std::vector<uint8_t> buf(random_size());
+        fill_random(buf);
+
+        uint64_t ve_buf;
+        if (veo_alloc_mem(sp.proc, &ve_buf, buf.size()) != 0) {
+            return fail("alloc");
+        }
+
+        if (veo_write_mem(sp.proc, ve_buf, buf.data(), buf.size()) != 0) {
+            fail("write");
+        } else if (call(checksum_sym, ve_buf, buf.size()) !=
+                   crc32(buf.data(), buf.size())) {
+            fail("write checksum");
+        }
+
+        veo_free_mem(sp.proc, ve_buf);
+        stats.bytes += buf.size();
+    }
+
+    // Fill a buffer on the VE and verify the data read back
+    void do_read()
+    {
+        std::vector<uint8_t> buf(random_size());
+
+        uint64_t ve_buf;
+        if (veo_alloc_mem(sp.proc, &ve_buf, buf.size()) != 0) {
+            return fail("alloc");
+        }
+
+        call(iota_sym, ve_buf, buf.size());
+
+        if (veo_read_mem(sp.proc, buf.data(), ve_buf, buf.size()) != 0) {
+            fail("read");
+        } else {
+            for (size_t i = 0; i < buf.size(); i++) {
+                if (buf[i] != static_cast<uint8_t>(i)) {
+                    fail("read data");
+                    break;
+                }
+            }
+        }
+
+        veo_free_mem(sp.proc, ve_buf);
+        stats.bytes += buf.size();
+    }
+
+    // Pipeline an asynchronous write, checksum and read back on the context
+    void do_async()
+    {
+        std::vector<uint8_t> src(random_size()), dst(src.size());
+        fill_random(src);
+
+        uint64_t ve_buf;
+        if (veo_alloc_mem(sp.proc, &ve_buf, src.size()) != 0) {
+            return fail("alloc");
+        }
+
+        struct veo_args *argp = veo_args_alloc();
+        veo_args_set_u64(argp, 0, ve_buf);
+        veo_args_set_u64(argp, 1, src.size());
+
+        uint64_t reqids[] = {
+            veo_async_write_mem(ctx, ve_buf, src.data(), src.size()),
+            veo_call_async(ctx, checksum_sym, argp),
+            veo_async_read_mem(ctx, dst.data(), ve_buf, dst.size()),
+        };
+        uint64_t results[3] = {};
+
+        for (size_t i = 0; i < 3; i++) {
+            if (reqids[i] == VEO_REQUEST_ID_INVALID ||
+                veo_call_wait_result(ctx, reqids[i], &results[i]) !=
+                    VEO_COMMAND_OK) {
+                fail("async");
+            }
+        }
+
+        if (results[1] != crc32(src.data(), src.size())) {
+            fail("async checksum");
+        }
+        if (src != dst) {
+            fail("async data");
+        }
+
+        veo_args_free(argp);
+        veo_free_mem(sp.proc, ve_buf);
+        stats.bytes += src.size() * 2;
+    }
+
+    void do_alloc()
+    {
+        uint64_t ve_buf;
+        if (veo_alloc_mem(sp.proc, &ve_buf, random_size()) != 0) {
+            return fail("alloc");
+        }
+        veo_free_mem(sp.proc, ve_buf);
+    }
+
+    void open_context()
+    {
+        std::lock_guard<std::mutex> lock(sp.ctx_mtx);
+        ctx = veo_context_open(sp.proc);
+    }
+
+    void close_context()
+    {
+        std::lock_guard<std::mutex> lock(sp.ctx_mtx);
+        veo_context_close(ctx);
+        ctx = NULL;
+    }
+
+public:
+    stress_worker(const stress_config &config, stress_proc &sp, uint64_t seed,
+                  worker_stats &stats)
+        : config(config), sp(sp), engine(seed), stats(stats)
+    {
+        checksum_sym = veo_get_sym(sp.proc, sp.handle, "checksum");
+        iota_sym = veo_get_sym(sp.proc, sp.handle, "iota");
+        increment_sym = veo_get_sym(sp.proc, sp.handle, "increment");
+    }
+
+    void run(stress_clock::time_point deadline)
+    {
+        std::discrete_distribution<int> pick({40, 15, 15, 20, 10});
+        size_t num_ops = 0;
+
+        open_context();
+
+        while (stress_clock::now() < deadline && ctx != NULL) {
+            int op = pick(engine);
+            if (config.churn > 0 && ++num_ops % config.churn == 0) {
+                op = OP_REOPEN;
+            }
+
+            auto start = stress_clock::now();
+
+            switch (op) {
+            case OP_CALL:
+                do_call();
+                break;
+            case OP_WRITE:
+                do_write();
+                break;
+            case OP_READ:
+                do_read();
+                break;
+            case OP_ASYNC:
+                do_async();
+                break;
+            case OP_ALLOC:
+                do_alloc();
+                break;
+            case OP_REOPEN:
+                close_context();
+                open_context();
+                break;
+            }
+
+            stats.latency[op].add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    stress_clock::now() - start)
+                    .count());
+        }
+
+        if (ctx == NULL) {
+            fail("context open");
+        } else {
+            close_context();
+        }
+    }
+};
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [--duration SEC] [--procs N] [--threads N] "
+            "[--max-size BYTES] [--churn OPS] [--seed N]\n",
+            argv0);
+}
+
+int main(int argc, char *argv[])
+{
+    stress_config config;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        const std::string opt = argv[i];
+        const char *val = argv[++i];
+
+        if (opt == "--duration") {
+            config.duration = std::atof(val);
+        } else if (opt == "--procs") {
+            config.num_procs = std::max(1L, std::atol(val));
+        } else if (opt == "--threads") {
+            config.num_threads = std::max(1L, std::atol(val));
+        } else if (opt == "--max-size") {
+            config.max_size = std::max(2L, std::atol(val));
+        } else if (opt == "--churn") {
+            config.churn = std::atol(val);
+        } else if (opt == "--seed") {
+            config.seed = std::strtoull(val, NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    const size_t threads_before = count_threads();
+
+    std::vector<stress_proc> procs(config.num_procs);
+    for (size_t i = 0; i < procs.size(); i++) {
+        procs[i].proc = veo_proc_create_async(i);
+    }
+    for (size_t i = 0; i < procs.size(); i++) {
+        if (procs[i].proc == NULL ||
+            veo_proc_create_wait(procs[i].proc) != 0) {
+            fprintf(stderr, "Cannot create proc on VE node %zu\n", i);
+            return 1;
+        }
+        procs[i].handle = veo_load_library(procs[i].proc, "./libvetest.so");
+    }
+
+    std::vector<worker_stats> stats(config.num_threads);
+    std::vector<std::thread> workers;
+
+    const auto start = stress_clock::now();
+    const auto deadline =
+        start + std::chrono::duration_cast<stress_clock::duration>(
+                    std::chrono::duration<double>(config.duration));
+
+    // Sample the resident set halfway through to separate warmup from
+    // steady growth
+    size_t rss_mid = 0;
+    std::thread sampler([&] {
+        std::this_thread::sleep_until(start + (deadline - start) / 2);
+        rss_mid = resident_kib();
+    });
+
+    for (size_t i = 0; i < config.num_threads; i++) {
+        workers.emplace_back([&, i] {
+            stress_worker w(config, procs[i % procs.size()], config.seed + i,
+                            stats[i]);
+            w.run(deadline);
+        });
+    }
+
+    for (auto &t : workers) {
+        t.join();
+    }
+    sampler.join();
+
+    const double seconds =
+        std::chrono::duration<double>(stress_clock::now() - start).count();
+    const size_t rss_end = resident_kib();
+
+    uint64_t leaked_bytes = 0;
+    std::vector<struct veo_proc_handle *> handles;
+    for (auto &sp : procs) {
+        struct veo_mem_usage usage;
+        if (veo_get_mem_usage(sp.proc, &usage) == 0) {
+            leaked_bytes += usage.current;
+        }
+
+        veo_unload_library(sp.proc, sp.handle);
+        handles.push_back(sp.proc);
+    }
+    veo_proc_destroy_many(handles.data(), handles.size());
+
+    const size_t threads_after = count_threads();
+
+    worker_stats total;
+    for (const auto &s : stats) {
+        for (size_t op = 0; op < NUM_OPS; op++) {
+            total.latency[op].merge(s.latency[op]);
+        }
+        total.bytes += s.bytes;
+        total.errors += s.errors;
+    }
+
+    printf("%-8s %10s %12s %10s %10s %10s %10s\n", "op", "count", "ops/s",
+           "mean_us", "p50_us", "p99_us", "p999_us");
+
+    uint64_t num_ops = 0;
+    for (size_t op = 0; op < NUM_OPS; op++) {
+        const histogram &h = total.latency[op];
+        if (h.count == 0) continue;
+
+        printf("%-8s %10llu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+               op_names[op], static_cast<unsigned long long>(h.count),
+               h.count / seconds, h.sum_ns / h.count / 1e3,
+               h.percentile_us(0.5), h.percentile_us(0.99),
+               h.percentile_us(0.999));
+        num_ops += h.count;
+    }
+
+    printf("\n%llu ops in %.1f s (%.0f ops/s, %.1f MiB/s)\n",
+           static_cast<unsigned long long>(num_ops), seconds,
+           num_ops / seconds, total.bytes / seconds / (1 << 20));
+    printf("RSS: %zu KiB at half time, %zu KiB at end\n", rss_mid, rss_end);
+    printf("Threads: %zu before, %zu after\n", threads_before,
+           threads_after);
+    printf("Integrity errors: %llu\n",
+           static_cast<unsigned long long>(total.errors));
+
+    printf("Leaked VE memory: %llu bytes\n",
+           static_cast<unsigned long long>(leaked_bytes));
+
+    bool leaked_threads = threads_after > threads_before;
+    if (leaked_threads) {
+        printf("Leaked %zu threads\n", threads_after - threads_before);
+    }
+
+    return total.errors > 0 || leaked_bytes > 0 || leaked_threads ? 1 : 0;
+}
@@ -1,11 +1,24 @@
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <dirent.h>
+#include <fstream>
 #include <memory>
+#include <poll.h>
 #include <random>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include <doctest/doctest.h>
+#include <nlohmann/json.hpp>
 
 #include "crc32.h"
 #include "ve_offload.h"
+#include "veo.hpp"
+#include "veo_stubs.h"
 
 TEST_CASE("Create and destroy a proc handle")
 {
@@ -33,6 +46,64 @@ TEST_CASE("Create and destroy multiple proc handles")
     veo_proc_destroy(proc2);
 }
 
+TEST_CASE("Create and destroy proc handles concurrently")
+{
+    constexpr int NUM_PROCS = 4;
+
+    struct veo_proc_handle *procs[NUM_PROCS];
+
+    for (int i = 0; i < NUM_PROCS; i++) {
+        procs[i] = veo_proc_create_async(i);
+        REQUIRE(procs[i] != NULL);
+    }
+
+    // A proc cannot be used before poll or wait has reported it ready
+    uint64_t addr;
+    REQUIRE(veo_alloc_mem(procs[0], &addr, 8) == -1);
+    REQUIRE(veo_load_library(procs[0], "./libvetest.so") == 0);
+    REQUIRE(veo_context_open(procs[0]) == NULL);
+
+    for (int i = 0; i < NUM_PROCS; i++) {
+        int state;
+        while ((state = veo_proc_create_poll(procs[i])) ==
+               VEO_COMMAND_UNFINISHED) {
+            usleep(1000);
+        }
+        REQUIRE(state == VEO_COMMAND_OK);
+        REQUIRE(veo_proc_create_wait(procs[i]) == 0);
+        REQUIRE(veo_proc_identifier(procs[i]) == i);
+
+        struct veo_thr_ctxt *ctx1 = veo_context_open(procs[i]);
+        struct veo_thr_ctxt *ctx2 = veo_context_open(procs[i]);
+        REQUIRE(ctx1 != NULL);
+        REQUIRE(ctx2 != NULL);
+    }
+
+    // A proc listed twice is rejected before anything is destroyed
+    struct veo_proc_handle *twice[] = {procs[0], procs[1], procs[0]};
+    REQUIRE(veo_proc_destroy_many(twice, 3) == -1);
+    REQUIRE(veo_proc_identifier(procs[0]) == 0);
+
+    // Open contexts are closed as well
+    REQUIRE(veo_proc_destroy_many(procs, NUM_PROCS) == 0);
+
+    // A proc whose stub-veorun cannot be launched fails to become ready
+    const char *veorun_bin = getenv("VEORUN_BIN");
+    const std::string saved = veorun_bin ? veorun_bin : "";
+    setenv("VEORUN_BIN", "/nonexistent/stub-veorun", 1);
+    struct veo_proc_handle *proc = veo_proc_create_async(0);
+    if (veorun_bin) {
+        setenv("VEORUN_BIN", saved.c_str(), 1);
+    } else {
+        unsetenv("VEORUN_BIN");
+    }
+
+    REQUIRE(proc != NULL);
+    REQUIRE(veo_proc_create_wait(proc) == -1);
+    REQUIRE(veo_proc_create_poll(proc) == VEO_COMMAND_ERROR);
+    veo_proc_destroy(proc);
+}
+
 TEST_CASE("Create and close a thread context")
 {
     struct veo_proc_handle *proc = veo_proc_create(0);
@@ -147,6 +218,141 @@ TEST_CASE("Allocate and free VE memory")
     veo_proc_destroy(proc);
 }
 
+TEST_CASE("Track VE memory usage")
+{
+    setenv("VEO_STUBS_MEM_LIMIT", "4K", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_MEM_LIMIT");
+    REQUIRE(proc != NULL);
+
+    uint64_t buf1, buf2, buf3;
+    REQUIRE(veo_alloc_mem(proc, &buf1, 1024) == 0);
+    REQUIRE(veo_alloc_mem(proc, &buf2, 3072) == 0);
+
+    struct veo_mem_usage usage;
+    REQUIRE(veo_get_mem_usage(proc, &usage) == 0);
+    REQUIRE(usage.current == 4096);
+    REQUIRE(usage.peak == 4096);
+    REQUIRE(usage.limit == 4096);
+    REQUIRE(usage.num_buffers == 2);
+
+    // The limit is reached
+    REQUIRE(veo_alloc_mem(proc, &buf3, 1) != 0);
+
+    veo_free_mem(proc, buf2);
+
+    REQUIRE(veo_get_mem_usage(proc, &usage) == 0);
+    REQUIRE(usage.current == 1024);
+    REQUIRE(usage.peak == 4096);
+    REQUIRE(usage.num_buffers == 1);
+
+    REQUIRE(veo_alloc_mem(proc, &buf3, 2048) == 0);
+    veo_free_mem(proc, buf3);
+
+    // buf1 is reported as leaked
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Checkpoint and restore a proc")
+{
+    std::mt19937 engine(0xdeadbeef);
+    std::uniform_int_distribution<uint8_t> dist;
+
+    constexpr size_t BUF_SIZE = 10000;
+    const char *path = "veo_test.ckpt";
+
+    std::vector<uint8_t> vh_buf1(BUF_SIZE), vh_buf2(100);
+    for (auto &b : vh_buf1) b = dist(engine);
+    for (auto &b : vh_buf2) b = dist(engine);
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+    uint64_t addr = veo_get_sym(proc, handle, "checksum");
+    REQUIRE(addr > 0);
+
+    uint64_t ve_buf1, ve_buf2;
+    REQUIRE(veo_alloc_mem(proc, &ve_buf1, vh_buf1.size()) == 0);
+    REQUIRE(veo_alloc_mem(proc, &ve_buf2, vh_buf2.size()) == 0);
+    veo_write_mem(proc, ve_buf1, vh_buf1.data(), vh_buf1.size());
+    veo_write_mem(proc, ve_buf2, vh_buf2.data(), vh_buf2.size());
+
+    REQUIRE(veo_proc_checkpoint(proc, path) == 0);
+
+    // The dump of VE memory is only readable by its owner
+    struct stat st;
+    REQUIRE(stat(path, &st) == 0);
+    REQUIRE((st.st_mode & 0777) == 0600);
+
+    veo_free_mem(proc, ve_buf1);
+    veo_free_mem(proc, ve_buf2);
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+
+    proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    REQUIRE(veo_proc_restore(proc, "./nonexistent.ckpt") != 0);
+    REQUIRE(veo_proc_restore(proc, path) == 0);
+
+    struct veo_mem_usage usage;
+    REQUIRE(veo_get_mem_usage(proc, &usage) == 0);
+    REQUIRE(usage.current == BUF_SIZE + 100);
+    REQUIRE(usage.num_buffers == 2);
+
+    // Addresses from the old proc are translated to the restored ones
+    uint64_t new_buf1 = veo_proc_translate(proc, ve_buf1);
+    uint64_t new_buf2 = veo_proc_translate(proc, ve_buf2);
+    REQUIRE(veo_proc_translate(proc, ve_buf1 + 10) == new_buf1 + 10);
+    REQUIRE(veo_proc_translate(proc, 42) == 42);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, new_buf1);
+    veo_args_set_u64(argp, 1, BUF_SIZE);
+
+    uint64_t retval;
+    REQUIRE(veo_call_sync(proc, veo_proc_translate(proc, addr), argp,
+                          &retval) == 0);
+    REQUIRE(retval == crc32(vh_buf1.data(), BUF_SIZE));
+    veo_args_free(argp);
+
+    std::vector<uint8_t> out(vh_buf2.size());
+    veo_read_mem(proc, out.data(), new_buf2, out.size());
+    REQUIRE(out == vh_buf2);
+
+    // Checkpoint again to the file the buffers are mapped from
+    REQUIRE(veo_proc_checkpoint(proc, path) == 0);
+    std::fill(out.begin(), out.end(), 0);
+    veo_read_mem(proc, out.data(), new_buf2, out.size());
+    REQUIRE(out == vh_buf2);
+
+    struct veo_proc_handle *proc2 = veo_proc_create(0);
+    REQUIRE(proc2 != NULL);
+    REQUIRE(veo_proc_restore(proc2, path) == 0);
+
+    std::fill(out.begin(), out.end(), 0);
+    veo_read_mem(proc2, out.data(), veo_proc_translate(proc2, new_buf2),
+                 out.size());
+    REQUIRE(out == vh_buf2);
+
+    veo_free_mem(proc2, veo_proc_translate(proc2, new_buf1));
+    veo_free_mem(proc2, veo_proc_translate(proc2, new_buf2));
+    veo_proc_destroy(proc2);
+
+    veo_free_mem(proc, new_buf1);
+    veo_free_mem(proc, new_buf2);
+
+    REQUIRE(veo_get_mem_usage(proc, &usage) == 0);
+    REQUIRE(usage.current == 0);
+
+    REQUIRE(veo_unload_library(proc, veo_proc_translate(proc, handle)) == 0);
+    veo_proc_destroy(proc);
+
+    unlink(path);
+}
+
 TEST_CASE("Write VE memory")
 {
     std::mt19937 engine(0xdeadbeef);
@@ -280,6 +486,134 @@ TEST_CASE("Write and read back VE memory")
     veo_proc_destroy(proc);
 }
 
+TEST_CASE("Transfer strided regions of VE memory")
+{
+    // A 16 x 32 grid on the VE and an 8 x 10 tile at row 3, column 5
+    constexpr size_t NX = 32, NY = 16, W = 10, H = 8, OFFSET = 3 * NX + 5;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    std::vector<uint8_t> grid(NX * NY);
+    for (size_t i = 0; i < grid.size(); i++) grid[i] = i;
+
+    uint64_t ve_buf;
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, grid.size()) == 0);
+    veo_write_mem(proc, ve_buf, grid.data(), grid.size());
+
+    // Read the tile into a host buffer with a pitch of 12
+    std::vector<uint8_t> tile(12 * H, 0);
+    REQUIRE(veo_read_mem_2d(proc, tile.data(), 12, ve_buf + OFFSET, NX, W,
+                            H) == 0);
+
+    for (size_t i = 0; i < H; i++) {
+        for (size_t j = 0; j < 12; j++) {
+            const uint8_t expected = j < W ? grid[OFFSET + i * NX + j] : 0;
+            REQUIRE(tile[i * 12 + j] == expected);
+        }
+    }
+
+    // Write a packed tile back asynchronously
+    std::vector<uint8_t> packed(W * H, 0xff);
+    uint64_t reqid = veo_async_write_mem_2d(ctx, ve_buf + OFFSET, NX,
+                                            packed.data(), W, W, H);
+    REQUIRE(reqid != VEO_REQUEST_ID_INVALID);
+
+    uint64_t retval;
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+
+    for (size_t i = 0; i < H; i++) {
+        std::fill_n(grid.begin() + OFFSET + i * NX, W, 0xff);
+    }
+
+    std::vector<uint8_t> out(grid.size());
+    reqid = veo_async_read_mem_2d(ctx, out.data(), NX, ve_buf, NX, NX, NY);
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+    REQUIRE(out == grid);
+
+    // Rows must not overlap
+    REQUIRE(veo_write_mem_2d(proc, ve_buf, 4, packed.data(), W, W, H) != 0);
+
+    veo_free_mem(proc, ve_buf);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+// FNV-1a hash as used in recordings
+static uint64_t fnv1a(const uint8_t *buf, size_t len,
+                      uint64_t hash = 14695981039346656037ULL)
+{
+    for (size_t i = 0; i < len; i++) {
+        hash = (hash ^ buf[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+TEST_CASE("Record the payload hash of a strided write")
+{
+    // Run by the record-strided-write test, which sets VEO_STUBS_RECORD
+    const char *path = getenv("VEO_STUBS_RECORD");
+    if (path == NULL) {
+        return;
+    }
+
+    constexpr size_t W = 4, H = 3, VH_PITCH = 8;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t ve_buf;
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, W * H) == 0);
+
+    std::vector<uint8_t> src(VH_PITCH * H);
+    for (size_t i = 0; i < src.size(); i++) src[i] = i;
+
+    uint64_t reqid = veo_async_write_mem_2d(ctx, ve_buf, W, src.data(),
+                                            VH_PITCH, W, H);
+    uint64_t retval;
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+
+    veo_free_mem(proc, ve_buf);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+
+    // Only the rows are transferred, so only they are hashed
+    uint64_t expected = fnv1a(NULL, 0);
+    for (size_t i = 0; i < H; i++) {
+        expected = fnv1a(&src[i * VH_PITCH], W, expected);
+    }
+
+    std::ifstream ifs(path, std::ios::binary);
+    ifs.seekg(8);
+
+    bool found = false;
+    uint32_t size;
+    while (ifs.read(reinterpret_cast<char *>(&size), sizeof(size))) {
+        std::vector<uint8_t> buf(size);
+        ifs.read(reinterpret_cast<char *>(buf.data()), size);
+        const nlohmann::json rec = nlohmann::json::from_msgpack(buf);
+
+        if (rec["type"] != "submit" || !rec["req"].contains("copy_in")) {
+            continue;
+        }
+        for (const auto &desc : rec["req"]["copy_in"]) {
+            if (desc.contains("width")) {
+                REQUIRE(desc["hash"].get<uint64_t>() == expected);
+                found = true;
+            }
+        }
+    }
+
+    REQUIRE(found);
+}
+
 TEST_CASE("Load and unload library on VE")
 {
     struct veo_proc_handle *proc = veo_proc_create(0);
@@ -296,6 +630,40 @@ TEST_CASE("Load and unload library on VE")
     veo_proc_destroy(proc);
 }
 
+TEST_CASE("Preload libraries and symbols at startup")
+{
+    setenv("VEO_STUBS_PRELOAD", "./libsomerandomname.so:./libvetest.so", 1);
+    setenv("VEO_STUBS_PREBIND", "increment,nonexistent", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_PRELOAD");
+    unsetenv("VEO_STUBS_PREBIND");
+    REQUIRE(proc != NULL);
+
+    // Both come from the handshake
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+    uint64_t addr = veo_get_sym(proc, handle, "increment");
+    REQUIRE(addr > 0);
+
+    // Preloaded libraries cannot be unloaded
+    REQUIRE(veo_unload_library(proc, handle) == 0);
+    REQUIRE(veo_load_library(proc, "./libvetest.so") == handle);
+
+    // Other symbols are still resolved on request
+    REQUIRE(veo_get_sym(proc, handle, "checksum") > 0);
+    REQUIRE(veo_get_sym(proc, handle, "nonexistent") == 0);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_i32(argp, 0, 123);
+
+    uint64_t retval;
+    REQUIRE(veo_call_sync(proc, addr, argp, &retval) == 0);
+    REQUIRE(retval == 124);
+
+    veo_args_free(argp);
+    veo_proc_destroy(proc);
+}
+
 TEST_CASE("Get address of a symbol on VE")
 {
     struct veo_proc_handle *proc = veo_proc_create(0);
@@ -315,6 +683,57 @@ TEST_CASE("Get address of a symbol on VE")
     veo_proc_destroy(proc);
 }
 
+TEST_CASE("Get addresses of many symbols on VE")
+{
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    const char *names[] = {"increment", "checksum", "somerandomname"};
+    uint64_t addrs[3];
+
+    // Unresolved symbols get zero
+    REQUIRE(veo_get_syms(proc, handle, names, 3, addrs) != 0);
+    REQUIRE(addrs[0] == veo_get_sym(proc, handle, "increment"));
+    REQUIRE(addrs[1] == veo_get_sym(proc, handle, "checksum"));
+    REQUIRE(addrs[2] == 0);
+
+    // A handle of zero searches all loaded libraries
+    uint64_t found[2] = {0, 0};
+    REQUIRE(veo_get_syms(proc, 0, names, 2, found) == 0);
+    REQUIRE(found[0] == addrs[0]);
+    REQUIRE(found[1] == addrs[1]);
+
+    // Libraries are searched in the order they were loaded
+    {
+        std::ifstream src("./libvetest.so", std::ios::binary);
+        std::ofstream dst("./libvetest_copy.so", std::ios::binary);
+        dst << src.rdbuf();
+    }
+
+    uint64_t copy = veo_load_library(proc, "./libvetest_copy.so");
+    REQUIRE(copy > 0);
+    REQUIRE(copy != handle);
+
+    REQUIRE(veo_get_syms(proc, 0, names, 1, found) == 0);
+    REQUIRE(found[0] == addrs[0]);
+
+    veo_unload_library(proc, handle);
+    REQUIRE(veo_get_syms(proc, 0, names, 1, found) == 0);
+    REQUIRE(found[0] == veo_get_sym(proc, copy, "increment"));
+
+    handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(veo_get_syms(proc, 0, names, 1, found) == 0);
+    REQUIRE(found[0] == veo_get_sym(proc, copy, "increment"));
+
+    veo_unload_library(proc, copy);
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+    unlink("./libvetest_copy.so");
+}
+
 TEST_CASE("Call a VE function by name and wait for result")
 {
     struct veo_proc_handle *proc = veo_proc_create(0);
@@ -731,3 +1150,1090 @@ TEST_CASE("Asynchronously write memory to VE")
     veo_context_close(ctx);
     veo_proc_destroy(proc);
 }
+
+TEST_CASE("Write and read back VE memory backed by huge pages")
+{
+    std::mt19937 engine(0xdeadbeef);
+    std::uniform_int_distribution<uint8_t> dist;
+
+    constexpr size_t BUF_SIZE = 3 * 1024 * 1024;
+
+    setenv("VEO_STUBS_HUGEPAGE", "thp", 1);
+    setenv("VEO_STUBS_NUMA", "1", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_HUGEPAGE");
+    unsetenv("VEO_STUBS_NUMA");
+    REQUIRE(proc != NULL);
+
+    uint64_t ve_buf;
+    std::vector<uint8_t> vh_buf1(BUF_SIZE), vh_buf2(BUF_SIZE);
+
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        vh_buf1[i] = dist(engine);
+    }
+
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, BUF_SIZE) == 0);
+    REQUIRE(ve_buf % (2 * 1024 * 1024) == 0);
+
+    veo_write_mem(proc, ve_buf, vh_buf1.data(), BUF_SIZE);
+    veo_read_mem(proc, vh_buf2.data(), ve_buf, BUF_SIZE);
+
+    REQUIRE(vh_buf1 == vh_buf2);
+
+    veo_free_mem(proc, ve_buf);
+
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Transfer data between a file and VE memory")
+{
+    std::mt19937 engine(0xdeadbeef);
+    std::uniform_int_distribution<uint8_t> dist;
+
+    constexpr size_t BUF_SIZE = 1024;
+    constexpr off_t OFFSET = 100;
+
+    const std::string in_path =
+        "/tmp/veo-test." + std::to_string(getpid()) + ".in";
+    const std::string out_path =
+        "/tmp/veo-test." + std::to_string(getpid()) + ".out";
+
+    std::vector<uint8_t> vh_buf1(OFFSET + BUF_SIZE), vh_buf2(BUF_SIZE);
+
+    for (size_t i = 0; i < vh_buf1.size(); i++) {
+        vh_buf1[i] = dist(engine);
+    }
+
+    std::ofstream(in_path, std::ios::binary)
+        .write(reinterpret_cast<char *>(vh_buf1.data()), vh_buf1.size());
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    uint64_t ve_buf;
+    veo_alloc_mem(proc, &ve_buf, BUF_SIZE);
+
+    REQUIRE(veo_write_mem_from_file(proc, ve_buf, in_path.c_str(), OFFSET,
+                                    BUF_SIZE) == 0);
+    REQUIRE(veo_read_mem_to_file(proc, out_path.c_str(), 0, ve_buf,
+                                 BUF_SIZE) == 0);
+
+    std::ifstream(out_path, std::ios::binary)
+        .read(reinterpret_cast<char *>(vh_buf2.data()), BUF_SIZE);
+
+    REQUIRE(std::equal(vh_buf2.begin(), vh_buf2.end(),
+                       vh_buf1.begin() + OFFSET));
+
+    uint64_t reqid1 = veo_async_write_mem_from_file(
+        ctx, ve_buf, in_path.c_str(), 0, BUF_SIZE);
+    REQUIRE(reqid1 > 0);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, ve_buf);
+    veo_args_set_u64(argp, 1, BUF_SIZE);
+
+    uint64_t reqid2 = veo_call_async_by_name(ctx, handle, "checksum", argp);
+    REQUIRE(reqid2 > 0);
+
+    uint64_t retval;
+    REQUIRE(veo_call_wait_result(ctx, reqid1, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 0);
+
+    REQUIRE(veo_call_wait_result(ctx, reqid2, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == crc32(vh_buf1.data(), BUF_SIZE));
+
+    REQUIRE(veo_write_mem_from_file(proc, ve_buf, "/nonexistent", 0,
+                                    BUF_SIZE) == -1);
+
+    veo_args_free(argp);
+
+    veo_free_mem(proc, ve_buf);
+
+    unlink(in_path.c_str());
+    unlink(out_path.c_str());
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Wait for a result with timeout and cancel a queued request")
+{
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_args *argp1 = veo_args_alloc();
+    veo_args_set_u64(argp1, 0, 200);
+
+    struct veo_args *argp2 = veo_args_alloc();
+    veo_args_set_u64(argp2, 0, 123);
+
+    uint64_t reqid1 = veo_call_async_by_name(ctx, handle, "sleep_ms", argp1);
+    uint64_t reqid2 = veo_call_async_by_name(ctx, handle, "increment", argp2);
+    uint64_t reqid3 = veo_call_async_by_name(ctx, handle, "increment", argp2);
+
+    uint64_t retval;
+    REQUIRE(veo_call_wait_result_timeout(ctx, reqid1, 1000, &retval) ==
+            VEO_COMMAND_UNFINISHED);
+
+    REQUIRE(veo_call_cancel(ctx, reqid2) == 0);
+    REQUIRE(veo_call_wait_result(ctx, reqid2, &retval) == VEO_COMMAND_ERROR);
+
+    REQUIRE(veo_call_wait_result_timeout(ctx, reqid1, 10000000, &retval) ==
+            VEO_COMMAND_OK);
+    REQUIRE(retval == 200);
+
+    // A timeout too long for the clock waits without a limit
+    REQUIRE(veo_call_wait_result_timeout(ctx, reqid3, UINT64_MAX, &retval) ==
+            VEO_COMMAND_OK);
+    REQUIRE(retval == 124);
+
+    REQUIRE(veo_call_cancel(ctx, reqid3) == -1);
+
+    veo_args_free(argp1);
+    veo_args_free(argp2);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Poll event file descriptors of multiple contexts")
+{
+    constexpr size_t NUM_CTXTS = 4;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_thr_ctxt *ctxts[NUM_CTXTS];
+    struct pollfd fds[NUM_CTXTS];
+    uint64_t reqids[NUM_CTXTS];
+
+    struct veo_args *argp = veo_args_alloc();
+
+    for (size_t i = 0; i < NUM_CTXTS; i++) {
+        ctxts[i] = veo_context_open(proc);
+        REQUIRE(ctxts[i] != NULL);
+
+        fds[i].fd = veo_context_event_fd(ctxts[i]);
+        fds[i].events = POLLIN;
+        REQUIRE(fds[i].fd >= 0);
+
+        veo_args_set_u64(argp, 0, 10 * i);
+        reqids[i] = veo_call_async_by_name(ctxts[i], handle, "sleep_ms", argp);
+    }
+
+    size_t completed = 0;
+
+    while (completed < NUM_CTXTS) {
+        REQUIRE(poll(fds, NUM_CTXTS, 10000) > 0);
+
+        for (size_t i = 0; i < NUM_CTXTS; i++) {
+            if (!(fds[i].revents & POLLIN)) continue;
+
+            uint64_t val, retval;
+            REQUIRE(read(fds[i].fd, &val, sizeof(val)) == sizeof(val));
+
+            REQUIRE(veo_call_peek_result(ctxts[i], reqids[i], &retval) ==
+                    VEO_COMMAND_OK);
+            REQUIRE(retval == 10 * i);
+
+            fds[i].fd = -1;
+            completed++;
+        }
+    }
+
+    veo_args_free(argp);
+
+    for (size_t i = 0; i < NUM_CTXTS; i++) {
+        veo_context_close(ctxts[i]);
+    }
+
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Wait for any and all requests across contexts")
+{
+    constexpr int NUM_CTXTS = 4;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_thr_ctxt *ctxts[NUM_CTXTS];
+    struct veo_call_handle calls[NUM_CTXTS];
+
+    struct veo_args *argp = veo_args_alloc();
+
+    for (int i = 0; i < NUM_CTXTS; i++) {
+        ctxts[i] = veo_context_open(proc);
+        REQUIRE(ctxts[i] != NULL);
+
+        // The last context finishes first
+        veo_args_set_u64(argp, 0, 50 * (NUM_CTXTS - i - 1));
+        calls[i].ctx = ctxts[i];
+        calls[i].reqid =
+            veo_call_async_by_name(ctxts[i], handle, "sleep_ms", argp);
+    }
+
+    int idx;
+    uint64_t retval;
+    REQUIRE(veo_call_wait_any(calls, NUM_CTXTS, &idx, &retval) ==
+            VEO_COMMAND_OK);
+    REQUIRE(idx == NUM_CTXTS - 1);
+    REQUIRE(retval == 0);
+
+    // An empty array has no request to complete
+    REQUIRE(veo_call_wait_any(calls, 0, &idx, &retval) == VEO_COMMAND_ERROR);
+    REQUIRE(idx == -1);
+
+    uint64_t retvals[NUM_CTXTS - 1];
+    REQUIRE(veo_call_wait_all(calls, NUM_CTXTS - 1, retvals) ==
+            VEO_COMMAND_OK);
+
+    for (int i = 0; i < NUM_CTXTS - 1; i++) {
+        REQUIRE(retvals[i] == 50 * (NUM_CTXTS - i - 1));
+    }
+
+    veo_args_free(argp);
+
+    for (int i = 0; i < NUM_CTXTS; i++) {
+        veo_context_close(ctxts[i]);
+    }
+
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Call a VE function in a batch")
+{
+    constexpr int REP = 100;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    uint64_t addr = veo_get_sym(proc, handle, "add3");
+    REQUIRE(addr > 0);
+
+    struct veo_args *argps[REP];
+    uint64_t reqids[REP];
+    int sums[REP], a = 123;
+
+    for (int i = 0; i < REP; i++) {
+        sums[i] = i;
+
+        argps[i] = veo_args_alloc();
+        veo_args_set_stack(argps[i], VEO_INTENT_INOUT, 0,
+                           reinterpret_cast<char *>(&sums[i]), sizeof(int));
+        veo_args_set_stack(argps[i], VEO_INTENT_IN, 1,
+                           reinterpret_cast<char *>(&a), sizeof(a));
+    }
+
+    REQUIRE(veo_call_async_batch(ctx, addr, argps, REP, reqids) == 0);
+
+    for (int i = 0; i < REP; i++) {
+        uint64_t retval;
+        REQUIRE(veo_call_wait_result(ctx, reqids[i], &retval) ==
+                VEO_COMMAND_OK);
+        REQUIRE(sums[i] == i + a);
+    }
+
+    for (int i = 0; i < REP; i++) {
+        veo_args_clear(argps[i]);
+        veo_args_set_u64(argps[i], 0, i);
+    }
+
+    REQUIRE(veo_call_async_batch_by_name(ctx, handle, "increment", argps, REP,
+                                         reqids) == 0);
+
+    for (int i = 0; i < REP; i++) {
+        uint64_t retval;
+        REQUIRE(veo_call_wait_result(ctx, reqids[i], &retval) ==
+                VEO_COMMAND_OK);
+        REQUIRE(retval == i + 1);
+
+        veo_args_free(argps[i]);
+    }
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Record and launch a graph")
+{
+    constexpr size_t BUF_SIZE = 1024;
+    constexpr int REP = 10;
+
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    uint64_t iota = veo_get_sym(proc, handle, "iota");
+    uint64_t checksum = veo_get_sym(proc, handle, "checksum");
+    REQUIRE(iota > 0);
+    REQUIRE(checksum > 0);
+
+    uint64_t ve_buf;
+    uint8_t vh_buf1[BUF_SIZE], vh_buf2[BUF_SIZE];
+    veo_alloc_mem(proc, &ve_buf, BUF_SIZE);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, ve_buf);
+    veo_args_set_u64(argp, 1, BUF_SIZE);
+
+    struct veo_graph *graph = veo_graph_alloc();
+    REQUIRE(graph != NULL);
+
+    REQUIRE(veo_graph_add_write_mem(graph, ve_buf, vh_buf1, BUF_SIZE) == 0);
+    int call_idx = veo_graph_add_call(graph, checksum, argp);
+    REQUIRE(call_idx == 1);
+    REQUIRE(veo_graph_add_call(graph, iota, argp) == 2);
+    REQUIRE(veo_graph_add_read_mem(graph, vh_buf2, ve_buf, BUF_SIZE) == 3);
+
+    // Checksum is the last call, so its return value is the graph's
+    REQUIRE(veo_graph_add_call(graph, checksum, argp) == 4);
+
+    REQUIRE(veo_graph_instantiate(ctx, graph) == 0);
+
+    for (int i = 0; i < REP; i++) {
+        size_t len = BUF_SIZE / (i + 1);
+
+        for (size_t j = 0; j < BUF_SIZE; j++) {
+            vh_buf1[j] = i + j * 7;
+        }
+
+        veo_args_set_u64(argp, 1, len);
+        REQUIRE(veo_graph_set_call_args(graph, 4, argp) == 0);
+
+        uint64_t reqid = veo_graph_launch(ctx, graph);
+        REQUIRE(reqid != VEO_REQUEST_ID_INVALID);
+
+        uint64_t retval;
+        REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+
+        uint8_t x = 0;
+        for (size_t j = 0; j < BUF_SIZE; j++) {
+            REQUIRE(vh_buf2[j] == x++);
+        }
+
+        REQUIRE(retval == crc32(vh_buf2, len));
+    }
+
+    veo_graph_free(graph);
+
+    // A graph may outlive the context it was instantiated on
+    {
+        struct veo_thr_ctxt *ctx2 = veo_context_open(proc);
+        REQUIRE(ctx2 != NULL);
+
+        struct veo_graph *graph2 = veo_graph_alloc();
+        REQUIRE(veo_graph_add_call(graph2, iota, argp) == 0);
+        REQUIRE(veo_graph_instantiate(ctx2, graph2) == 0);
+
+        veo_context_close(ctx2);
+
+        REQUIRE(veo_graph_launch(ctx, graph2) == VEO_REQUEST_ID_INVALID);
+        veo_graph_free(graph2);
+    }
+
+    veo_args_free(argp);
+
+    veo_free_mem(proc, ve_buf);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Execute requests out of order on an unordered context")
+{
+    setenv("VEO_STUBS_NUM_THREADS", "4", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_NUM_THREADS");
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt_attr *attr = veo_alloc_thr_ctxt_attr();
+    REQUIRE(attr != NULL);
+    REQUIRE(veo_set_thr_ctxt_unordered(attr, 1) == 0);
+
+    int unordered;
+    REQUIRE(veo_get_thr_ctxt_unordered(attr, &unordered) == 0);
+    REQUIRE(unordered == 1);
+
+    struct veo_thr_ctxt *ctx = veo_context_open_with_attr(proc, attr);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_args *argp1 = veo_args_alloc();
+    veo_args_set_u64(argp1, 0, 300);
+
+    struct veo_args *argp2 = veo_args_alloc();
+    veo_args_set_u64(argp2, 0, 123);
+
+    struct veo_call_handle calls[2];
+    calls[0] = {ctx, veo_call_async_by_name(ctx, handle, "sleep_ms", argp1)};
+    calls[1] = {ctx, veo_call_async_by_name(ctx, handle, "increment", argp2)};
+
+    int idx;
+    uint64_t retval;
+    REQUIRE(veo_call_wait_any(calls, 2, &idx, &retval) == VEO_COMMAND_OK);
+    REQUIRE(idx == 1);
+    REQUIRE(retval == 124);
+
+    uint64_t reqid = veo_call_async_by_name(ctx, handle, "sleep_ms", argp1);
+    veo_context_sync(ctx);
+
+    REQUIRE(veo_call_peek_result(ctx, calls[0].reqid, &retval) ==
+            VEO_COMMAND_OK);
+    REQUIRE(retval == 300);
+    REQUIRE(veo_call_peek_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+
+    veo_args_free(argp1);
+    veo_args_free(argp2);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_free_thr_ctxt_attr(attr);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Run more ordered contexts than pool threads")
+{
+    constexpr int NUM_CTXTS = 4;
+
+    setenv("VEO_STUBS_NUM_THREADS", "2", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_NUM_THREADS");
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_thr_ctxt *ctxts[NUM_CTXTS];
+    struct veo_call_handle calls[NUM_CTXTS];
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, NUM_CTXTS);
+
+    // Each kernel blocks until the kernels of all other contexts run
+    for (int i = 0; i < NUM_CTXTS; i++) {
+        ctxts[i] = veo_context_open(proc);
+        REQUIRE(ctxts[i] != NULL);
+
+        calls[i].ctx = ctxts[i];
+        calls[i].reqid =
+            veo_call_async_by_name(ctxts[i], handle, "barrier_wait", argp);
+    }
+
+    uint64_t retvals[NUM_CTXTS];
+    REQUIRE(veo_call_wait_all(calls, NUM_CTXTS, retvals) == VEO_COMMAND_OK);
+
+    for (int i = 0; i < NUM_CTXTS; i++) {
+        REQUIRE(retvals[i] >= NUM_CTXTS);
+    }
+
+    veo_args_free(argp);
+
+    for (int i = 0; i < NUM_CTXTS; i++) {
+        veo_context_close(ctxts[i]);
+    }
+
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Fall back to the default trace size for invalid record counts")
+{
+    const std::string dir = "/tmp/veo-test." + std::to_string(getpid());
+    REQUIRE(mkdir(dir.c_str(), 0755) == 0);
+
+    for (const char *records : {"0", "abc", "16k"}) {
+        setenv("VEO_STUBS_TRACE_DIR", dir.c_str(), 1);
+        setenv("VEO_STUBS_TRACE_RECORDS", records, 1);
+        struct veo_proc_handle *proc = veo_proc_create(0);
+        unsetenv("VEO_STUBS_TRACE_DIR");
+        unsetenv("VEO_STUBS_TRACE_RECORDS");
+        REQUIRE(proc != NULL);
+
+        uint64_t handle = veo_load_library(proc, "./libvetest.so");
+        REQUIRE(handle > 0);
+
+        struct veo_thr_ctxt *ctx = veo_context_open(proc);
+        REQUIRE(ctx != NULL);
+
+        struct veo_args *argp = veo_args_alloc();
+        veo_args_set_u64(argp, 0, 41);
+
+        uint64_t retval;
+        uint64_t reqid = veo_call_async_by_name(ctx, handle, "increment", argp);
+        REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+        REQUIRE(retval == 42);
+
+        veo_args_free(argp);
+        veo_context_close(ctx);
+        veo_unload_library(proc, handle);
+        veo_proc_destroy(proc);
+    }
+
+    // Each process still wrote a trace and its list of log call sites
+    int num_traces = 0, num_sites = 0;
+    DIR *d = opendir(dir.c_str());
+    REQUIRE(d != NULL);
+    while (struct dirent *entry = readdir(d)) {
+        const std::string name = entry->d_name;
+        if (name[0] == '.') continue;
+        unlink((dir + "/" + name).c_str());
+        num_traces += name.substr(name.size() - 4) == ".bin";
+        num_sites += name.substr(name.size() - 4) == ".fmt";
+    }
+    closedir(d);
+    rmdir(dir.c_str());
+
+    REQUIRE(num_traces == 3);
+    REQUIRE(num_sites == 3);
+}
+
+TEST_CASE("Limit the requests in flight on a context")
+{
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    uint64_t ve_buf;
+    std::vector<uint8_t> vh_buf(800);
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, vh_buf.size()) == 0);
+
+    struct veo_thr_ctxt *default_ctx = veo_context_open(proc);
+    REQUIRE(default_ctx != NULL);
+
+    struct veo_thr_ctxt_attr *attr = veo_alloc_thr_ctxt_attr();
+    REQUIRE(veo_set_thr_ctxt_limits(attr, 2, 1024, 1) == 0);
+
+    uint64_t max_requests, max_bytes;
+    int nonblock;
+    REQUIRE(veo_get_thr_ctxt_limits(attr, &max_requests, &max_bytes,
+                                    &nonblock) == 0);
+    REQUIRE(max_requests == 2);
+    REQUIRE(max_bytes == 1024);
+    REQUIRE(nonblock == 1);
+
+    struct veo_thr_ctxt *ctx = veo_context_open_with_attr(proc, attr);
+    REQUIRE(ctx != NULL);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, 200);
+
+    uint64_t retval;
+
+    // Fail when too many requests are in flight
+    {
+        uint64_t reqid1 = veo_call_async_by_name(ctx, handle, "sleep_ms", argp);
+        uint64_t reqid2 = veo_call_async_by_name(ctx, handle, "sleep_ms", argp);
+        REQUIRE(reqid1 != VEO_REQUEST_ID_INVALID);
+        REQUIRE(reqid2 != VEO_REQUEST_ID_INVALID);
+
+        errno = 0;
+        REQUIRE(veo_call_async_by_name(ctx, handle, "sleep_ms", argp) ==
+                VEO_REQUEST_ID_INVALID);
+        REQUIRE(errno == EAGAIN);
+
+        // A completed request frees its slot
+        REQUIRE(veo_call_wait_result(ctx, reqid1, &retval) == VEO_COMMAND_OK);
+        uint64_t reqid3 = veo_call_async_by_name(ctx, handle, "sleep_ms", argp);
+        REQUIRE(reqid3 != VEO_REQUEST_ID_INVALID);
+
+        veo_call_wait_result(ctx, reqid2, &retval);
+        veo_call_wait_result(ctx, reqid3, &retval);
+    }
+
+    // Fail when too many bytes are in flight
+    {
+        uint64_t reqid1 = veo_call_async_by_name(ctx, handle, "sleep_ms", argp);
+        uint64_t reqid2 = veo_async_write_mem(ctx, ve_buf, vh_buf.data(),
+                                              vh_buf.size());
+        REQUIRE(reqid2 != VEO_REQUEST_ID_INVALID);
+
+        errno = 0;
+        REQUIRE(veo_async_read_mem(ctx, vh_buf.data(), ve_buf,
+                                   vh_buf.size()) == VEO_REQUEST_ID_INVALID);
+        REQUIRE(errno == EAGAIN);
+
+        veo_call_wait_result(ctx, reqid1, &retval);
+        veo_call_wait_result(ctx, reqid2, &retval);
+    }
+
+    // Block until a request completes
+    {
+        REQUIRE(veo_set_thr_ctxt_limits(attr, 1, 0, 0) == 0);
+        struct veo_thr_ctxt *blocking_ctx =
+            veo_context_open_with_attr(proc, attr);
+        REQUIRE(blocking_ctx != NULL);
+
+        auto start = std::chrono::steady_clock::now();
+
+        uint64_t reqid1 =
+            veo_call_async_by_name(blocking_ctx, handle, "sleep_ms", argp);
+        uint64_t reqid2 =
+            veo_call_async_by_name(blocking_ctx, handle, "sleep_ms", argp);
+
+        // The second submission waited for the first call
+        REQUIRE(std::chrono::steady_clock::now() - start >=
+                std::chrono::milliseconds(200));
+
+        REQUIRE(veo_call_wait_result(blocking_ctx, reqid1, &retval) ==
+                VEO_COMMAND_OK);
+        REQUIRE(veo_call_wait_result(blocking_ctx, reqid2, &retval) ==
+                VEO_COMMAND_OK);
+
+        veo_context_close(blocking_ctx);
+    }
+
+    veo_args_free(argp);
+    veo_free_mem(proc, ve_buf);
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_context_close(default_ctx);
+    veo_proc_destroy(proc);
+
+    // Limits are never applied to the default context, even if the first
+    // context is opened with them
+    {
+        proc = veo_proc_create(0);
+        REQUIRE(proc != NULL);
+        handle = veo_load_library(proc, "./libvetest.so");
+
+        REQUIRE(veo_set_thr_ctxt_limits(attr, 1, 0, 1) == 0);
+        ctx = veo_context_open_with_attr(proc, attr);
+        REQUIRE(ctx != NULL);
+
+        argp = veo_args_alloc();
+        veo_args_set_u64(argp, 0, 200);
+        uint64_t reqid = veo_call_async_by_name(ctx, handle, "sleep_ms", argp);
+        REQUIRE(reqid != VEO_REQUEST_ID_INVALID);
+
+        // Runs on the default context without waiting for the call
+        REQUIRE(veo_alloc_mem(proc, &ve_buf, 8) == 0);
+        REQUIRE(veo_call_peek_result(ctx, reqid, &retval) ==
+                VEO_COMMAND_UNFINISHED);
+
+        veo_call_wait_result(ctx, reqid, &retval);
+        veo_args_free(argp);
+        veo_free_mem(proc, ve_buf);
+        veo_context_close(ctx);
+        veo_proc_destroy(proc);
+    }
+
+    // Synchronous calls block at the limits even in nonblocking mode
+    {
+        setenv("VEO_STUBS_MAX_INFLIGHT", "1", 1);
+        setenv("VEO_STUBS_BACKPRESSURE", "fail", 1);
+        proc = veo_proc_create(0);
+        unsetenv("VEO_STUBS_MAX_INFLIGHT");
+        unsetenv("VEO_STUBS_BACKPRESSURE");
+        REQUIRE(proc != NULL);
+
+        handle = veo_load_library(proc, "./libvetest.so");
+        default_ctx = veo_context_open(proc);
+
+        argp = veo_args_alloc();
+        veo_args_set_u64(argp, 0, 100);
+        uint64_t reqid =
+            veo_call_async_by_name(default_ctx, handle, "sleep_ms", argp);
+        REQUIRE(reqid != VEO_REQUEST_ID_INVALID);
+
+        REQUIRE(veo_call_sync(proc, veo_get_sym(proc, handle, "sleep_ms"),
+                              argp, &retval) == VEO_COMMAND_OK);
+
+        veo_call_wait_result(default_ctx, reqid, &retval);
+        veo_args_free(argp);
+        veo_proc_destroy(proc);
+    }
+
+    veo_free_thr_ctxt_attr(attr);
+}
+
+TEST_CASE("Exchange messages over shared memory")
+{
+    setenv("VEO_STUBS_TRANSPORT", "shm", 1);
+    // Smaller than the transferred buffer so that the rings wrap around
+    setenv("VEO_STUBS_SHM_SIZE", "65536", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    struct veo_thr_ctxt_attr *attr = veo_alloc_thr_ctxt_attr();
+    REQUIRE(veo_set_thr_ctxt_unordered(attr, 1) == 0);
+    struct veo_thr_ctxt *unordered_ctx = veo_context_open_with_attr(proc, attr);
+    REQUIRE(unordered_ctx != NULL);
+    unsetenv("VEO_STUBS_TRANSPORT");
+    unsetenv("VEO_STUBS_SHM_SIZE");
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_args *argp = veo_args_alloc();
+
+    for (struct veo_thr_ctxt *c : {ctx, unordered_ctx}) {
+        for (uint64_t i = 0; i < 1000; i++) {
+            veo_args_set_u64(argp, 0, i);
+
+            uint64_t reqid =
+                veo_call_async_by_name(c, handle, "increment", argp);
+            uint64_t retval;
+            REQUIRE(veo_call_wait_result(c, reqid, &retval) ==
+                    VEO_COMMAND_OK);
+            REQUIRE(retval == i + 1);
+        }
+    }
+
+    const size_t BUF_SIZE = 1024 * 1024;
+    std::vector<uint8_t> src(BUF_SIZE), dst(BUF_SIZE);
+    std::mt19937 rng(0);
+    std::generate(src.begin(), src.end(), rng);
+
+    uint64_t ve_buf;
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, BUF_SIZE) == 0);
+    REQUIRE(veo_write_mem(proc, ve_buf, src.data(), BUF_SIZE) == 0);
+    REQUIRE(veo_read_mem(proc, dst.data(), ve_buf, BUF_SIZE) == 0);
+    REQUIRE(src == dst);
+    REQUIRE(veo_free_mem(proc, ve_buf) == 0);
+
+    veo_args_free(argp);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(unordered_ctx);
+    veo_context_close(ctx);
+    veo_free_thr_ctxt_attr(attr);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Call a VE function through the typed C++ interface")
+{
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    uint64_t increment = veo_get_sym(proc, handle, "increment");
+    uint64_t sum_mixed = veo_get_sym(proc, handle, "sum_mixed");
+    REQUIRE(increment > 0);
+    REQUIRE(sum_mixed > 0);
+
+    REQUIRE(veo::call<uint64_t>(ctx, increment, uint64_t(41)) == 42);
+    REQUIRE(veo::call<int64_t>(ctx, sum_mixed, int8_t(-1), uint16_t(60000),
+                               int32_t(-70000), int64_t(1) << 40, 2.5,
+                               3.5f) == 60000 - 70000 - 1 + (1L << 40) + 5);
+
+    uint64_t reqid = veo::call_async(ctx, increment, uint64_t(1));
+    uint64_t retval;
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 2);
+
+    uint8_t bad_type = 42;
+    uint64_t val = 0;
+    REQUIRE(veo_call_async_packed(ctx, increment, &bad_type, &val, 1) ==
+            VEO_REQUEST_ID_INVALID);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Reuse arguments across calls")
+{
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_i8(argp, 0, -1);
+    veo_args_set_u16(argp, 1, 60000);
+    veo_args_set_i32(argp, 2, -70000);
+    veo_args_set_i64(argp, 3, 0);
+    veo_args_set_double(argp, 4, 2.5);
+    veo_args_set_float(argp, 5, 3.5f);
+
+    uint64_t retval;
+    for (int64_t i = 0; i < 100; i++) {
+        // Only one slot changes between calls
+        veo_args_set_i64(argp, 3, i);
+
+        uint64_t reqid = veo_call_async_by_name(ctx, handle, "sum_mixed", argp);
+        REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+        REQUIRE(static_cast<int64_t>(retval) == 60000 - 70000 - 1 + i + 5);
+    }
+
+    // Replace a stack argument with a scalar and vice versa
+    int32_t a = 3, b = 4;
+    veo_args_clear(argp);
+    veo_args_set_stack(argp, VEO_INTENT_IN, 0, (char *)&a, sizeof(a));
+    veo_args_set_stack(argp, VEO_INTENT_IN, 1, (char *)&b, sizeof(b));
+    REQUIRE(veo_call_sync(proc, veo_get_sym(proc, handle, "add1"), argp,
+                          &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 7);
+
+    veo_args_set_u64(argp, 0, 41);
+    veo_args_set_u64(argp, 1, 0);
+    uint64_t reqid = veo_call_async_by_name(ctx, handle, "increment", argp);
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 42);
+
+    // Submit the same changed arguments from several threads at once
+    {
+        constexpr int NUM_THREADS = 4;
+        struct veo_thr_ctxt *ctxts[NUM_THREADS];
+        uint64_t reqids[NUM_THREADS];
+        std::vector<std::thread> threads;
+
+        for (int i = 0; i < NUM_THREADS; i++) {
+            ctxts[i] = veo_context_open(proc);
+            REQUIRE(ctxts[i] != NULL);
+        }
+
+        veo_args_set_u64(argp, 0, 99);
+
+        for (int i = 0; i < NUM_THREADS; i++) {
+            threads.emplace_back([&, i] {
+                reqids[i] = veo_call_async_by_name(ctxts[i], handle,
+                                                   "increment", argp);
+            });
+        }
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        for (int i = 0; i < NUM_THREADS; i++) {
+            REQUIRE(veo_call_wait_result(ctxts[i], reqids[i], &retval) ==
+                    VEO_COMMAND_OK);
+            REQUIRE(retval == 100);
+            veo_context_close(ctxts[i]);
+        }
+    }
+
+    veo_args_free(argp);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}
+
+#ifdef __linux__
+TEST_CASE("Partition host CPUs among VE nodes")
+{
+    const char *omp_env = getenv("OMP_NUM_THREADS");
+    const std::string saved_omp = omp_env != NULL ? omp_env : "";
+    unsetenv("OMP_NUM_THREADS");
+
+    setenv("VEO_STUBS_CPU_PARTITION", "0=0;1=0", 1);
+    struct veo_proc_handle *proc = veo_proc_create(1);
+    REQUIRE(proc != NULL);
+
+    // A thread count chosen by the user is kept
+    setenv("OMP_NUM_THREADS", "3", 1);
+    struct veo_proc_handle *proc2 = veo_proc_create(0);
+    unsetenv("VEO_STUBS_CPU_PARTITION");
+    REQUIRE(proc2 != NULL);
+
+    if (omp_env != NULL) {
+        setenv("OMP_NUM_THREADS", saved_omp.c_str(), 1);
+    } else {
+        unsetenv("OMP_NUM_THREADS");
+    }
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    struct veo_args *argp = veo_args_alloc();
+    uint64_t retval;
+
+    REQUIRE(veo_call_sync(proc, veo_get_sym(proc, handle, "num_allowed_cpus"),
+                          argp, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 1);
+
+    REQUIRE(veo_call_sync(proc, veo_get_sym(proc, handle, "omp_num_threads"),
+                          argp, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 1);
+
+    uint64_t handle2 = veo_load_library(proc2, "./libvetest.so");
+    REQUIRE(handle2 > 0);
+
+    REQUIRE(veo_call_sync(proc2,
+                          veo_get_sym(proc2, handle2, "omp_num_threads"),
+                          argp, &retval) == VEO_COMMAND_OK);
+    REQUIRE(retval == 3);
+
+    veo_args_free(argp);
+
+    veo_unload_library(proc2, handle2);
+    veo_proc_destroy(proc2);
+    veo_unload_library(proc, handle);
+    veo_proc_destroy(proc);
+}
+#endif
+
+TEST_CASE("Charge modeled costs to a virtual clock")
+{
+    // 10 us per transfer, 1 GB/s and 100 us per launch
+    setenv("VEO_STUBS_TIMING", "latency=10,bandwidth=1,launch=100", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_TIMING");
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx1 = veo_context_open(proc);
+    struct veo_thr_ctxt *ctx2 = veo_context_open(proc);
+    REQUIRE(ctx1 != NULL);
+    REQUIRE(ctx2 != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    constexpr size_t BUF_SIZE = 1000;
+    uint8_t vh_buf[BUF_SIZE] = {0};
+    uint64_t ve_buf;
+    REQUIRE(veo_alloc_mem(proc, &ve_buf, BUF_SIZE) == 0);
+
+    uint64_t vstart, vend, retval;
+
+    uint64_t reqid1 = veo_async_write_mem(ctx1, ve_buf, vh_buf, BUF_SIZE);
+    veo_context_sync(ctx1);
+    REQUIRE(veo_call_peek_vtime(ctx1, reqid1, &vstart, &vend) ==
+            VEO_COMMAND_OK);
+    REQUIRE(vend - vstart == 10000 + BUF_SIZE);
+    REQUIRE(veo_call_wait_result(ctx1, reqid1, &retval) == VEO_COMMAND_OK);
+
+    // The link is busy until the transfer on ctx1 has finished
+    uint64_t link_free = vend;
+    uint64_t reqid2 = veo_async_read_mem(ctx2, vh_buf, ve_buf, BUF_SIZE);
+    veo_context_sync(ctx2);
+    REQUIRE(veo_call_peek_vtime(ctx2, reqid2, &vstart, &vend) ==
+            VEO_COMMAND_OK);
+    REQUIRE(vstart >= link_free);
+    REQUIRE(veo_call_wait_result(ctx2, reqid2, &retval) == VEO_COMMAND_OK);
+
+    struct veo_args *argp = veo_args_alloc();
+    veo_args_set_u64(argp, 0, 1);
+
+    uint64_t reqid3 = veo_call_async_by_name(ctx1, handle, "increment", argp);
+    veo_context_sync(ctx1);
+    REQUIRE(veo_call_peek_vtime(ctx1, reqid3, &vstart, &vend) ==
+            VEO_COMMAND_OK);
+    REQUIRE(vstart == link_free);
+    REQUIRE(vend - vstart >= 100000);
+    REQUIRE(veo_call_wait_result(ctx1, reqid3, &retval) == VEO_COMMAND_OK);
+
+    uint64_t vtime;
+    REQUIRE(veo_context_vtime(ctx1, &vtime) == 0);
+    REQUIRE(vtime == vend);
+
+    veo_args_free(argp);
+    veo_free_mem(proc, ve_buf);
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx1);
+    veo_context_close(ctx2);
+    veo_proc_destroy(proc);
+}
+
+TEST_CASE("Charge copies of stack arguments in a batch")
+{
+    // Without kernel time, a batch costs as much as the same single calls,
+    // including the copies of their stack arguments
+    setenv("VEO_STUBS_TIMING",
+           "latency=10,bandwidth=1,launch=100,kernel_scale=0", 1);
+    struct veo_proc_handle *proc = veo_proc_create(0);
+    unsetenv("VEO_STUBS_TIMING");
+    REQUIRE(proc != NULL);
+
+    struct veo_thr_ctxt *ctx = veo_context_open(proc);
+    REQUIRE(ctx != NULL);
+
+    uint64_t handle = veo_load_library(proc, "./libvetest.so");
+    REQUIRE(handle > 0);
+
+    constexpr int NUM_CALLS = 3;
+    int32_t a = 3, b = 4;
+    struct veo_args *argps[NUM_CALLS];
+
+    for (int i = 0; i < NUM_CALLS; i++) {
+        argps[i] = veo_args_alloc();
+        veo_args_set_stack(argps[i], VEO_INTENT_IN, 0, (char *)&a, sizeof(a));
+        veo_args_set_stack(argps[i], VEO_INTENT_IN, 1, (char *)&b, sizeof(b));
+    }
+
+    // Two transfers of 4 bytes and a launch
+    constexpr uint64_t CALL_COST = 2 * (10000 + 4) + 100000;
+
+    uint64_t vstart, vend, retval;
+    uint64_t reqid = veo_call_async_by_name(ctx, handle, "add1", argps[0]);
+    veo_context_sync(ctx);
+    REQUIRE(veo_call_peek_vtime(ctx, reqid, &vstart, &vend) == VEO_COMMAND_OK);
+    REQUIRE(vend - vstart == CALL_COST);
+    REQUIRE(veo_call_wait_result(ctx, reqid, &retval) == VEO_COMMAND_OK);
+
+    uint64_t reqids[NUM_CALLS];
+    REQUIRE(veo_call_async_batch_by_name(ctx, handle, "add1", argps, NUM_CALLS,
+                                         reqids) == 0);
+    veo_context_sync(ctx);
+
+    uint64_t batch_start, batch_end;
+    REQUIRE(veo_call_peek_vtime(ctx, reqids[0], &batch_start, &vend) ==
+            VEO_COMMAND_OK);
+    REQUIRE(veo_call_peek_vtime(ctx, reqids[NUM_CALLS - 1], &vstart,
+                                &batch_end) == VEO_COMMAND_OK);
+    REQUIRE(batch_end - batch_start == NUM_CALLS * CALL_COST);
+
+    for (int i = 0; i < NUM_CALLS; i++) {
+        REQUIRE(veo_call_wait_result(ctx, reqids[i], &retval) ==
+                VEO_COMMAND_OK);
+        REQUIRE(retval == 7);
+        veo_args_free(argps[i]);
+    }
+
+    veo_unload_library(proc, handle);
+    veo_context_close(ctx);
+    veo_proc_destroy(proc);
+}